@@ -0,0 +1,350 @@
+#include "prm_def.h"
+#include "matrix_operations.h"
+#include "thread_team.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Dimension of the search: half a suppression matrix. */
+#define CMA_NDIM     8
+
+/* Initial step size, relative to the largest element of the matrix. */
+#define CMA_SIGMA0   0.1
+
+/* Stop when the steps in every direction are below this size (the mean
+ * is kept with its largest element at 1).
+ */
+#define CMA_TOLX     1e-12
+
+/* Stop when the condition number of the covariance exceeds this: the
+ * chi2 is flat along the scale of the delta row (absorbed by k) and the
+ * delta row plus a multiple of the sigma row (absorbed by the shift),
+ * where the distribution keeps widening.
+ */
+#define CMA_CONDMAX  1e14
+
+/* Prototypes. Delta and sigma terms of ROI sites and fit of positions
+ * given by them.
+ */
+roi_terms roi_terms_alloc (const roi_data * rd, int axis, int single);
+
+void roi_terms_free (roi_terms * rt);
+
+void roi_terms_calc (roi_terms * rt, const double * supmat);
+
+kdchi2 roi_terms_fit (const roi_terms * rt, size_t ielem, double dterm);
+
+kdelta positions_calc (const dataset * ds, const double * supmat,
+                       const double * nominal_pos, double * pos);
+
+
+/* Population of a generation shared with the team: every thread
+ * evaluates candidates tid, tid + nthreads, ... on terms of its own.
+ */
+typedef struct
+{
+    roi_terms * terms;          /* Terms of each thread.             */
+    const double * xx;          /* Candidates (CMA_NDIM each).       */
+    double * chi2;              /* Their chi2 (INFINITY if no fit).  */
+    int lambda;                 /* Population size.                  */
+} cma_population;
+
+
+/* Evaluate the candidates of a population taken by thread tid.
+ */
+static void cma_eval_task (void * arg, int tid, int nthreads)
+{
+    cma_population * pop = (cma_population *) arg;
+    roi_terms * rt = &pop->terms[tid];
+    kdchi2 kc;
+
+    for (int kk = tid; kk < pop->lambda; kk += nthreads)
+    {
+        roi_terms_calc(rt, pop->xx + CMA_NDIM * kk);
+        kc = roi_terms_fit(rt, 0, 0.0);
+        pop->chi2[kk] = kc.failed ? INFINITY : kc.chi2;
+    }
+}
+
+
+/* Standard normal deviate (Box-Muller). */
+static double cma_normal (pcg32_random_t * rng)
+{
+    double u1 = 1.0 - pcg_double_r(rng), u2 = pcg_double_r(rng);
+    return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+
+/* Minimize the chi2 of the ROI fit of the half matrix supmat of an axis
+ * by CMA-ES (covariance matrix adaptation), with populations of lambda
+ * candidates evaluated on team. The search runs for neval evaluations,
+ * or for wall seconds if wall is positive, unless it converges before.
+ * supmat receives the best candidate found; its chi2 goes to *chi2 and
+ * the final step size to *sigma_1. Returns the number of evaluations.
+ */
+static size_t cma_es_axis (const dataset * ds, const xbpm_prm * prm,
+                           int axis, double * supmat, int lambda,
+                           size_t neval, double wall, thread_team * team,
+                           pcg32_random_t * rng, double * chi2,
+                           double * sigma_1, size_t * ngen)
+{
+    const int nd = CMA_NDIM;
+    int mu = lambda / 2, ii, jj, kk, ir;
+    double weights[lambda], mueff = 0.0, wsum = 0.0;
+    double mean[CMA_NDIM], old[CMA_NDIM], step[CMA_NDIM], tmp[CMA_NDIM];
+    double cov[CMA_NDIM * CMA_NDIM], bb[CMA_NDIM * CMA_NDIM];
+    double eig[CMA_NDIM * CMA_NDIM], dd[CMA_NDIM];
+    double pc[CMA_NDIM] = {0.0}, ps[CMA_NDIM] = {0.0};
+    double sigma, scale = 0.0, norm_ps, hsig;
+    int rank[lambda];
+    size_t nevals = 0, gen = 0;
+    double t_end = clock_seconds() + wall;
+
+    /* Selection weights and adaptation constants (Hansen's defaults). */
+    for (ii = 0; ii < mu; ii++)
+    {
+        weights[ii] = log(mu + 0.5) - log(ii + 1.0);
+        wsum += weights[ii];
+    }
+    for (ii = 0; ii < mu; ii++)
+    {
+        weights[ii] /= wsum;
+        mueff += weights[ii] * weights[ii];
+    }
+    mueff = 1.0 / mueff;
+
+    double cc    = (4.0 + mueff / nd) / (nd + 4.0 + 2.0 * mueff / nd);
+    double cs    = (mueff + 2.0) / (nd + mueff + 5.0);
+    double c1    = 2.0 / ((nd + 1.3) * (nd + 1.3) + mueff);
+    double cmu   = 2.0 * (mueff - 2.0 + 1.0 / mueff)
+                 / ((nd + 2.0) * (nd + 2.0) + mueff);
+    if (cmu > 1.0 - c1) cmu = 1.0 - c1;
+    double damps = 1.0 + cs
+                 + 2.0 * fmax(0.0, sqrt((mueff - 1.0) / (nd + 1.0)) - 1.0);
+    double chin  = sqrt(nd) * (1.0 - 1.0 / (4.0 * nd)
+                               + 1.0 / (21.0 * nd * nd));
+
+    double * xx = malloc((size_t) lambda * nd * sizeof(double));
+    double * yy = malloc((size_t) lambda * nd * sizeof(double));
+    double * fit = malloc((size_t) lambda * sizeof(double));
+    roi_terms * terms = malloc(team->nthreads * sizeof(roi_terms));
+    if (xx == NULL || yy == NULL || fit == NULL || terms == NULL)
+    {
+        printf(" ERROR (cma_es_axis): could not allocate memory"
+               " for the population. Aborting.\n");
+        exit(-1);
+    }
+    for (ii = 0; ii < team->nthreads; ii++)
+    {
+        terms[ii] = roi_terms_alloc(&ds->rd, axis, prm->single);
+    }
+    cma_population pop = {terms, xx, fit, lambda};
+
+    /* Start at the given matrix, with an isotropic distribution. */
+    memcpy(mean, supmat, sizeof(mean));
+    for (ii = 0; ii < nd; ii++)
+    {
+        if (fabs(mean[ii]) > scale) scale = fabs(mean[ii]);
+    }
+    if (scale == 0.0) scale = 1.0;
+    sigma = CMA_SIGMA0 * scale;
+    for (ii = 0; ii < nd * nd; ii++) cov[ii] = bb[ii] = 0.0;
+    for (ii = 0; ii < nd; ii++)
+    {
+        cov[ii * nd + ii] = bb[ii * nd + ii] = 1.0;
+        dd[ii] = 1.0;
+    }
+
+    roi_terms_calc(&terms[0], supmat);
+    *chi2 = roi_terms_fit(&terms[0], 0, 0.0).chi2;
+
+    for (;;)
+    {
+        if (wall > 0.0 ? clock_seconds() >= t_end : nevals >= neval) break;
+
+        /* Sample: x = mean + sigma B D z. */
+        for (kk = 0; kk < lambda; kk++)
+        {
+            for (jj = 0; jj < nd; jj++) tmp[jj] = dd[jj] * cma_normal(rng);
+            matrix_vector_product(bb, tmp, nd, nd, yy + kk * nd);
+            for (jj = 0; jj < nd; jj++)
+            {
+                xx[kk * nd + jj] = mean[jj] + sigma * yy[kk * nd + jj];
+            }
+        }
+        team_run(team, cma_eval_task, &pop);
+        nevals += lambda;
+        gen++;
+
+        /* Rank the candidates (insertion sort) and keep the best. */
+        for (kk = 0; kk < lambda; kk++)
+        {
+            for (ir = kk; ir > 0 && fit[rank[ir - 1]] > fit[kk]; ir--)
+            {
+                rank[ir] = rank[ir - 1];
+            }
+            rank[ir] = kk;
+        }
+        if (fit[rank[0]] < *chi2)
+        {
+            *chi2 = fit[rank[0]];
+            memcpy(supmat, xx + rank[0] * nd, sizeof(mean));
+        }
+
+        /* New mean and its step. */
+        memcpy(old, mean, sizeof(mean));
+        for (jj = 0; jj < nd; jj++)
+        {
+            mean[jj] = 0.0;
+            for (ii = 0; ii < mu; ii++)
+            {
+                mean[jj] += weights[ii] * xx[rank[ii] * nd + jj];
+            }
+            step[jj] = (mean[jj] - old[jj]) / sigma;
+        }
+
+        /* Evolution paths; C^(-1/2) step = B D^(-1) B^T step. */
+        for (ii = 0; ii < nd; ii++)
+        {
+            tmp[ii] = 0.0;
+            for (jj = 0; jj < nd; jj++) tmp[ii] += bb[jj * nd + ii] * step[jj];
+            tmp[ii] /= dd[ii];
+        }
+        norm_ps = 0.0;
+        for (ii = 0; ii < nd; ii++)
+        {
+            double csum = 0.0;
+            for (jj = 0; jj < nd; jj++) csum += bb[ii * nd + jj] * tmp[jj];
+            ps[ii] = (1.0 - cs) * ps[ii]
+                   + sqrt(cs * (2.0 - cs) * mueff) * csum;
+            norm_ps += ps[ii] * ps[ii];
+        }
+        norm_ps = sqrt(norm_ps);
+        hsig = (norm_ps / sqrt(1.0 - pow(1.0 - cs, 2.0 * gen)) / chin
+                < 1.4 + 2.0 / (nd + 1.0)) ? 1.0 : 0.0;
+        for (ii = 0; ii < nd; ii++)
+        {
+            pc[ii] = (1.0 - cc) * pc[ii]
+                   + hsig * sqrt(cc * (2.0 - cc) * mueff) * step[ii];
+        }
+
+        /* Covariance: rank-one and rank-mu updates. */
+        for (ii = 0; ii < nd; ii++)
+        {
+            for (jj = 0; jj <= ii; jj++)
+            {
+                double cmuij = 0.0;
+                for (kk = 0; kk < mu; kk++)
+                {
+                    cmuij += weights[kk] * yy[rank[kk] * nd + ii]
+                                         * yy[rank[kk] * nd + jj];
+                }
+                cov[ii * nd + jj] = (1.0 - c1 - cmu) * cov[ii * nd + jj]
+                    + c1 * (pc[ii] * pc[jj]
+                            + (1.0 - hsig) * cc * (2.0 - cc)
+                              * cov[ii * nd + jj])
+                    + cmu * cmuij;
+                cov[jj * nd + ii] = cov[ii * nd + jj];
+            }
+        }
+
+        /* Step size. */
+        sigma *= exp((cs / damps) * (norm_ps / chin - 1.0));
+
+        /* C = B D^2 B^T. */
+        memcpy(eig, cov, sizeof(cov));
+        if (symmetric_eigen(eig, tmp, bb, nd) < 0)
+        {
+            printf(" WARNING (cma_es_axis): covariance eigensystem did"
+                   " not converge. Stopping.\n");
+            break;
+        }
+        double dmax = 0.0, dmin = INFINITY;
+        for (ii = 0; ii < nd; ii++)
+        {
+            dd[ii] = sqrt(fmax(tmp[ii], 0.0));
+            if (dd[ii] > dmax) dmax = dd[ii];
+            if (dd[ii] < dmin) dmin = dd[ii];
+        }
+
+        /* The chi2 does not change with the scale of the matrix, along
+         * which the mean would drift: keep its largest element at 1,
+         * scaling the distribution with it. */
+        scale = 0.0;
+        for (ii = 0; ii < nd; ii++)
+        {
+            if (fabs(mean[ii]) > scale) scale = fabs(mean[ii]);
+        }
+        if (scale > 0.0 && isfinite(scale))
+        {
+            for (ii = 0; ii < nd; ii++) mean[ii] /= scale;
+            sigma /= scale;
+        }
+
+        /* Converged (or degenerate) distribution. */
+        if (sigma * dmax < CMA_TOLX || !isfinite(sigma) ||
+            dmax * dmax > CMA_CONDMAX * dmin * dmin) break;
+    }
+
+    for (ii = 0; ii < team->nthreads; ii++) roi_terms_free(&terms[ii]);
+    free(terms);
+    free(xx);
+    free(yy);
+    free(fit);
+
+    *sigma_1 = sigma;
+    *ngen = gen;
+    return nevals;
+}
+
+
+/* Optimize the suppression matrix by CMA-ES, H and V halves one after
+ * the other, each population evaluated in parallel. The halves share the
+ * nrand evaluations, or, if prm->wall is positive, prm->wall seconds.
+ * Random numbers come from streams stream and stream + 1 of the seed.
+ */
+rw_stats cma_es (dataset * ds, xbpm_prm * prm, double * supmat,
+                 double * pos_h, double * pos_v)
+{
+    int lambda = (prm->popsize > 0) ? prm->popsize
+                 : 4 + (int) (3.0 * log((double) CMA_NDIM));
+    int nthreads = (prm->nthreads > 0) ? prm->nthreads : team_cores();
+    if (nthreads > lambda) nthreads = lambda;
+
+    size_t neval[2], ngen[2];
+    double chi2[2], sigma[2];
+    pcg32_random_t rng;
+
+    thread_team * team = team_create(nthreads);
+    for (int axis = 0; axis < 2; axis++)
+    {
+        pcg32_init_r(&rng, prm->seed, prm->stream + axis);
+        neval[axis] = cma_es_axis(ds, prm, axis, supmat + 8 * axis, lambda,
+                                  (axis == 0) ? (prm->nrand + 1) / 2
+                                              : prm->nrand / 2,
+                                  0.5 * prm->wall, team, &rng,
+                                  &chi2[axis], &sigma[axis], &ngen[axis]);
+    }
+    team_destroy(team);
+
+    printf("##### CMA-ES: population %d, %d threads.\n", lambda, nthreads);
+    printf("       generations  evaluations         sigma          chi2\n");
+    printf(" H   %12zu %12zu  %12.4g  %12.6g\n",
+           ngen[0], neval[0], sigma[0], chi2[0]);
+    printf(" V   %12zu %12zu  %12.4g  %12.6g\n\n",
+           ngen[1], neval[1], sigma[1], chi2[1]);
+
+    /* Evaluations are the analogue of trials, selected candidates of
+     * accepted changes. */
+    rw_stats rws = {neval[0], neval[1],
+                    ngen[0] * (size_t) (lambda / 2),
+                    ngen[1] * (size_t) (lambda / 2),
+                    prm->beta, prm->beta, sigma[0], sigma[1],
+                    chi2[0], chi2[1], 0, 0};
+
+    /* Final positions. */
+    positions_calc(ds, supmat,     ds->nom_h, pos_h);
+    positions_calc(ds, supmat + 8, ds->nom_v, pos_v);
+    return rws;
+}
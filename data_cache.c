@@ -0,0 +1,225 @@
+#include "prm_def.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* The ordering of sites is mapped as an array of size_t. */
+_Static_assert(sizeof(size_t) == sizeof(uint64_t),
+               "size_t must be 64 bits wide");
+
+/* Binary columnar data file: a header of DATA_CACHE_HEADER bytes, then
+ * the DATA_COLUMNS columns of nsites doubles each, in the order of the
+ * text files, and the ordering of sites by position (ord_sites, nsites
+ * 64 bit integers). As a cache of a text file, the header identifies
+ * its source by size, modification time and a hash of its first and
+ * last DATA_CACHE_HASHED bytes.
+ */
+typedef struct
+{
+    char magic[8];              /* DATA_CACHE_MAGIC.                 */
+    uint32_t version;           /* DATA_CACHE_VERSION.               */
+    uint32_t ncols;             /* DATA_COLUMNS.                     */
+    uint64_t nsites;            /* Number of sites.                  */
+    uint64_t src_size;          /* Source size (bytes), 0 if none.   */
+    int64_t  src_mtime;         /* Source modification time (ns).    */
+    uint64_t src_hash;          /* Hash of the source ends.          */
+} data_cache_header;
+
+
+/* FNV-1a hash of nn bytes of buf, continuing from hh.
+ */
+static uint64_t fnv1a (uint64_t hh, const unsigned char * buf, size_t nn)
+{
+    for (size_t ii = 0; ii < nn; ii++)
+    {
+        hh = (hh ^ buf[ii]) * 0x100000001b3u;
+    }
+    return hh;
+}
+
+
+/* Fill the source fields of header hd from the text data file src.
+ * Returns 0, or -1 if it could not be read.
+ */
+static int data_cache_source (const char * src, data_cache_header * hd)
+{
+    struct stat st;
+    unsigned char buf[DATA_CACHE_HASHED];
+    uint64_t hh = 0xcbf29ce484222325u;
+    ssize_t nr;
+    int fd = open(src, O_RDONLY);
+
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    hd->src_size  = (uint64_t) st.st_size;
+    hd->src_mtime = (int64_t) st.st_mtim.tv_sec * 1000000000
+                  + (int64_t) st.st_mtim.tv_nsec;
+
+    nr = pread(fd, buf, sizeof(buf), 0);
+    if (nr > 0) hh = fnv1a(hh, buf, (size_t) nr);
+    if (st.st_size > (off_t) sizeof(buf))
+    {
+        nr = pread(fd, buf, sizeof(buf), st.st_size - (off_t) sizeof(buf));
+        if (nr > 0) hh = fnv1a(hh, buf, (size_t) nr);
+    }
+    hd->src_hash = hh;
+    close(fd);
+    return 0;
+}
+
+
+/* Size of a binary data file of nsites sites. */
+static size_t data_cache_size (size_t nsites)
+{
+    return DATA_CACHE_HEADER
+         + (DATA_COLUMNS * sizeof(double) + sizeof(uint64_t)) * nsites;
+}
+
+
+/* Whether the nn entries of ord are a permutation of 0 to nn - 1.
+ */
+static int data_cache_permutation (const size_t * ord, size_t nn)
+{
+    unsigned char * seen = calloc(nn / 8 + 1, 1);
+    size_t ii;
+
+    if (seen == NULL)
+    {
+        printf(" ERROR (data_cache_open): could not allocate memory"
+               " for the check of the site ordering. Aborting.\n");
+        exit(-1);
+    }
+    for (ii = 0; ii < nn; ii++)
+    {
+        size_t io = ord[ii];
+        if (io >= nn || (seen[io / 8] & (1u << (io % 8)))) break;
+        seen[io / 8] |= (unsigned char) (1u << (io % 8));
+    }
+    free(seen);
+    return ii == nn;
+}
+
+
+/* Map the binary data file path into ds: the columns and ord_sites
+ * point into the mapping (ds->map), nothing is copied. With a source
+ * src, the file must be its cache and match it. Returns 0, or -1 if
+ * path is not a (valid, matching) binary data file. A file whose site
+ * ordering is not a permutation of the sites aborts the run, unless it
+ * is a cache, which is then ignored.
+ */
+int data_cache_open (const char * path, const char * src, dataset * ds)
+{
+    data_cache_header hd, sh;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) != 0 ||
+        pread(fd, &hd, sizeof(hd), 0) != (ssize_t) sizeof(hd) ||
+        memcmp(hd.magic, DATA_CACHE_MAGIC, sizeof(hd.magic)) != 0 ||
+        hd.version != DATA_CACHE_VERSION || hd.ncols != DATA_COLUMNS ||
+        hd.nsites == 0 ||
+        (size_t) st.st_size != data_cache_size((size_t) hd.nsites))
+    {
+        close(fd);
+        return -1;
+    }
+    if (src != NULL &&
+        (data_cache_source(src, &sh) != 0 ||
+         sh.src_size  != hd.src_size  || sh.src_mtime != hd.src_mtime ||
+         sh.src_hash  != hd.src_hash))
+    {
+        close(fd);
+        return -1;
+    }
+
+    size_t size = (size_t) st.st_size, nn = (size_t) hd.nsites;
+    void * map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    double * col = (double *) ((char *) map + DATA_CACHE_HEADER);
+    if (!data_cache_permutation((const size_t *) (col + DATA_COLUMNS * nn),
+                                nn))
+    {
+        munmap(map, size);
+        if (src != NULL)
+        {
+            printf(" WARNING (data_cache_open): invalid site ordering in"
+                   " cache %s; it is rebuilt.\n\n", path);
+            return -1;
+        }
+        printf(" ERROR (data_cache_open): invalid site ordering in"
+               " binary data file %s. Aborting.\n", path);
+        exit(-1);
+    }
+    ds->nsites    = nn;
+    ds->nom_h     = col;
+    ds->nom_v     = col + nn;
+    ds->to        = col + 2 * nn;
+    ds->sto       = col + 3 * nn;
+    ds->ti        = col + 4 * nn;
+    ds->sti       = col + 5 * nn;
+    ds->bi        = col + 6 * nn;
+    ds->sbi       = col + 7 * nn;
+    ds->bo        = col + 8 * nn;
+    ds->sbo       = col + 9 * nn;
+    ds->ord_sites = (size_t *) (col + DATA_COLUMNS * nn);
+    ds->map       = map;
+    ds->map_size  = size;
+    return 0;
+}
+
+
+/* Write the data of ds and its ordering of sites to the binary data
+ * file path, through a temporary file renamed at the end, so that a
+ * partial file is never read. With a source src, the file is its cache.
+ * Returns 0, or -1 if it could not be written.
+ */
+int data_cache_write (const char * path, const char * src,
+                      const dataset * ds)
+{
+    data_cache_header hd;
+    char tmp[300], pad[DATA_CACHE_HEADER];
+    const double * col[DATA_COLUMNS] = {ds->nom_h, ds->nom_v, ds->to,
+                                        ds->sto, ds->ti, ds->sti, ds->bi,
+                                        ds->sbi, ds->bo, ds->sbo};
+    size_t nn = ds->nsites;
+    int ok;
+
+    memset(&hd, 0, sizeof(hd));
+    memcpy(hd.magic, DATA_CACHE_MAGIC, sizeof(hd.magic));
+    hd.version = DATA_CACHE_VERSION;
+    hd.ncols   = DATA_COLUMNS;
+    hd.nsites  = nn;
+    if (src != NULL && data_cache_source(src, &hd) != 0) return -1;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int) getpid());
+    FILE * fc = fopen(tmp, "wb");
+    if (fc == NULL) return -1;
+
+    memset(pad, 0, sizeof(pad));
+    memcpy(pad, &hd, sizeof(hd));
+    ok = (fwrite(pad, sizeof(pad), 1, fc) == 1);
+    for (int jc = 0; jc < DATA_COLUMNS && ok; jc++)
+    {
+        ok = (fwrite(col[jc], sizeof(double), nn, fc) == nn);
+    }
+    if (ok) ok = (fwrite(ds->ord_sites, sizeof(size_t), nn, fc) == nn);
+    ok = (fclose(fc) == 0) && ok;
+
+    if (!ok || rename(tmp, path) != 0)
+    {
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
@@ -1,7 +1,24 @@
 #include "prm_def.h"
+#include "thread_team.h"
+#include <fcntl.h>
+#include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Prototypes. Binary columnar data files. */
+int data_cache_open (const char * path, const char * src, dataset * ds);
+
+int data_cache_write (const char * path, const char * src,
+                      const dataset * ds);
+
+/* Prototypes. NumPy .npy files. */
+int npy_is (const char * path);
+
+double * npy_read (const char * path, int * ndim, size_t * shape);
 
 
 /* Return the minimum and maximum values of a vector vv of size nn.
@@ -40,70 +57,13 @@ int site_visited (size_t * idx, size_t ic, size_t ivisit)
 }
 
 
-/* Exchange the values of two integer variables (a and b).
- */
-void exchange_values(size_t * a, size_t * b)
-{
-    size_t tmp = *a;
-    *a = *b;
-    *b = tmp;
-}
-
-
-/* Given two arrays, hh and vv, with horizontal and vertical positions
- * of each site (out of nsites) _on a grid_, return an index array idx
- * of integers which maps the order through lines and columns
- * (from lower lines and columns to higher ones). It is supposed that 
- * positions given by the same index are correlated, namely, hh[i] and vv[i]
- * correspond to the same site.
+/* Line or column index xx of a grid of nn, clamped to [0, nn].
  */
-size_t * index_order_by_position (double * hh, double * vv, size_t nsites)
+static size_t grid_index (double xx, size_t nn)
 {
-    double next_h, next_v;
-    size_t ic, jj, inext, icurr;
-    
-    /* Initialize index array. */
-    size_t * idx = calloc(nsites, sizeof(size_t));
-    if (idx == NULL)
-    {
-        printf(" ERROR (index_order_by_position):"
-            " could not allocate memory for index array. Aborting.\n");
-        exit(-1);
-    }
-
-    for (ic = 0; ic < nsites; ic++)
-    {
-        idx[ic] = ic;
-    }
-
-    /* Run through coordinate arrays. */
-    next_h = hh[0];
-    next_v = vv[0];
-    for (ic = 1; ic < nsites; ic++)
-    {
-        icurr = ic;
-        next_h =  hh[ic];
-        next_v =  vv[ic];
-        // inext  = idx[ic];
-        for (jj = ic + 1; jj < nsites; jj++)
-        {
-            inext = idx[jj];
-            /* Next horizontal coordinate is lesser than previous one. */
-            if (hh[inext] <= next_h)
-            {
-                /* Next vertical coordinate is lesser than previous one. */
-                if (vv[inext] < next_v)  /* Guarantee no short circuit. */
-                {
-                    next_h = hh[inext];
-                    next_v = vv[inext];
-                    icurr = inext;
-                }
-            }
-        }
-        /* Rearrange order in index array. */
-        exchange_values(&idx[ic], &idx[icurr]);
-    }
-    return idx;
+    if (!(xx > 0.0)) return 0;
+    if (xx > (double) nn) return nn;
+    return (size_t) xx;
 }
 
 
@@ -144,9 +104,46 @@ roi_struct roi_indexation (const dataset * ds, xbpm_prm * prm)
         exit(-1);
     }
 
-    /* Run through all sites. */
+    /* On a regular grid, only the lines and columns spanning the ROI
+     * (and one more on each side, for positions within the tolerance)
+     * are run through. */
     size_t icount = 0;
-    for (ii = 0; ii < ds->nsites; ii++)
+    const grid_info * gr = &ds->grid;
+    if (gr->regular)
+    {
+        size_t ix0 = 0, ix1 = gr->nx, iy0 = 0, iy1 = gr->ny, ix, iy;
+        if (gr->dh > 0.0)
+        {
+            ix0 = grid_index(floor((prm->roi_from - gr->h0) / gr->dh) - 1,
+                             gr->nx);
+            ix1 = grid_index(ceil((prm->roi_to - gr->h0) / gr->dh) + 2,
+                             gr->nx);
+        }
+        if (gr->dv > 0.0)
+        {
+            iy0 = grid_index(floor((prm->roi_from - gr->v0) / gr->dv) - 1,
+                             gr->ny);
+            iy1 = grid_index(ceil((prm->roi_to - gr->v0) / gr->dv) + 2,
+                             gr->ny);
+        }
+        for (iy = iy0; iy < iy1; iy++)
+        {
+            for (ix = ix0; ix < ix1; ix++)
+            {
+                ord_idx = ds->ord_sites[iy * gr->nx + ix];
+                if (ds->nom_h[ord_idx] >= prm->roi_from &&
+                    ds->nom_h[ord_idx] <= prm->roi_to &&
+                    ds->nom_v[ord_idx] >= prm->roi_from &&
+                    ds->nom_v[ord_idx] <= prm->roi_to)
+                {
+                    roisite[icount++] = ord_idx;
+                }
+            }
+        }
+    }
+
+    /* Otherwise, run through all sites. */
+    for (ii = 0; ii < ds->nsites && !gr->regular; ii++)
     {
         /* Index of grid-ordered sites. */
         ord_idx = ds->ord_sites[ii];
@@ -174,11 +171,324 @@ roi_struct roi_indexation (const dataset * ds, xbpm_prm * prm)
 }
 
 
-/* Read matrix from file.
+/* Build a compacted copy of the ROI data of ds, for the sites indexed by
+ * roi. All columns are carved out of one aligned allocation.
+ */
+roi_data roi_data_build (const dataset * ds, const roi_struct * roi)
+{
+    roi_data rd;
+    size_t ii, idx;
+
+    rd.nsites = roi->nsites;
+    rd.npad   = ((roi->nsites + ROI_PAD - 1) / ROI_PAD) * ROI_PAD;
+    if (rd.npad == 0) rd.npad = ROI_PAD;
+
+    /* Six double and four single precision columns. */
+    size_t arena_size = 6 * rd.npad * sizeof(double)
+                      + 4 * rd.npad * sizeof(float);
+    rd.arena = aligned_alloc(ROI_ALIGN, arena_size);
+    if (rd.arena == NULL)
+    {
+        printf(" ERROR (roi_data_build):"
+            " could not allocate memory for ROI data. Aborting.\n");
+        exit(-1);
+    }
+    memset(rd.arena, 0, arena_size);
+
+    rd.nom_h = (double *) rd.arena;
+    rd.nom_v = rd.nom_h + rd.npad;
+    rd.to    = rd.nom_v + rd.npad;
+    rd.ti    = rd.to    + rd.npad;
+    rd.bi    = rd.ti    + rd.npad;
+    rd.bo    = rd.bi    + rd.npad;
+    rd.fto   = (float *) (rd.bo + rd.npad);
+    rd.fti   = rd.fto   + rd.npad;
+    rd.fbi   = rd.fti   + rd.npad;
+    rd.fbo   = rd.fbi   + rd.npad;
+
+    for (ii = 0; ii < roi->nsites; ii++)
+    {
+        idx = roi->idx[ii];
+        rd.nom_h[ii] = ds->nom_h[idx];
+        rd.nom_v[ii] = ds->nom_v[idx];
+        rd.to[ii]    = ds->to[idx];
+        rd.ti[ii]    = ds->ti[idx];
+        rd.bi[ii]    = ds->bi[idx];
+        rd.bo[ii]    = ds->bo[idx];
+        rd.fto[ii]   = (float) rd.to[ii];
+        rd.fti[ii]   = (float) rd.ti[ii];
+        rd.fbi[ii]   = (float) rd.bi[ii];
+        rd.fbo[ii]   = (float) rd.bo[ii];
+    }
+    return rd;
+}
+
+
+/* Comparison of doubles for qsort. */
+static int compare_doubles (const void * a, const void * b)
+{
+    double da = *(const double *) a, db = *(const double *) b;
+    return (da > db) - (da < db);
+}
+
+
+/* Sort the nn values vals and merge those closer than tol to the former
+ * one. Returns the number of distinct values left at the start of vals.
+ */
+static size_t distinct_values (double * vals, size_t nn, double tol)
+{
+    size_t ii, nu = 0;
+    if (nn == 0) return 0;
+    qsort(vals, nn, sizeof(double), compare_doubles);
+    for (ii = 1; ii < nn; ii++)
+    {
+        if (vals[ii] - vals[nu] > tol) vals[++nu] = vals[ii];
+    }
+    return nu + 1;
+}
+
+
+/* Rank of value xx among the nu distinct sorted values uniq (the index
+ * of the first of them not below xx - tol).
+ */
+static size_t value_rank (const double * uniq, size_t nu, double xx,
+                          double tol)
+{
+    size_t lo = 0, hi = nu;
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (uniq[mid] < xx - tol) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+
+/* Site of the ordering by position: ranks of its vertical and
+ * horizontal positions, and its index. */
+typedef struct
+{
+    size_t rv, rh, idx;
+} site_key;
+
+static int compare_site_keys (const void * a, const void * b)
+{
+    const site_key * ka = (const site_key *) a, * kb = (const site_key *) b;
+    if (ka->rv != kb->rv) return (ka->rv > kb->rv) - (ka->rv < kb->rv);
+    if (ka->rh != kb->rh) return (ka->rh > kb->rh) - (ka->rh < kb->rh);
+    return (ka->idx > kb->idx) - (ka->idx < kb->idx);
+}
+
+
+/* Given two arrays, hh and vv, with horizontal and vertical positions
+ * of each site (out of nsites) _on a grid_, return an index array idx
+ * of integers which maps the order through lines and columns
+ * (from lower lines and columns to higher ones). It is supposed that
+ * positions given by the same index are correlated, namely, hh[i] and vv[i]
+ * correspond to the same site.
+ * Positions closer than GRID_TOL of the span are the same line or column:
+ * sites are ranked by their distinct vertical and horizontal positions,
+ * and sorted by these ranks (then by index), in O(n log n).
+ */
+size_t * index_order_by_position (double * hh, double * vv, size_t nsites)
+{
+    size_t ic, nh, nv;
+
+    /* Initialize index array. */
+    size_t * idx = calloc(nsites + 1, sizeof(size_t));
+    site_key * key = calloc(nsites + 1, sizeof(site_key));
+    double * uh = calloc(nsites + 1, sizeof(double));
+    double * uv = calloc(nsites + 1, sizeof(double));
+    if (idx == NULL || key == NULL || uh == NULL || uv == NULL)
+    {
+        printf(" ERROR (index_order_by_position):"
+            " could not allocate memory for index array. Aborting.\n");
+        exit(-1);
+    }
+
+    /* Distinct lines and columns. */
+    minmax mh = min_and_max(hh, nsites);
+    minmax mv = min_and_max(vv, nsites);
+    double tol = GRID_TOL * ((mh.max - mh.min > mv.max - mv.min)
+                             ? mh.max - mh.min : mv.max - mv.min);
+    memcpy(uh, hh, nsites * sizeof(double));
+    memcpy(uv, vv, nsites * sizeof(double));
+    nh = distinct_values(uh, nsites, tol);
+    nv = distinct_values(uv, nsites, tol);
+
+    /* Sort by line, then column. */
+    for (ic = 0; ic < nsites; ic++)
+    {
+        key[ic].rv  = value_rank(uv, nv, vv[ic], tol);
+        key[ic].rh  = value_rank(uh, nh, hh[ic], tol);
+        key[ic].idx = ic;
+    }
+    qsort(key, nsites, sizeof(site_key), compare_site_keys);
+    for (ic = 0; ic < nsites; ic++)
+    {
+        idx[ic] = key[ic].idx;
+    }
+
+    free(key);
+    free(uh);
+    free(uv);
+    return idx;
+}
+
+
+/* Regular grid of the sites of ds, in the order of ds->ord_sites: the
+ * sites are a full lattice of nx columns by ny lines if the first line
+ * has nx sites, there are ny = nsites / nx lines, and every site is at
+ * (h0 + ix dh, v0 + iy dv) within GRID_TOL of the span. Otherwise the
+ * grid is not regular.
+ */
+grid_info grid_infer (const dataset * ds)
+{
+    grid_info gr;
+    const size_t * ord = ds->ord_sites;
+    size_t nn = ds->nsites, ix, iy;
+
+    memset(&gr, 0, sizeof(gr));
+    if (nn == 0) return gr;
+
+    minmax mh = min_and_max(ds->nom_h, nn);
+    minmax mv = min_and_max(ds->nom_v, nn);
+    double tol = GRID_TOL * ((mh.max - mh.min > mv.max - mv.min)
+                             ? mh.max - mh.min : mv.max - mv.min);
+
+    gr.h0 = ds->nom_h[ord[0]];
+    gr.v0 = ds->nom_v[ord[0]];
+    for (gr.nx = 1; gr.nx < nn; gr.nx++)
+    {
+        if (fabs(ds->nom_v[ord[gr.nx]] - gr.v0) > tol) break;
+    }
+    if (nn % gr.nx != 0) return gr;
+    gr.ny = nn / gr.nx;
+    if (gr.nx > 1)
+        gr.dh = (ds->nom_h[ord[gr.nx - 1]] - gr.h0) / (double) (gr.nx - 1);
+    if (gr.ny > 1)
+        gr.dv = (ds->nom_v[ord[(gr.ny - 1) * gr.nx]] - gr.v0)
+              / (double) (gr.ny - 1);
+
+    for (iy = 0; iy < gr.ny; iy++)
+    {
+        for (ix = 0; ix < gr.nx; ix++)
+        {
+            size_t is = ord[iy * gr.nx + ix];
+            if (fabs(ds->nom_h[is] - gr.h0 - (double) ix * gr.dh) > tol ||
+                fabs(ds->nom_v[is] - gr.v0 - (double) iy * gr.dv) > tol)
+                return gr;
+        }
+    }
+    gr.regular = 1;
+    return gr;
+}
+
+
+/* Stratified subsample of the ROI sites roi: every stride-th row and
+ * column of the grid. Rows and columns are ranked by the distinct
+ * vertical and horizontal nominal positions of the ROI, thus the order
+ * of the sites does not matter; the order of roi is kept.
+ */
+roi_struct roi_subsample (const dataset * ds, const roi_struct * roi,
+                          size_t stride)
+{
+    roi_struct sub = {NULL, 0};
+    size_t ii, nh, nv, idx;
+
+    double * uh = calloc(roi->nsites + 1, sizeof(double));
+    double * uv = calloc(roi->nsites + 1, sizeof(double));
+    sub.idx = calloc(roi->nsites + 1, sizeof(size_t));
+    if (uh == NULL || uv == NULL || sub.idx == NULL)
+    {
+        printf(" ERROR (roi_subsample):"
+            " could not allocate memory for ROI levels. Aborting.\n");
+        exit(-1);
+    }
+
+    for (ii = 0; ii < roi->nsites; ii++)
+    {
+        uh[ii] = ds->nom_h[roi->idx[ii]];
+        uv[ii] = ds->nom_v[roi->idx[ii]];
+    }
+    /* Positions closer than GRID_TOL of the ROI span are the same. */
+    double tol = 0.0;
+    if (roi->nsites > 0)
+    {
+        minmax mh = min_and_max(uh, roi->nsites);
+        minmax mv = min_and_max(uv, roi->nsites);
+        tol = GRID_TOL * ((mh.max - mh.min > mv.max - mv.min)
+                        ? mh.max - mh.min : mv.max - mv.min);
+    }
+    nh = distinct_values(uh, roi->nsites, tol);
+    nv = distinct_values(uv, roi->nsites, tol);
+
+    for (ii = 0; ii < roi->nsites; ii++)
+    {
+        idx = roi->idx[ii];
+        if (value_rank(uh, nh, ds->nom_h[idx], tol) % stride == 0 &&
+            value_rank(uv, nv, ds->nom_v[idx], tol) % stride == 0)
+        {
+            sub.idx[sub.nsites++] = idx;
+        }
+    }
+
+    free(uh);
+    free(uv);
+    return sub;
+}
+
+
+/* Build the coarse ROI levels of the schedule in prm, from the coarsest
+ * to the finest, and print the schedule.
+ */
+void roi_levels_build (dataset * ds, const xbpm_prm * prm)
+{
+    double frac = 1.0;
+
+    ds->nlevels = prm->nlevels;
+    if (prm->nlevels == 0) return;
+
+    printf("##### ROI levels:\n");
+    for (int il = 0; il < prm->nlevels; il++)
+    {
+        ds->level_roi[il] = roi_subsample(ds, &ds->roi,
+                                          prm->level_stride[il]);
+        ds->level_rd[il]  = roi_data_build(ds, &ds->level_roi[il]);
+        frac -= prm->level_frac[il];
+        printf("  stride %2zu : %8zu sites, %5.1lf %% of the trials\n",
+               prm->level_stride[il], ds->level_roi[il].nsites,
+               100.0 * prm->level_frac[il]);
+    }
+    printf("  full ROI  : %8zu sites, %5.1lf %% of the trials\n\n",
+           ds->roi.nsites, 100.0 * frac);
+}
+
+
+/* Read matrix from file: text, or a .npy array of 16 numbers (4 x 4).
  */
 void matrix_read(char * matfile, double * mat)
 {
     size_t ii;
+
+    if (npy_is(matfile))
+    {
+        size_t shape[NPY_DIMS_MAX], nn = 1;
+        int ndim;
+        double * arr = npy_read(matfile, &ndim, shape);
+        for (int id = 0; id < ndim; id++) nn *= shape[id];
+        if (nn != 16)
+        {
+            printf(" ERROR (matrix_read): '%s' holds %zu numbers, not a"
+                   " 4 x 4 matrix. Aborting.\n", matfile, nn);
+            exit(-1);
+        }
+        memcpy(mat, arr, 16 * sizeof(double));
+        free(arr);
+        return;
+    }
+
     FILE * df = fopen(matfile, "r");
 
     for(ii = 0; ii < 4; ii++)
@@ -195,80 +505,409 @@ void matrix_read(char * matfile, double * mat)
 }
 
 
-/* Read data from file.
+/* Exact powers of ten of the fast path of parse_double. */
+static const double pow10_exact[23] =
+{
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+
+/* Parse a number at *pp (up to end), independently of the locale, and
+ * move *pp past it. Numbers of up to 15 significant digits and decimal
+ * exponents up to 22 are converted exactly as strtod would (the mantissa
+ * and the power of ten are exact doubles, so is the rounding of their
+ * product or quotient); others, of up to 63 characters, are passed on
+ * to strtod. Returns 0, or -1 if there is no number at *pp.
  */
-dataset data_read(xbpm_prm * prm)
+static int parse_double (const char ** pp, const char * end, double * val)
 {
-    FILE * df = fopen(prm->datafile, "r");
-    char line[MAX_LINE];
-    char * pd, * parse;
-    dataset ds;
-    size_t nsite = 0;
-    
+    const char * p = *pp, * start = *pp;
+    uint64_t mant = 0;
+    int ndig = 0, dexp = 0, eexp = 0, neg = 0, eneg = 0, digits = 0;
+    char buf[64];
+
+    if (p < end && (*p == '-' || *p == '+')) neg = (*p++ == '-');
+    for (; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+    {
+        if (ndig < 19)
+        {
+            mant = 10 * mant + (uint64_t) (*p - '0');
+            ndig += (mant > 0);
+        }
+        else
+        {
+            dexp++;
+        }
+    }
+    if (p < end && *p == '.')
+    {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+        {
+            if (ndig < 19)
+            {
+                mant = 10 * mant + (uint64_t) (*p - '0');
+                ndig += (mant > 0);
+                dexp--;
+            }
+        }
+    }
+    if (digits == 0) goto slow;
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        const char * q = p + 1;
+        if (q < end && (*q == '-' || *q == '+')) eneg = (*q++ == '-');
+        if (q >= end || *q < '0' || *q > '9') goto slow;
+        for (; q < end && *q >= '0' && *q <= '9'; q++)
+        {
+            if (eexp < 100000) eexp = 10 * eexp + (*q - '0');
+        }
+        p = q;
+    }
+    if (p < end && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+        goto slow;
+
+    dexp += eneg ? -eexp : eexp;
+    if (ndig > 15 || dexp < -22 || dexp > 22) goto slow;
+
+    *val = (double) mant;
+    *val = (dexp < 0) ? *val / pow10_exact[-dexp] : *val * pow10_exact[dexp];
+    if (neg) *val = -*val;
+    *pp = p;
+    return 0;
+
+    /* Long mantissas, large exponents, inf, nan: copy the field. */
+slow:
+    p = start;
+    size_t nn = 0;
+    while (p + nn < end && nn < sizeof(buf) - 1 && p[nn] != ' ' &&
+           p[nn] != '\t' && p[nn] != '\n' && p[nn] != '\r') nn++;
+    if (nn == 0) return -1;
+
+    /* A field too long for buf is an error, not a number and the rest
+     * of it as the next one. */
+    if (nn == sizeof(buf) - 1 && p + nn < end && p[nn] != ' ' &&
+        p[nn] != '\t' && p[nn] != '\n' && p[nn] != '\r') return -1;
+    memcpy(buf, p, nn);
+    buf[nn] = '\0';
+    char * q;
+    *val = strtod(buf, &q);
+    if (q != buf + nn) return -1;
+    *pp = p + nn;
+    return 0;
+}
+
+
+/* Line aligned chunk of a mapped data file, for a thread. */
+typedef struct
+{
+    const char * beg, * end;    /* Bounds, at line starts.            */
+    size_t nrows;               /* Rows (non blank lines) in it.      */
+    size_t first;               /* Index of its first row.            */
+    size_t bad;                 /* First row failing to parse, + 1.   */
+} data_chunk;
+
+/* Chunks of a data file shared with the team's threads. */
+typedef struct
+{
+    data_chunk * chunk;
+    int nchunks;
+    double * col[DATA_COLUMNS]; /* Destination of each column.        */
+    int parse;                  /* 0: count the rows, 1: parse them.  */
+} data_load;
+
+
+/* Count (parse == 0) or parse the rows of the chunks of a data file;
+ * thread tid takes chunks tid, tid + nthreads, ... Lines of blanks only
+ * are skipped, and columns after the tenth ignored.
+ */
+static void data_load_task (void * arg, int tid, int nthreads)
+{
+    data_load * ld = (data_load *) arg;
+
+    for (int ic = tid; ic < ld->nchunks; ic += nthreads)
+    {
+        data_chunk * ch = &ld->chunk[ic];
+        const char * p = ch->beg, * eol;
+        size_t irow = ch->first;
+
+        if (!ld->parse) ch->nrows = 0;
+        for (; p < ch->end; p = eol + 1)
+        {
+            eol = memchr(p, '\n', (size_t) (ch->end - p));
+            if (eol == NULL) eol = ch->end;
+
+            while (p < eol && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+            if (p == eol) continue;
+            if (!ld->parse)
+            {
+                ch->nrows++;
+                continue;
+            }
+
+            for (int jc = 0; jc < DATA_COLUMNS; jc++)
+            {
+                while (p < eol && (*p == ' ' || *p == '\t')) p++;
+                if (parse_double(&p, eol, &ld->col[jc][irow]) != 0)
+                {
+                    if (ch->bad == 0) ch->bad = irow + 1;
+                    break;
+                }
+            }
+            irow++;
+        }
+    }
+}
+
+
+/* Read the text data file of prm into ds: the file is mapped, split
+ * into line aligned chunks (one per thread for large files), its rows
+ * counted, and then parsed straight into the data arrays.
+ */
+static void data_read_text (const xbpm_prm * prm, dataset * ds)
+{
+    struct stat st;
+    size_t size;
+    int fd = open(prm->datafile, O_RDONLY);
+
     /* Check when opening data file. */
-    if (df == NULL)
+    if (fd < 0 || fstat(fd, &st) != 0)
     {
         perror(prm->datafile);
         printf("##### (data_read) file: '%s'\n"
             "ERROR: Aborting.\n\n", prm->datafile);
             exit(-1);
     }
+    size = (size_t) st.st_size;
+    if (size == 0)
+    {
+        printf(" ERROR (data_read): data file '%s' is empty."
+            " Aborting.\n", prm->datafile);
+        exit(-1);
+    }
+    const char * map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror(prm->datafile);
+        printf(" ERROR (data_read): could not map data file '%s'."
+            " Aborting.\n", prm->datafile);
+        exit(-1);
+    }
+    madvise((void *) map, size, MADV_SEQUENTIAL);
+
+    /* Chunks, of at least DATA_CHUNK_MIN bytes. */
+    int nthreads = (prm->nthreads > 0) ? prm->nthreads : team_cores();
+    if ((size_t) nthreads > size / DATA_CHUNK_MIN)
+        nthreads = (int) (size / DATA_CHUNK_MIN);
+    if (nthreads < 1) nthreads = 1;
+
+    data_load ld;
+    ld.nchunks = nthreads;
+    ld.chunk   = calloc(nthreads, sizeof(data_chunk));
+    if (ld.chunk == NULL)
+    {
+        printf(" ERROR (data_read): could not allocate memory"
+            " for data chunks. Aborting.\n");
+        exit(-1);
+    }
+    for (int ic = 0; ic < nthreads; ic++)
+    {
+        const char * p = map + (size / nthreads) * ic;
+        if (ic > 0)
+        {
+            p = memchr(p - 1, '\n', (size_t) (map + size - p + 1));
+            p = (p == NULL) ? map + size : p + 1;
+        }
+        ld.chunk[ic].beg = p;
+        if (ic > 0) ld.chunk[ic - 1].end = p;
+    }
+    ld.chunk[nthreads - 1].end = map + size;
 
-    /* Allocate space for data. */
-    ds.nsites = prm->nsites;
-
-    ds.nom_h = calloc(prm->nsites, sizeof(double));
-    ds.nom_v = calloc(prm->nsites, sizeof(double));
-
-    ds.to    = calloc(prm->nsites, sizeof(double));
-    ds.ti    = calloc(prm->nsites, sizeof(double));
-    ds.bi    = calloc(prm->nsites, sizeof(double));
-    ds.bo    = calloc(prm->nsites, sizeof(double));
+    /* Count the rows of each chunk, then parse them. */
+    thread_team * team = (nthreads > 1) ? team_create(nthreads) : NULL;
+    ld.parse = 0;
+    if (team != NULL) team_run(team, data_load_task, &ld);
+    else              data_load_task(&ld, 0, 1);
 
-    ds.sto   = calloc(prm->nsites, sizeof(double));
-    ds.sti   = calloc(prm->nsites, sizeof(double));
-    ds.sbi   = calloc(prm->nsites, sizeof(double));
-    ds.sbo   = calloc(prm->nsites, sizeof(double));
+    ds->nsites = 0;
+    for (int ic = 0; ic < nthreads; ic++)
+    {
+        ld.chunk[ic].first = ds->nsites;
+        ds->nsites += ld.chunk[ic].nrows;
+    }
+    if (ds->nsites == 0)
+    {
+        printf(" ERROR (data_read): no data in file '%s'. Aborting.\n",
+            prm->datafile);
+        exit(-1);
+    }
 
-    if (ds.nom_h == NULL || ds.nom_v == NULL ||
-        ds.to    == NULL || ds.ti    == NULL ||
-        ds.bi    == NULL || ds.bo    == NULL ||
-        ds.sto   == NULL || ds.sti   == NULL ||
-        ds.sbi   == NULL || ds.sbo   == NULL)
+    /* Allocate space for data. */
+    ds->nom_h = calloc(ds->nsites, sizeof(double));
+    ds->nom_v = calloc(ds->nsites, sizeof(double));
+
+    ds->to    = calloc(ds->nsites, sizeof(double));
+    ds->ti    = calloc(ds->nsites, sizeof(double));
+    ds->bi    = calloc(ds->nsites, sizeof(double));
+    ds->bo    = calloc(ds->nsites, sizeof(double));
+
+    ds->sto   = calloc(ds->nsites, sizeof(double));
+    ds->sti   = calloc(ds->nsites, sizeof(double));
+    ds->sbi   = calloc(ds->nsites, sizeof(double));
+    ds->sbo   = calloc(ds->nsites, sizeof(double));
+
+    if (ds->nom_h == NULL || ds->nom_v == NULL ||
+        ds->to    == NULL || ds->ti    == NULL ||
+        ds->bi    == NULL || ds->bo    == NULL ||
+        ds->sto   == NULL || ds->sti   == NULL ||
+        ds->sbi   == NULL || ds->sbo   == NULL)
     {
         printf(" ERROR (data_read): could not allocate memory"
             " for data arrays. Aborting.\n");
         exit(-1);
     }
 
-    while (fgets(line, sizeof(line), df) != NULL)
+    /* Columns: positions, then current and deviation of each blade. */
+    double * col[DATA_COLUMNS] = {ds->nom_h, ds->nom_v, ds->to, ds->sto,
+                                  ds->ti, ds->sti, ds->bi, ds->sbi,
+                                  ds->bo, ds->sbo};
+    memcpy(ld.col, col, sizeof(col));
+    ld.parse = 1;
+    if (team != NULL) team_run(team, data_load_task, &ld);
+    else              data_load_task(&ld, 0, 1);
+    if (team != NULL) team_destroy(team);
+
+    for (int ic = 0; ic < nthreads; ic++)
+    {
+        if (ld.chunk[ic].bad == 0) continue;
+        printf(" ERROR (data_read): row %zu of data file '%s' does not"
+            " have %d numbers. Aborting.\n", ld.chunk[ic].bad,
+            prm->datafile, DATA_COLUMNS);
+        exit(-1);
+    }
+    free(ld.chunk);
+    munmap((void *) map, size);
+    printf("##### Data: %zu sites read (%d thread%s).\n\n", ds->nsites,
+           nthreads, (nthreads > 1) ? "s" : "");
+}
+
+
+/* Read the .npy data file of prm into ds: an array of nsites rows of
+ * the DATA_COLUMNS columns of text files (or its transpose, DATA_COLUMNS
+ * rows of nsites), of any type npy_read converts.
+ */
+static void data_read_npy (const xbpm_prm * prm, dataset * ds)
+{
+    size_t shape[NPY_DIMS_MAX], nn, ii;
+    int ndim, jc, rows;
+    double * arr = npy_read(prm->datafile, &ndim, shape);
+
+    if (ndim != 2 || (shape[1] != DATA_COLUMNS && shape[0] != DATA_COLUMNS)
+        || shape[0] * shape[1] == 0)
+    {
+        printf(" ERROR (data_read): '%s' must be an array of n x %d (or"
+               " %d x n) numbers. Aborting.\n", prm->datafile,
+               DATA_COLUMNS, DATA_COLUMNS);
+        exit(-1);
+    }
+    rows = (shape[1] == DATA_COLUMNS);
+    nn   = rows ? shape[0] : shape[1];
+
+    double ** col[DATA_COLUMNS] = {&ds->nom_h, &ds->nom_v, &ds->to,
+                                   &ds->sto, &ds->ti, &ds->sti, &ds->bi,
+                                   &ds->sbi, &ds->bo, &ds->sbo};
+    ds->nsites = nn;
+    for (jc = 0; jc < DATA_COLUMNS; jc++)
     {
-        parse = line;
+        *col[jc] = malloc(nn * sizeof(double));
+        if (*col[jc] == NULL)
+        {
+            printf(" ERROR (data_read): could not allocate memory"
+                " for data arrays. Aborting.\n");
+            exit(-1);
+        }
+        for (ii = 0; ii < nn; ii++)
+        {
+            (*col[jc])[ii] = rows ? arr[ii * DATA_COLUMNS + jc]
+                                  : arr[jc * nn + ii];
+        }
+    }
+    free(arr);
+    printf("##### Data: %zu sites read from .npy file.\n\n", ds->nsites);
+}
 
-        /* Skip empty lines. */
-        if (line[0] == '\n')
-            continue;
-        
-        ds.nom_h[nsite] = atof(strtok_r(parse, " ", &pd));
-        ds.nom_v[nsite] = atof(strtok_r(NULL, " ", &pd));
 
-        ds.to[nsite]    = atof(strtok_r(NULL, " ", &pd));
-        ds.sto[nsite]   = atof(strtok_r(NULL, " ", &pd));
-        ds.ti[nsite]    = atof(strtok_r(NULL, " ", &pd));
-        ds.sti[nsite]   = atof(strtok_r(NULL, " ", &pd));
+/* Read data from file: a binary data file is mapped as it is; a text
+ * or .npy one is read from its cache (file name + DATA_CACHE_EXT) if
+ * that is still valid, or parsed and then cached, unless
+ * prm->data_cache is off. With prm->convfile, the data are written to
+ * that binary file. The number of sites, if given (-n), must match the
+ * file; otherwise it is set from it.
+ */
+dataset data_read(xbpm_prm * prm)
+{
+    dataset ds;
+    char cache[300];
 
-        ds.bi[nsite]    = atof(strtok_r(NULL, " ", &pd));
-        ds.sbi[nsite]   = atof(strtok_r(NULL, " ", &pd));
+    memset(&ds, 0, sizeof(ds));
+    snprintf(cache, sizeof(cache), "%s%s", prm->datafile, DATA_CACHE_EXT);
+    if (data_cache_open(prm->datafile, NULL, &ds) == 0)
+    {
+        printf("##### Data: %zu sites mapped from binary file.\n\n",
+               ds.nsites);
+    }
+    else if (prm->data_cache && data_cache_open(cache, prm->datafile,
+                                                &ds) == 0)
+    {
+        printf("##### Data: %zu sites mapped from cache %s.\n\n",
+               ds.nsites, cache);
+    }
+    else
+    {
+        if (npy_is(prm->datafile)) data_read_npy(prm, &ds);
+        else                       data_read_text(prm, &ds);
+        ds.ord_sites = index_order_by_position(ds.nom_h, ds.nom_v,
+                                               ds.nsites);
+        if (prm->data_cache && prm->convfile[0] == '\0' &&
+            data_cache_write(cache, prm->datafile, &ds) != 0)
+        {
+            printf(" WARNING (data_read): could not write the data"
+                   " cache %s.\n\n", cache);
+        }
+    }
 
-        ds.bo[nsite]    = atof(strtok_r(NULL, " ", &pd));
-        ds.sbo[nsite]   = atof(strtok_r(NULL, " ", &pd));
+    if (prm->nsites > 0 && prm->nsites != ds.nsites)
+    {
+        printf(" ERROR (data_read): data file '%s' has %zu sites, %zu"
+            " given (-n). Aborting.\n", prm->datafile, ds.nsites,
+            prm->nsites);
+        exit(-1);
+    }
+    prm->nsites = ds.nsites;
 
-        nsite++;
+    if (prm->convfile[0] != '\0')
+    {
+        if (data_cache_write(prm->convfile, NULL, &ds) != 0)
+        {
+            printf(" ERROR (data_read): could not write binary data"
+                   " file %s. Aborting.\n", prm->convfile);
+            exit(-1);
+        }
+        printf("##### Data: written to binary file %s.\n\n",
+               prm->convfile);
+    }
+
+    ds.grid = grid_infer(&ds);
+    if (ds.grid.regular)
+    {
+        printf("##### Grid: %zu x %zu sites, spacing %g x %g.\n\n",
+               ds.grid.nx, ds.grid.ny, ds.grid.dh, ds.grid.dv);
     }
 
-    ds.ord_sites = index_order_by_position(ds.nom_h, ds.nom_v, ds.nsites);
     ds.roi = roi_indexation(&ds, prm);
+    ds.rd  = roi_data_build(&ds, &ds.roi);
+    roi_levels_build(&ds, prm);
 
-    fclose(df);
     return ds;
 }
\ No newline at end of file
@@ -7,19 +7,111 @@ void help (void)
          "             fitting for suppression matrix.\n");
   printf(
     "\n Usage:"
-    "\n    ./mc_search -d <data file> -n <sites> [options] [args]"
+    "\n    ./mc_search -d <data file> [-n <sites>] [options] [args]"
     "\n\n where  "
-    "\n  -d <data file>    : data file name (obligatory)"
-    "\n  -n <# sites>      : total number of sites in the grid (obligatory)"
+    "\n  -d <data file>    : data file name (obligatory): text, NumPy .npy"
+    "\n                      (n x 10 array of the text columns) or binary"
+    "\n                      (see --convert); a text or .npy file is"
+    "\n                      cached in a binary file, <data file>.xbd,"
+    "\n                      reused while the file is unchanged"
+    "\n  -n <# sites>      : total number of sites in the grid; counted"
+    "\n                      from the data file if omitted, which must"
+    "\n                      match it otherwise"
     "\n\n with optional arguments"
     "\n  -h                : this help"
+    "\n  --convert <file>  : write the data to the binary file and exit"
+    "\n  --no-data-cache   : neither read nor write <data file>.xbd"
+    "\n  --npy-out <prefix>: write the final matrix and positions, in"
+    "\n                      the order of the data file, to"
+    "\n                      <prefix>_matrix.npy, <prefix>_pos_h.npy and"
+    "\n                      <prefix>_pos_v.npy"
     "\n  -b <inv. temp>    : the inverse of the temperature, beta = 1/T"
     "\n  -f <init. index>  : ROI initial index (from)"
     "\n  -u <last index>   : ROI last index (up to)"
+    "\n  -k <kernels>      : vector kernels: auto (default, best supported"
+    "\n                      by the CPU), scalar, sse2, avx2 or avx512"
+    "\n  -F                : single precision evaluation of positions during"
+    "\n                      the walk (sums still in double precision)"
+    "\n  -j <threads>      : number of threads (default: one per core)"
     "\n  -r <# rand.>      : number of random changes"
     "\n  -m <matrix file>  : initial matrix to be update by annealing"
+    "\n                      (text, or a 4 x 4 NumPy .npy array)"
     "\n  -s <changes size> : step size of random changes in the"
     "\n                      suppression matrix elements (default = 1e-5)"
+    "\n  -M <tries>        : candidates per trial (default 1); more than 1"
+    "\n                      makes trials multiple-try Metropolis ones,"
+    "\n                      each evaluating 2 M - 1 candidate matrices"
+    "\n  --speculate <n>   : evaluate n proposals at a time on the threads"
+    "\n                      (half of -j per chain), assuming the former"
+    "\n                      ones rejected; the walk is unchanged, but"
+    "\n                      faster when acceptance is low (default off)"
+    "\n  -p <threads>      : threads splitting the ROI evaluations of each"
+    "\n                      chain of the plain walk (not with -R, -K,"
+    "\n                      --cma or -M), for very large grids (0: off); by"
+    "\n                      default half of -j, if the ROI is larger than"
+    "\n                      a threshold calibrated at start"
+    "\n  --cache           : cache the fits of the states visited on the"
+    "\n                      step lattice (between rate checks), so"
+    "\n                      that revisits cost a lookup"
+    "\n  -P <mode>         : parameterisation of the matrix walked:"
+    "\n                      full (16 elements, default), gains (4 blade"
+    "\n                      gains scaling the columns of the initial"
+    "\n                      matrix) or shared (H and V delta rows and a"
+    "\n                      sigma row shared by both)"
+    "\n  --varpro          : walk only the sigma (second) row of each"
+    "\n                      half matrix; the delta (first) row is solved"
+    "\n                      by least squares for every state"
+    "\n  --polish <tol>    : refine the walk's matrix by Levenberg-"
+    "\n                      Marquardt until chi2 decreases by less than"
+    "\n                      the relative tolerance tol in an iteration"
+    "\n  -L <levels>       : coarse-to-fine schedule, a list of"
+    "\n                      stride[:fraction] (e.g. 4:0.4,2:0.3); the"
+    "\n                      walk starts on the ROI sites of every"
+    "\n                      stride-th row and column for the given"
+    "\n                      fraction of the trials (an equal share if"
+    "\n                      omitted) and ends on the full ROI"
+    "\n\n Stopping criteria (-r is then an upper bound; checked at the"
+    "\n acceptance rate checks, every 250 trials):"
+    "\n  --tol <rel>       : relative chi2 improvement over a window"
+    "\n                      below rel"
+    "\n  --window <n>      : window of trials of --tol (default 10000)"
+    "\n  --step-min <s>    : step size below s"
+    "\n  --time <s>        : wall clock budget of s seconds (CMA-ES too)"
+    "\n  --target <chi2>   : chi2 of the chain down to the target"
+    "\n\n Cooling schedules (applied at the acceptance rate checks):"
+    "\n  --schedule <s:p>  : default (beta raised by 1%% below 10%% of"
+    "\n                      acceptance), exp (beta times p, 1.01 by"
+    "\n                      default), lam (Lam-Delosme adaptive, quality"
+    "\n                      p = 0.1 by default) or target (beta follows"
+    "\n                      a target acceptance decreasing from p = 0.44"
+    "\n                      to 0.01); the step of exp and lam keeps the"
+    "\n                      acceptance near 0.44"
+    "\n  --element-steps   : adapt the step of each element (parameter)"
+    "\n                      to its own acceptance rate"
+    "\n\n CMA-ES (covariance matrix adaptation):"
+    "\n  --cma             : optimize by CMA-ES instead of the walk; -r"
+    "\n                      gives the number of evaluations, and"
+    "\n                      populations are evaluated in parallel"
+    "\n  --popsize <n>     : population size (default 4 + 3 ln 8 = 10)"
+    "\n  --compare         : run the walk, then CMA-ES for the same wall"
+    "\n                      clock time, and compare them; the CMA-ES"
+    "\n                      matrix is kept"
+    "\n\n Parallel tempering (replica exchange):"
+    "\n  -R <replicas>     : number of replicas; more than 1 replaces the"
+    "\n                      annealing walk by parallel tempering at fixed"
+    "\n                      beta * ratio^i (i = 0 is the hottest replica)"
+    "\n  --pt-ratio <r>    : ratio of neighbour replicas' beta (default 1.5)"
+    "\n  --pt-swap <n>     : trials between swap attempts (default 100)"
+    "\n\n Multi-start:"
+    "\n  -K <walks>        : number of independent walks run on the threads;"
+    "\n                      the best H and V halves are kept"
+    "\n  --jitter <rel>    : relative jitter of the walks' initial matrix"
+    "\n                      elements (default 0.01)"
+    "\n\n Random numbers:"
+    "\n  -S, --seed <n>    : seed of the random streams (default: read from"
+    "\n                      /dev/urandom); a run is reproduced by giving"
+    "\n                      the seed and stream it reports"
+    "\n  --stream <n>      : first random stream of the run (default 0)"
     "\n"
     "\n The data must be a 10-column text: the two first columns are the"
     "\n nominal positions; the other four pairs of columns are the values"
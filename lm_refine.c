@@ -0,0 +1,198 @@
+#include "prm_def.h"
+#include "matrix_operations.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Parameters of an axis: the delta and sigma rows, but for the largest
+ * sigma element, which is held.
+ */
+#define LM_NPAR      7
+
+/* Maximum number of iterations and damping factor of an axis. */
+#define LM_ITER_MAX  200
+#define LM_LAMBDA_MAX 1e16
+
+/* Prototypes. Delta and sigma terms of ROI sites and fit of positions
+ * given by them.
+ */
+roi_terms roi_terms_alloc (const roi_data * rd, int axis, int single);
+
+void roi_terms_free (roi_terms * rt);
+
+void roi_terms_calc (roi_terms * rt, const double * supmat);
+
+kdchi2 roi_terms_fit (const roi_terms * rt, size_t ielem, double dterm);
+
+
+/* Residuals res of the positions (a.b)/(c.b) of the ROI sites of rd
+ * against nominal, for the half matrix pp (a, c), and their Jacobian jac
+ * (nsites x LM_NPAR, row-major, without the held sigma element ifix) if
+ * not NULL. Returns the sum of squared residuals (NAN if a position is
+ * not finite).
+ */
+static double lm_residuals (const roi_data * rd, const double * nominal,
+                            const double * pp, int ifix, double * res,
+                            double * jac)
+{
+    const double * const bl[4] = {rd->to, rd->ti, rd->bi, rd->bo};
+    double delta, sigma, xx, rss = 0.0;
+
+    for (size_t is = 0; is < rd->nsites; is++)
+    {
+        delta = pp[0] * bl[0][is] + pp[1] * bl[1][is]
+              + pp[2] * bl[2][is] + pp[3] * bl[3][is];
+        sigma = pp[4] * bl[0][is] + pp[5] * bl[1][is]
+              + pp[6] * bl[2][is] + pp[7] * bl[3][is];
+        xx = delta / sigma;
+        res[is] = xx - nominal[is];
+        rss += res[is] * res[is];
+
+        if (jac == NULL) continue;
+        double * jr = jac + is * LM_NPAR;
+        for (int jj = 0, jp = 4; jj < 4; jj++)
+        {
+            jr[jj] = bl[jj][is] / sigma;
+            if (jj != ifix) jr[jp++] = -jr[jj] * xx;
+        }
+    }
+    return isfinite(rss) ? rss : NAN;
+}
+
+
+/* Refine the half suppression matrix supmat of an axis by
+ * Levenberg-Marquardt on the positions of the ROI sites of rd, until the
+ * relative decrease of chi2 in an iteration falls below rtol. Returns the
+ * number of iterations; chi2 before and after go to chi2_0 and chi2_1.
+ *
+ * The scaled positions k (a.b)/(c.b) + d do not change with the common
+ * scale of a and c, with k a, nor with a + t c against d. The scaling is
+ * therefore folded into the delta row, a' = k a + d c (k = 1, d = 0, as
+ * in roi_varpro_fit), and the largest sigma element is held; the other 7
+ * elements are fitted. The refined matrix is given back in the gauge of
+ * the scaling fitted at start.
+ */
+static int lm_refine_axis (const roi_data * rd, int axis, double rtol,
+                           double * supmat, double * chi2_0, double * chi2_1)
+{
+    size_t nn = rd->nsites;
+    const double * nominal = (axis == 0) ? rd->nom_h : rd->nom_v;
+    double pp[8], ptry[8], jtj[LM_NPAR * LM_NPAR];
+    double aa[LM_NPAR * LM_NPAR], grad[LM_NPAR], dp[LM_NPAR];
+    double rss, rss_try, lambda = 1e-3;
+    int iter = 0, ifix = 0, jj;
+    int ipar[LM_NPAR];          /* Matrix element of each parameter. */
+
+    /* Start from the matrix and its scaling. */
+    roi_terms rt = roi_terms_alloc(rd, axis, 0);
+    roi_terms_calc(&rt, supmat);
+    kdchi2 kc = roi_terms_fit(&rt, 0, 0.0);
+    roi_terms_free(&rt);
+    if (nn < 2)
+    {
+        *chi2_0 = *chi2_1 = kc.chi2;
+        return 0;
+    }
+    for (jj = 0; jj < 4; jj++)
+    {
+        pp[jj]     = kc.k * supmat[jj] + kc.delta * supmat[4 + jj];
+        pp[4 + jj] = supmat[4 + jj];
+        if (fabs(pp[4 + jj]) > fabs(pp[4 + ifix])) ifix = jj;
+    }
+    for (jj = 0; jj < 4; jj++) ipar[jj] = jj;
+    for (jj = 0; jj < 4; jj++)
+    {
+        if (jj != ifix) ipar[jj < ifix ? 4 + jj : 3 + jj] = 4 + jj;
+    }
+
+    double * res = malloc(nn * sizeof(double));
+    double * jac = malloc(nn * LM_NPAR * sizeof(double));
+    if (res == NULL || jac == NULL)
+    {
+        printf(" ERROR (lm_refine_axis): could not allocate memory"
+               " for the Jacobian. Aborting.\n");
+        exit(-1);
+    }
+
+    rss = lm_residuals(rd, nominal, pp, ifix, res, jac);
+    *chi2_0 = rss / (double) (nn - 1);
+
+    while (iter < LM_ITER_MAX && lambda < LM_LAMBDA_MAX && isfinite(rss))
+    {
+        iter++;
+
+        /* Normal equations J^T J dp = -J^T r. */
+        double * jact = matrix_transpose(jac, nn, LM_NPAR);
+        if (jact == NULL)
+        {
+            printf(" ERROR (lm_refine_axis): could not allocate memory"
+                   " for the Jacobian. Aborting.\n");
+            exit(-1);
+        }
+        matrix_product(jact, jac, LM_NPAR, nn, LM_NPAR, jtj);
+        matrix_vector_product(jact, res, LM_NPAR, nn, grad);
+        free(jact);
+
+        /* Damp until a step lowers chi2. */
+        for (;;)
+        {
+            memcpy(aa, jtj, sizeof(aa));
+            for (jj = 0; jj < LM_NPAR; jj++)
+            {
+                aa[jj * LM_NPAR + jj] *= 1.0 + lambda;
+                dp[jj] = -grad[jj];
+            }
+
+            rss_try = NAN;
+            if (linear_solve(aa, dp, LM_NPAR) == 0)
+            {
+                memcpy(ptry, pp, sizeof(ptry));
+                for (jj = 0; jj < LM_NPAR; jj++) ptry[ipar[jj]] += dp[jj];
+                rss_try = lm_residuals(rd, nominal, ptry, ifix, res, NULL);
+            }
+            if (rss_try < rss || lambda >= LM_LAMBDA_MAX) break;
+            lambda *= 10.0;
+        }
+        if (!(rss_try < rss)) break;
+
+        memcpy(pp, ptry, sizeof(pp));
+        lambda /= 10.0;
+        double drel = (rss - rss_try) / rss;
+        rss = lm_residuals(rd, nominal, pp, ifix, res, jac);
+        if (drel < rtol) break;
+    }
+
+    /* Back to the gauge of the starting scaling, a = (a' - d c) / k,
+     * unless k is zero; the scaling is fitted again to the result. */
+    for (jj = 0; jj < 4; jj++)
+    {
+        supmat[jj] = (kc.k != 0.0)
+                   ? (pp[jj] - kc.delta * pp[4 + jj]) / kc.k : pp[jj];
+        supmat[4 + jj] = pp[4 + jj];
+    }
+    *chi2_1 = rss / (double) (nn - 1);
+
+    free(res);
+    free(jac);
+    return iter;
+}
+
+
+/* Refine the suppression matrix supmat, H and V halves, by
+ * Levenberg-Marquardt on the ROI positions with relative chi2 tolerance
+ * prm->polish.
+ */
+lm_stats lm_refine (const dataset * ds, const xbpm_prm * prm,
+                    double * supmat)
+{
+    lm_stats lms;
+
+    printf("##### Levenberg-Marquardt refinement (tolerance %g).\n\n",
+           prm->polish);
+    lms.iter_h = lm_refine_axis(&ds->rd, 0, prm->polish, supmat,
+                                &lms.chi2_h0, &lms.chi2_h);
+    lms.iter_v = lm_refine_axis(&ds->rd, 1, prm->polish, supmat + 8,
+                                &lms.chi2_v0, &lms.chi2_v);
+    return lms;
+}
@@ -1,12 +1,19 @@
 #include "prm_def.h"
+#include "simd_kernels.h"
+#include "thread_team.h"
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <sys/mman.h>
 
 #define NLIN 4
 #define NCOL 4
 
+/* Reference values below this are compared by absolute difference. */
+#define REL_DIFF_FLOOR 1.0e-12
+
 
 /* Prototypes.      */
 /* Read parameters. */
@@ -18,10 +25,37 @@ double * matrix_read(char * matfile, double * supmat);
 /* Read data from file. */
 dataset data_read(xbpm_prm * prm);
 
+/* Seed from urandom. */
+uint64_t seed_get(void);
+
 /* Perform a random walk with the gain matrix. */
 rw_stats random_walk(dataset * ds, xbpm_prm * prm, double * supmat,
                      double * pos_h, double * pos_v);
 
+/* Optimize the matrix by parallel tempering. */
+rw_stats parallel_tempering(dataset * ds, xbpm_prm * prm, double * supmat,
+                            double * pos_h, double * pos_v);
+
+/* Optimize the matrix by independent walks from jittered starts. */
+rw_stats multi_start(dataset * ds, xbpm_prm * prm, double * supmat,
+                     double * pos_h, double * pos_v);
+
+/* Optimize the matrix by CMA-ES. */
+rw_stats cma_es(dataset * ds, xbpm_prm * prm, double * supmat,
+                double * pos_h, double * pos_v);
+
+/* Walk a reduced parameterisation of the matrix. */
+rw_stats param_walk(dataset * ds, xbpm_prm * prm, double * supmat,
+                    double * pos_h, double * pos_v);
+
+/* Refine the matrix by Levenberg-Marquardt. */
+lm_stats lm_refine(const dataset * ds, const xbpm_prm * prm,
+                   double * supmat);
+
+/* Write an array to a .npy file. */
+int npy_write(const char * path, const double * data, int ndim,
+              const size_t * shape);
+
 /* Print coordinates of sites. */
 void positions_print(const dataset * ds,
                      const double * pos_h, const double * pos_v,
@@ -30,6 +64,12 @@ void positions_print(const dataset * ds,
 kdelta positions_calc(const dataset * ds, const double * supmat,
                       const double * nompos, double * pos);
 
+/* Delta and sigma terms of ROI sites and fit of positions given by them. */
+roi_terms roi_terms_alloc (const roi_data * rd, int axis, int single);
+void roi_terms_free (roi_terms * rt);
+void roi_terms_calc (roi_terms * rt, const double * supmat);
+kdchi2 roi_terms_fit (const roi_terms * rt, size_t ielem, double dterm);
+
 /* Basic suppression matrix.
  * It represents the usual delta/sigma calculation.
  */
@@ -83,10 +123,18 @@ void matrix_show (double * mat, size_t nn, size_t mm)
 }
 
 
+/* Percentage of num in den, 0 if den is 0 (no trials).
+ */
+static double percent (size_t num, size_t den)
+{
+    return den ? 100.0 * (double) num / (double) den : 0.0;
+}
+
+
 /* Print scaling parameters.
  */
-void scaling_params_print (kdelta kdh, kdelta kdv,
-                           rw_stats rws, size_t nrand, double step)
+void scaling_params_print (kdelta kdh, kdelta kdv, rw_stats rws,
+                           const lm_stats * lms, size_t nrand)
 {
     printf("\n##### Rescaling parameters:");
     printf("\n Horizontal:\n"
@@ -96,14 +144,54 @@ void scaling_params_print (kdelta kdh, kdelta kdv,
 
     printf("\n\n##### Random walk statistics."
            "\n Total matrix changes H = %.2lf %%",
-           (double) rws.imat_h / (double) nrand * 100.0);
+           percent(rws.imat_h, nrand));
     printf("\n Total matrix changes V = %.2lf %%",
-           (double) rws.imat_v / (double) nrand * 100.0);
-    printf("\n Acceptance rate        = %6.2lf %%",
-           ((double) rws.accept / (double) nrand) * 100.0);
-    printf("\n Final temperature      = %.4g \t(beta = %.4g)",
-           1/rws.beta, rws.beta);
-    printf("\n Final step size        = %.4g \n\n", step);
+           percent(rws.imat_v, nrand));
+    printf("\n Acceptance rate        = %6.2lf %%"
+           "\t(H = %.2lf %%, V = %.2lf %%)",
+           percent(rws.accept_h + rws.accept_v, nrand),
+           percent(rws.accept_h, rws.imat_h),
+           percent(rws.accept_v, rws.imat_v));
+    printf("\n Final temperature H    = %.4g \t(beta = %.4g)",
+           1/rws.beta_h, rws.beta_h);
+    printf("\n Final temperature V    = %.4g \t(beta = %.4g)",
+           1/rws.beta_v, rws.beta_v);
+    printf("\n Final step size H      = %.4g", rws.step_h);
+    printf("\n Final step size V      = %.4g", rws.step_v);
+    printf("\n Final chi2 H (ROI)     = %.6g", rws.chi2_h);
+    printf("\n Final chi2 V (ROI)     = %.6g ", rws.chi2_v);
+    if (rws.memo_lookups > 0)
+    {
+        printf("\n States cache hit rate  = %6.2lf %%\t(%zu of %zu)",
+               100.0 * (double) rws.memo_hits / (double) rws.memo_lookups,
+               rws.memo_hits, rws.memo_lookups);
+    }
+    if (rws.failed > 0)
+    {
+        printf("\n Failed scalings        = %zu \t(changes rejected)",
+               rws.failed);
+    }
+    if (rws.stop_h != STOP_NONE || rws.stop_v != STOP_NONE)
+    {
+        const char * reason[5] = {"trials done", "chi2 improvement",
+                                  "step floor", "time budget",
+                                  "target chi2"};
+        printf("\n Trials run H           = %zu \t(stopped by %s)",
+               rws.iter_h, reason[rws.stop_h]);
+        printf("\n Trials run V           = %zu \t(stopped by %s)",
+               rws.iter_v, reason[rws.stop_v]);
+    }
+    if (lms != NULL)
+    {
+        printf("\n\n##### Levenberg-Marquardt refinement."
+               "\n Iterations H           = %d"
+               "\n Iterations V           = %d", lms->iter_h, lms->iter_v);
+        printf("\n Refined chi2 H (ROI)   = %.6g \t(from %.6g)",
+               lms->chi2_h, lms->chi2_h0);
+        printf("\n Refined chi2 V (ROI)   = %.6g \t(from %.6g)",
+               lms->chi2_v, lms->chi2_v0);
+    }
+    printf("\n\n");
 
     // printf("\n Acceptance rate: %12.4lf %% \n\n",
     //        ((double) accept / (double) nrand) * 100.0);
@@ -111,28 +199,145 @@ void scaling_params_print (kdelta kdh, kdelta kdv,
 }
 
 
+/* Relative difference of xx to the reference ref, or the absolute one
+ * if ref is (nearly) zero.
+ */
+static double rel_diff (double xx, double ref)
+{
+    double den = fabs(ref);
+    return fabs(xx - ref) / ((den < REL_DIFF_FLOOR) ? 1.0 : den);
+}
+
+
+/* Compare the fit of the matrix supmat evaluated in single precision, as
+ * the walk did, against the double precision evaluation. Differences
+ * to values below REL_DIFF_FLOOR are absolute.
+ */
+void single_precision_report (const dataset * ds, const double * supmat)
+{
+    const char * axis_name[2] = {"Horizontal", "Vertical"};
+    roi_terms tf, td;
+    kdchi2 kf, kd;
+
+    printf("##### Single precision check (ROI fit of final matrix):\n");
+    printf("              %14s %14s %12s\n", "single", "double", "rel. diff");
+    for (int axis = 0; axis < 2; axis++)
+    {
+        tf = roi_terms_alloc(&ds->rd, axis, 1);
+        td = roi_terms_alloc(&ds->rd, axis, 0);
+        roi_terms_calc(&tf, supmat + 8 * axis);
+        roi_terms_calc(&td, supmat + 8 * axis);
+        kf = roi_terms_fit(&tf, 0, 0.0);
+        kd = roi_terms_fit(&td, 0, 0.0);
+        roi_terms_free(&tf);
+        roi_terms_free(&td);
+
+        printf(" %s:\n", axis_name[axis]);
+        printf("    chi2   = %14.8g %14.8g %12.3e\n", kf.chi2, kd.chi2,
+               rel_diff(kf.chi2, kd.chi2));
+        printf("    k      = %14.8g %14.8g %12.3e\n", kf.k, kd.k,
+               rel_diff(kf.k, kd.k));
+        printf("    delta  = %14.8g %14.8g %12.3e\n", kf.delta, kd.delta,
+               rel_diff(kf.delta, kd.delta));
+    }
+    printf("\n");
+}
+
+
+/* Run the random walk on a copy of supmat, then CMA-ES on supmat for
+ * the same wall clock time, and print the chi2 each reached.
+ */
+rw_stats cma_walk_compare (dataset * ds, xbpm_prm * prm, double * supmat,
+                           double * pos_h, double * pos_v)
+{
+    double walkmat[16];
+    double t0, t_walk, t_cma;
+    rw_stats rww, rwc;
+
+    memcpy(walkmat, supmat, sizeof(walkmat));
+    t0 = clock_seconds();
+    rww = random_walk(ds, prm, walkmat, pos_h, pos_v);
+    t_walk = clock_seconds() - t0;
+
+    prm->wall = t_walk;
+    t0 = clock_seconds();
+    rwc = cma_es(ds, prm, supmat, pos_h, pos_v);
+    t_cma = clock_seconds() - t0;
+
+    printf("##### Equal wall clock comparison:\n");
+    printf("               time (s)  evaluations       chi2 H       chi2 V"
+           "     chi2 H+V\n");
+    printf(" walk    %12.3lf %12zu %12.6g %12.6g %12.6g\n", t_walk,
+           rww.imat_h + rww.imat_v, rww.chi2_h, rww.chi2_v,
+           rww.chi2_h + rww.chi2_v);
+    printf(" CMA-ES  %12.3lf %12zu %12.6g %12.6g %12.6g\n\n", t_cma,
+           rwc.imat_h + rwc.imat_v, rwc.chi2_h, rwc.chi2_v,
+           rwc.chi2_h + rwc.chi2_v);
+    return rwc;
+}
+
+
 /* Free up allocated memory. */
 void dataset_free (dataset * ds, double * supmat,
                    double * pos_h, double * pos_v)
 {
-    free(ds->nom_h);
-    free(ds->nom_v);
-    free(ds->to);
-    free(ds->ti);
-    free(ds->bi);
-    free(ds->bo);
-    free(ds->sto);
-    free(ds->sti);
-    free(ds->sbi);
-    free(ds->sbo);
-    free(ds->ord_sites);
+    if (ds->map != NULL)
+    {
+        munmap(ds->map, ds->map_size);
+    }
+    else
+    {
+        free(ds->nom_h);
+        free(ds->nom_v);
+        free(ds->to);
+        free(ds->ti);
+        free(ds->bi);
+        free(ds->bo);
+        free(ds->sto);
+        free(ds->sti);
+        free(ds->sbi);
+        free(ds->sbo);
+        free(ds->ord_sites);
+    }
     free(ds->roi.idx);
+    free(ds->rd.arena);
+    for (int il = 0; il < ds->nlevels; il++)
+    {
+        free(ds->level_roi[il].idx);
+        free(ds->level_rd[il].arena);
+    }
     free(supmat);
     free(pos_h);
     free(pos_v);
 }
 
 
+/* Write the matrix supmat (4 x 4) and the positions pos_h and pos_v of
+ * the sites (in the order of the data file) to the .npy files
+ * <prefix>_matrix.npy, <prefix>_pos_h.npy and <prefix>_pos_v.npy.
+ */
+void npy_results_write (const char * prefix, const dataset * ds,
+                        const double * supmat, const double * pos_h,
+                        const double * pos_v)
+{
+    const char * names[3] = {"matrix", "pos_h", "pos_v"};
+    const double * arrs[3] = {supmat, pos_h, pos_v};
+    size_t shape[2] = {4, 4};
+    char path[300];
+
+    for (int ia = 0; ia < 3; ia++)
+    {
+        if (ia > 0) shape[0] = ds->nsites;
+        snprintf(path, sizeof(path), "%s_%s.npy", prefix, names[ia]);
+        if (npy_write(path, arrs[ia], (ia == 0) ? 2 : 1, shape) != 0)
+        {
+            printf(" ERROR (npy_results_write): could not write '%s'.\n",
+                   path);
+        }
+    }
+}
+
+
 /* Main program.
  */
 int main(int argc, char **argv)
@@ -140,9 +345,24 @@ int main(int argc, char **argv)
     /* Read parameters from command line. */
     xbpm_prm prm = parameters_read(argc, argv);
 
+    /* Select vector kernels for this CPU. */
+    printf("##### Vector kernels: %s\n\n", simd_kernels_init(prm.simd));
+
+    /* Seed of the random streams, from urandom unless given. */
+    if (!prm.seed_set) prm.seed = seed_get();
+    printf("##### Random seed: %" PRIu64 ", stream: %" PRIu64 "\n\n",
+           prm.seed, prm.stream);
+
     /* Read XBPM data from file. */
     dataset ds = data_read(&prm);
 
+    /* Conversion of the data to a binary file only. */
+    if (prm.convfile[0] != '\0')
+    {
+        dataset_free(&ds, NULL, NULL, NULL);
+        return 0;
+    }
+
     /* Read initial suppression matrix from file if provided. */
     double * supmat = suppression_matrix_read(prm.matfile);
     printf("##### Input matrix:\n");
@@ -157,7 +377,45 @@ int main(int argc, char **argv)
                " for position arrays. Aborting.\n");
         exit(-1);
     }
-    rw_stats rws = random_walk(&ds, &prm, supmat, pos_h, pos_v);
+    /* Time budget of the optimization. */
+    if (prm.time > 0.0)
+    {
+        prm.time_end = clock_seconds() + prm.time;
+        if (prm.cma && !prm.compare) prm.wall = prm.time;
+    }
+
+    rw_stats rws;
+    if (prm.nreplicas > 1)
+    {
+        rws = parallel_tempering(&ds, &prm, supmat, pos_h, pos_v);
+    }
+    else if (prm.param_mode != PARAM_FULL)
+    {
+        rws = param_walk(&ds, &prm, supmat, pos_h, pos_v);
+    }
+    else if (prm.compare)
+    {
+        rws = cma_walk_compare(&ds, &prm, supmat, pos_h, pos_v);
+    }
+    else if (prm.cma)
+    {
+        rws = cma_es(&ds, &prm, supmat, pos_h, pos_v);
+    }
+    else if (prm.nstarts > 1)
+    {
+        rws = multi_start(&ds, &prm, supmat, pos_h, pos_v);
+    }
+    else
+    {
+        rws = random_walk(&ds, &prm, supmat, pos_h, pos_v);
+    }
+
+    /* Polish the walk's matrix. */
+    lm_stats lms;
+    if (prm.polish > 0.0)
+    {
+        lms = lm_refine(&ds, &prm, supmat);
+    }
 
     /* Show modified matrix. */
     printf("##### Modified matrix:\n");
@@ -169,9 +427,20 @@ int main(int argc, char **argv)
 
     /* Print out final positions. */
     positions_print(&ds, pos_h, pos_v, prm.outfile);
+    if (prm.npyout[0] != '\0')
+    {
+        npy_results_write(prm.npyout, &ds, supmat, pos_h, pos_v);
+    }
 
     /* Print final scaling parameters. */
-    scaling_params_print(kdh, kdv, rws, prm.nrand, prm.step);
+    scaling_params_print(kdh, kdv, rws, (prm.polish > 0.0) ? &lms : NULL,
+                         prm.nrand);
+
+    /* Check the single precision evaluation against double precision. */
+    if (prm.single)
+    {
+        single_precision_report(&ds, supmat);
+    }
 
     /* Free up allocated memory. */
     dataset_free(&ds, supmat, pos_h, pos_v);
@@ -1,5 +1,7 @@
 #include "prm_def.h"
+#include "simd_kernels.h"
 #include <stdlib.h>
+#include <math.h>
 
 #ifndef MAT_OP
 #define MAT_OP
@@ -100,6 +102,146 @@ double vector_sum(const double *mA, const size_t nn)
 }
 
 
+/* Add the nn sized vector mA, multiplied by aa, to vector mB
+ * (mB = aa * mA + mB).
+ */
+void vector_axpy(const double aa, const double *mA, double *mB,
+                 const size_t nn)
+{
+    for (size_t ii = 0; ii < nn; ii++)
+    {
+        mB[ii] += aa * mA[ii];
+    }
+}
+
+
+/* Solve the nn x nn linear system mA * xx = bb by Gaussian elimination
+ * with partial pivoting. mA is a flat row-major array and is destroyed;
+ * the solution xx overwrites bb. Returns 0, or -1 if mA is singular.
+ */
+int linear_solve(double *mA, double *bb, const size_t nn)
+{
+    for (size_t kk = 0; kk < nn; kk++)
+    {
+        /* Pivot: largest element of column kk from row kk on. */
+        size_t ip = kk;
+        for (size_t ii = kk + 1; ii < nn; ii++)
+        {
+            if (fabs(mA[ii * nn + kk]) > fabs(mA[ip * nn + kk])) ip = ii;
+        }
+        if (mA[ip * nn + kk] == 0.0 || !isfinite(mA[ip * nn + kk]))
+            return -1;
+        if (ip != kk)
+        {
+            for (size_t jj = kk; jj < nn; jj++)
+            {
+                double tmp = mA[kk * nn + jj];
+                mA[kk * nn + jj] = mA[ip * nn + jj];
+                mA[ip * nn + jj] = tmp;
+            }
+            double tmp = bb[kk]; bb[kk] = bb[ip]; bb[ip] = tmp;
+        }
+
+        /* Eliminate column kk below the pivot. */
+        for (size_t ii = kk + 1; ii < nn; ii++)
+        {
+            double ff = mA[ii * nn + kk] / mA[kk * nn + kk];
+            for (size_t jj = kk; jj < nn; jj++)
+            {
+                mA[ii * nn + jj] -= ff * mA[kk * nn + jj];
+            }
+            bb[ii] -= ff * bb[kk];
+        }
+    }
+
+    /* Back substitution. */
+    for (size_t ii = nn; ii-- > 0;)
+    {
+        double sum = bb[ii];
+        for (size_t jj = ii + 1; jj < nn; jj++)
+        {
+            sum -= mA[ii * nn + jj] * bb[jj];
+        }
+        bb[ii] = sum / mA[ii * nn + ii];
+    }
+    return 0;
+}
+
+
+/* Eigenvalues evals and eigenvectors evecs (the columns of an nn x nn
+ * flat row-major array) of the symmetric nn x nn matrix mA, by cyclic
+ * Jacobi rotations. mA is destroyed. Returns the number of sweeps, or -1
+ * if the off-diagonal elements did not vanish.
+ */
+int symmetric_eigen(double *mA, double *evals, double *evecs,
+                    const size_t nn)
+{
+    const int max_sweeps = 50;
+
+    for (size_t ii = 0; ii < nn; ii++)
+    {
+        for (size_t jj = 0; jj < nn; jj++)
+        {
+            evecs[ii * nn + jj] = (ii == jj) ? 1.0 : 0.0;
+        }
+    }
+
+    for (int sweep = 1; sweep <= max_sweeps; sweep++)
+    {
+        double off = 0.0, diag = 0.0;
+        for (size_t ii = 0; ii < nn; ii++)
+        {
+            diag += mA[ii * nn + ii] * mA[ii * nn + ii];
+            for (size_t jj = ii + 1; jj < nn; jj++)
+            {
+                off += mA[ii * nn + jj] * mA[ii * nn + jj];
+            }
+        }
+        if (off <= 1e-30 * diag || off == 0.0)
+        {
+            for (size_t ii = 0; ii < nn; ii++) evals[ii] = mA[ii * nn + ii];
+            return sweep;
+        }
+
+        for (size_t pp = 0; pp + 1 < nn; pp++)
+        {
+            for (size_t qq = pp + 1; qq < nn; qq++)
+            {
+                double apq = mA[pp * nn + qq];
+                if (apq == 0.0) continue;
+
+                /* Rotation annihilating element (pp,qq). */
+                double theta = (mA[qq * nn + qq] - mA[pp * nn + pp])
+                             / (2.0 * apq);
+                double tt = ((theta >= 0.0) ? 1.0 : -1.0)
+                          / (fabs(theta) + sqrt(theta * theta + 1.0));
+                double cc = 1.0 / sqrt(tt * tt + 1.0), ss = tt * cc;
+
+                for (size_t kk = 0; kk < nn; kk++)
+                {
+                    double akp = mA[kk * nn + pp], akq = mA[kk * nn + qq];
+                    mA[kk * nn + pp] = cc * akp - ss * akq;
+                    mA[kk * nn + qq] = ss * akp + cc * akq;
+                }
+                for (size_t kk = 0; kk < nn; kk++)
+                {
+                    double apk = mA[pp * nn + kk], aqk = mA[qq * nn + kk];
+                    mA[pp * nn + kk] = cc * apk - ss * aqk;
+                    mA[qq * nn + kk] = ss * apk + cc * aqk;
+                }
+                for (size_t kk = 0; kk < nn; kk++)
+                {
+                    double vkp = evecs[kk * nn + pp], vkq = evecs[kk * nn + qq];
+                    evecs[kk * nn + pp] = cc * vkp - ss * vkq;
+                    evecs[kk * nn + qq] = ss * vkp + cc * vkq;
+                }
+            }
+        }
+    }
+    return -1;
+}
+
+
 /* Calculate the dot product of a line matrix mA and a
  * column matrix mB, indexed by roi->idx. The ROI skips
  * certain elements.
@@ -107,14 +249,7 @@ double vector_sum(const double *mA, const size_t nn)
 double roi_dot_product(const double *mA, const double *mB,
                        const roi_struct * roi)
 {
-    double dprod = 0.0;
-    size_t idx;
-    for (size_t ii = 0; ii < roi->nsites; ii++)
-    {
-        idx = roi->idx[ii];
-        dprod += mA[idx] * mB[idx];
-    }
-    return dprod;
+    return simd.roi_dot(mA, mB, roi->idx, roi->nsites);
 }
 
 
@@ -124,12 +259,7 @@ double roi_dot_product(const double *mA, const double *mB,
  */
 double roi_vector_sum(const double *mA, const roi_struct * roi)
 {
-    double sum = 0.0;
-    for (size_t ii = 0; ii < roi->nsites; ii++)
-    {
-        sum += mA[roi->idx[ii]];
-    }
-    return sum;
+    return simd.roi_sum(mA, roi->idx, roi->nsites);
 }
 
 #endif
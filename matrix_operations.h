@@ -26,6 +26,20 @@ void matrix_vector_product(const double *mA, const double *vv,
 /* Basic vector helpers. */
 double dot_product(const double *mA, const double *mB, const size_t nn);
 double vector_sum(const double *mA, const size_t nn);
+void vector_axpy(const double aa, const double *mA, double *mB,
+                 const size_t nn);
+
+/* Solve the nn x nn system mA * xx = bb in place (xx in bb, mA destroyed).
+ * Returns 0, or -1 if mA is singular.
+ */
+int linear_solve(double *mA, double *bb, const size_t nn);
+
+/* Eigenvalues evals and eigenvectors evecs (columns, flat row-major) of
+ * the symmetric nn x nn matrix mA (destroyed), by Jacobi rotations.
+ * Returns the number of sweeps, or -1 if they did not converge.
+ */
+int symmetric_eigen(double *mA, double *evals, double *evecs,
+                    const size_t nn);
 
 /* ROI-aware helpers (operate on flat vectors indexed by roi->idx). */
 double roi_dot_product(const double *mA, const double *mB,
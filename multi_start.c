@@ -0,0 +1,168 @@
+#include "prm_def.h"
+#include "thread_team.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Prototypes. Random walks. */
+rw_stats random_walk_serial (const dataset * ds, const xbpm_prm * prm,
+                             double * supmat, uint64_t seed, uint64_t stream);
+
+kdelta positions_calc (const dataset * ds, const double * supmat,
+                       const double * nominal_pos, double * pos);
+
+/* Walks shared with the pool's threads. */
+typedef struct
+{
+    const dataset * ds;
+    const xbpm_prm * prm;
+    double * supmats;           /* Matrices of the walks (16 each). */
+    rw_stats * rws;             /* Statistics of the walks.         */
+    uint64_t seed;
+    int nstarts;
+    int next;                   /* Next walk to be run.             */
+} ms_walks;
+
+/* Run walks, taking the next one not yet started until all are done.
+ */
+static void ms_walks_task (void * arg, int tid, int nthreads)
+{
+    ms_walks * ms = (ms_walks *) arg;
+    int kk;
+    while ((kk = __atomic_fetch_add(&ms->next, 1, __ATOMIC_RELAXED))
+           < ms->nstarts)
+    {
+        ms->rws[kk] = random_walk_serial(ms->ds, ms->prm,
+                                         ms->supmats + 16 * kk, ms->seed,
+                                         ms->prm->stream + 2 * (uint64_t) kk);
+    }
+}
+
+/* Print the mean, standard deviation, minimum and maximum of nn values
+ * of chi2, stored every stride elements of vv.
+ */
+static void ms_spread_print (const char * label, const double * vv,
+                             size_t stride, int nn)
+{
+    double mean = 0.0, var = 0.0, vmin = vv[0], vmax = vv[0];
+    for (int kk = 0; kk < nn; kk++)
+    {
+        double val = vv[kk * stride];
+        mean += val;
+        if (val < vmin) vmin = val;
+        if (val > vmax) vmax = val;
+    }
+    mean /= nn;
+    for (int kk = 0; kk < nn; kk++)
+    {
+        double df = vv[kk * stride] - mean;
+        var += df * df;
+    }
+    var = (nn > 1) ? var / (nn - 1) : 0.0;
+    printf(" %s: mean = %.6g, std dev = %.3g, min = %.6g, max = %.6g\n",
+           label, mean, sqrt(var), vmin, vmax);
+}
+
+/* Optimize the suppression matrix by prm->nstarts independent walks run on
+ * a pool of threads, each with its own random streams and starting from
+ * a copy of supmat whose elements are jittered by a relative amount of up
+ * to prm->jitter (the first walk starts from supmat itself). The chi2 of
+ * H and V are independent, thus supmat receives the best H half and the
+ * best V half found.
+ */
+rw_stats multi_start (dataset * ds, xbpm_prm * prm, double * supmat,
+                      double * pos_h, double * pos_v)
+{
+    int kk, ibest[2] = {0, 0};
+    int nstarts = prm->nstarts;
+    int nthreads = (prm->nthreads > 0) ? prm->nthreads : team_cores();
+    if (nthreads > nstarts) nthreads = nstarts;
+
+    double * supmats = calloc(16 * nstarts, sizeof(double));
+    rw_stats * rws   = calloc(nstarts, sizeof(rw_stats));
+    double * chi2    = calloc(3 * nstarts, sizeof(double));
+    if (supmats == NULL || rws == NULL || chi2 == NULL)
+    {
+        printf(" ERROR (multi_start): could not allocate memory"
+               " for walks. Aborting.\n");
+        exit(-1);
+    }
+
+    /* Jittered starting matrices. The last stream of seed is used for
+     * the jitter; walk kk draws from streams 2 kk and 2 kk + 1, counted
+     * from the run's one. */
+    uint64_t seed = prm->seed;
+    pcg32_random_t rng;
+    pcg32_init_r(&rng, seed, prm->stream + 2 * (uint64_t) nstarts);
+    for (kk = 0; kk < nstarts; kk++)
+    {
+        for (int ii = 0; ii < 16; ii++)
+        {
+            double jit = (kk == 0) ? 0.0
+                       : prm->jitter * (2.0 * pcg_double_r(&rng) - 1.0);
+            supmats[16 * kk + ii] = supmat[ii] * (1.0 + jit);
+        }
+    }
+
+    ms_walks ms = {ds, prm, supmats, rws, seed, nstarts, 0};
+    thread_team * team = team_create(nthreads);
+    team_run(team, ms_walks_task, &ms);
+    team_destroy(team);
+
+    /* Best halves. */
+    for (kk = 0; kk < nstarts; kk++)
+    {
+        chi2[3 * kk]     = rws[kk].chi2_h;
+        chi2[3 * kk + 1] = rws[kk].chi2_v;
+        chi2[3 * kk + 2] = rws[kk].chi2_h + rws[kk].chi2_v;
+        if (rws[kk].chi2_h < rws[ibest[0]].chi2_h) ibest[0] = kk;
+        if (rws[kk].chi2_v < rws[ibest[1]].chi2_v) ibest[1] = kk;
+    }
+    memcpy(supmat,     supmats + 16 * ibest[0],     8 * sizeof(double));
+    memcpy(supmat + 8, supmats + 16 * ibest[1] + 8, 8 * sizeof(double));
+
+    printf("##### Multi-start: %d walks, %d threads,"
+           " jitter = %.3g.\n", nstarts, nthreads, prm->jitter);
+    printf(" walk      chi2 H      chi2 V     chi2 H+V\n");
+    for (kk = 0; kk < nstarts; kk++)
+    {
+        printf(" %4d  %10.6g  %10.6g  %11.6g\n", kk,
+               chi2[3 * kk], chi2[3 * kk + 1], chi2[3 * kk + 2]);
+    }
+    printf("\n Final chi2 spread:\n");
+    ms_spread_print("H  ", chi2,     3, nstarts);
+    ms_spread_print("V  ", chi2 + 1, 3, nstarts);
+    ms_spread_print("H+V", chi2 + 2, 3, nstarts);
+    printf(" Best H from walk %d, best V from walk %d:"
+           " chi2 H+V = %.6g\n\n", ibest[0], ibest[1],
+           rws[ibest[0]].chi2_h + rws[ibest[1]].chi2_v);
+
+    /* Statistics of the best walks. */
+    rw_stats best = rws[ibest[0]];
+    best.imat_v   = rws[ibest[1]].imat_v;
+    best.accept_v = rws[ibest[1]].accept_v;
+    best.beta_v   = rws[ibest[1]].beta_v;
+    best.step_v   = rws[ibest[1]].step_v;
+    best.chi2_v   = rws[ibest[1]].chi2_v;
+    best.iter_v   = rws[ibest[1]].iter_v;
+    best.stop_v   = rws[ibest[1]].stop_v;
+
+    /* Cache and failed scalings statistics of all walks. */
+    best.memo_lookups = best.memo_hits = best.failed = 0;
+    for (kk = 0; kk < nstarts; kk++)
+    {
+        best.memo_lookups += rws[kk].memo_lookups;
+        best.memo_hits    += rws[kk].memo_hits;
+        best.failed       += rws[kk].failed;
+    }
+
+    free(supmats);
+    free(rws);
+    free(chi2);
+
+    /* Final positions. */
+    positions_calc(ds, supmat,     ds->nom_h, pos_h);
+    positions_calc(ds, supmat + 8, ds->nom_v, pos_v);
+    return best;
+}
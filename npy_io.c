@@ -0,0 +1,253 @@
+#include "prm_def.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* NumPy .npy files: the magic string "\x93NUMPY", the format version
+ * (major, minor), the length of the header (2 bytes in version 1, 4 in
+ * versions 2 and 3, little endian), and the header, a Python dict
+ * literal with the keys 'descr' (type), 'fortran_order' and 'shape',
+ * padded with blanks and a newline so that the data are 64 bytes
+ * aligned. The data follow, in C or Fortran order.
+ */
+static const char npy_magic[6] = {'\x93', 'N', 'U', 'M', 'P', 'Y'};
+
+
+/* Whether file path is a .npy file (by its magic string). */
+int npy_is (const char * path)
+{
+    char magic[6];
+    FILE * fp = fopen(path, "rb");
+    int is;
+
+    if (fp == NULL) return 0;
+    is = (fread(magic, 1, 6, fp) == 6 && memcmp(magic, npy_magic, 6) == 0);
+    fclose(fp);
+    return is;
+}
+
+
+/* Value of key in the header dict hdr: a pointer past "'key':" and
+ * blanks, or NULL if missing.
+ */
+static const char * npy_key (const char * hdr, const char * key)
+{
+    char pat[32];
+    snprintf(pat, sizeof(pat), "'%s':", key);
+    const char * pp = strstr(hdr, pat);
+    if (pp == NULL) return NULL;
+    for (pp += strlen(pat); *pp == ' '; pp++);
+    return pp;
+}
+
+
+/* Read the array of .npy file path, of type float64, float32, int64 or
+ * int32 of either byte order, into a new array of doubles in C order.
+ * Its number of dimensions (up to NPY_DIMS_MAX) and shape are set in
+ * ndim and shape.
+ */
+double * npy_read (const char * path, int * ndim, size_t * shape)
+{
+    unsigned char pre[10], len4[2];
+    size_t hlen, nn = 1, width, ii;
+    char * hdr, kind, order;
+    const char * pp;
+    int fortran, big;
+
+    FILE * fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        perror(path);
+        printf(" ERROR (npy_read): could not open '%s'. Aborting.\n", path);
+        exit(-1);
+    }
+    if (fread(pre, 1, 10, fp) != 10 || memcmp(pre, npy_magic, 6) != 0 ||
+        pre[6] < 1 || pre[6] > 3)
+    {
+        printf(" ERROR (npy_read): '%s' is not a .npy file."
+               " Aborting.\n", path);
+        exit(-1);
+    }
+    hlen = (size_t) pre[8] | (size_t) pre[9] << 8;
+    if (pre[6] > 1)
+    {
+        if (fread(len4, 1, 2, fp) != 2)
+        {
+            printf(" ERROR (npy_read): truncated header in '%s'."
+                   " Aborting.\n", path);
+            exit(-1);
+        }
+        hlen |= (size_t) len4[0] << 16 | (size_t) len4[1] << 24;
+    }
+
+    hdr = calloc(hlen + 1, 1);
+    if (hdr == NULL || fread(hdr, 1, hlen, fp) != hlen)
+    {
+        printf(" ERROR (npy_read): could not read the header of '%s'."
+               " Aborting.\n", path);
+        exit(-1);
+    }
+
+    /* Type: byte order, kind and width, e.g. '<f8'. */
+    pp = npy_key(hdr, "descr");
+    if (pp == NULL || pp[0] != '\'' ||
+        sscanf(pp + 1, "%c%c%zu", &order, &kind, &width) != 3 ||
+        !((kind == 'f' || kind == 'i') && (width == 4 || width == 8)))
+    {
+        printf(" ERROR (npy_read): '%s' must hold float64, float32, int64"
+               " or int32 numbers. Aborting.\n", path);
+        exit(-1);
+    }
+    big = (order == '>');
+
+    pp = npy_key(hdr, "fortran_order");
+    fortran = (pp != NULL && strncmp(pp, "True", 4) == 0);
+
+    /* Shape: a tuple of up to NPY_DIMS_MAX sizes. */
+    pp = npy_key(hdr, "shape");
+    if (pp == NULL || *pp != '(')
+    {
+        printf(" ERROR (npy_read): no shape in '%s'. Aborting.\n", path);
+        exit(-1);
+    }
+    *ndim = 0;
+    for (pp++; *pp != ')' && *pp != '\0';)
+    {
+        char * end;
+        size_t dim = (size_t) strtoul(pp, &end, 10);
+        if (end == pp) break;
+        if (*ndim == NPY_DIMS_MAX)
+        {
+            printf(" ERROR (npy_read): more than %d dimensions in '%s'."
+                   " Aborting.\n", NPY_DIMS_MAX, path);
+            exit(-1);
+        }
+        shape[(*ndim)++] = dim;
+        nn *= dim;
+        for (pp = end; *pp == ',' || *pp == ' '; pp++);
+    }
+    free(hdr);
+
+    /* Data, converted to doubles. */
+    unsigned char * raw = malloc(nn * width + 1);
+    double * data = malloc(nn * sizeof(double) + 1);
+    if (raw == NULL || data == NULL)
+    {
+        printf(" ERROR (npy_read): could not allocate memory for '%s'."
+               " Aborting.\n", path);
+        exit(-1);
+    }
+    if (fread(raw, width, nn, fp) != nn)
+    {
+        printf(" ERROR (npy_read): '%s' holds less data than its shape."
+               " Aborting.\n", path);
+        exit(-1);
+    }
+    fclose(fp);
+
+    for (ii = 0; ii < nn; ii++)
+    {
+        unsigned char bb[8];
+        memcpy(bb, raw + ii * width, width);
+        if (big)
+        {
+            for (size_t jj = 0; jj < width / 2; jj++)
+            {
+                unsigned char tt = bb[jj];
+                bb[jj] = bb[width - 1 - jj];
+                bb[width - 1 - jj] = tt;
+            }
+        }
+        if (kind == 'f' && width == 8)
+        {
+            memcpy(&data[ii], bb, 8);
+        }
+        else if (kind == 'f')
+        {
+            float ff;
+            memcpy(&ff, bb, 4);
+            data[ii] = (double) ff;
+        }
+        else if (width == 8)
+        {
+            int64_t i8;
+            memcpy(&i8, bb, 8);
+            data[ii] = (double) i8;
+        }
+        else
+        {
+            int32_t i4;
+            memcpy(&i4, bb, 4);
+            data[ii] = (double) i4;
+        }
+    }
+    free(raw);
+
+    /* Fortran order of a matrix: transpose. */
+    if (fortran && *ndim == 2)
+    {
+        double * tr = malloc(nn * sizeof(double) + 1);
+        if (tr == NULL)
+        {
+            printf(" ERROR (npy_read): could not allocate memory for '%s'."
+                   " Aborting.\n", path);
+            exit(-1);
+        }
+        for (ii = 0; ii < shape[0]; ii++)
+        {
+            for (size_t jj = 0; jj < shape[1]; jj++)
+            {
+                tr[ii * shape[1] + jj] = data[jj * shape[0] + ii];
+            }
+        }
+        free(data);
+        data = tr;
+    }
+    else if (fortran && *ndim > 2)
+    {
+        printf(" ERROR (npy_read): Fortran order of more than two"
+               " dimensions in '%s'. Aborting.\n", path);
+        exit(-1);
+    }
+    return data;
+}
+
+
+/* Write the array data of ndim dimensions of the given shape, in C
+ * order, to the .npy file path, as float64. Returns 0, or -1 if it could
+ * not be written.
+ */
+int npy_write (const char * path, const double * data, int ndim,
+               const size_t * shape)
+{
+    char hdr[256];
+    size_t nn = 1, hlen;
+    int len;
+
+    len = snprintf(hdr, sizeof(hdr),
+                   "{'descr': '<f8', 'fortran_order': False, 'shape': (");
+    for (int id = 0; id < ndim; id++)
+    {
+        len += snprintf(hdr + len, sizeof(hdr) - len, "%zu,%s", shape[id],
+                        (id < ndim - 1) ? " " : "");
+        nn  *= shape[id];
+    }
+    if (ndim > 1) len--;        /* (n,) for one dimension only. */
+    len += snprintf(hdr + len, sizeof(hdr) - len, "), }");
+
+    /* Pad with blanks and a newline to a multiple of 64 bytes. */
+    hlen = ((10 + (size_t) len + 1 + 63) / 64) * 64 - 10;
+    memset(hdr + len, ' ', hlen - (size_t) len);
+    hdr[hlen - 1] = '\n';
+
+    FILE * fp = fopen(path, "wb");
+    if (fp == NULL) return -1;
+    unsigned char pre[10] = {0x93, 'N', 'U', 'M', 'P', 'Y', 1, 0,
+                             (unsigned char) (hlen & 0xff),
+                             (unsigned char) (hlen >> 8)};
+    int ok = (fwrite(pre, 1, 10, fp) == 10 &&
+              fwrite(hdr, 1, hlen, fp) == hlen &&
+              fwrite(data, sizeof(double), nn, fp) == nn);
+    ok = (fclose(fp) == 0) && ok;
+    return ok ? 0 : -1;
+}
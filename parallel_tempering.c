@@ -0,0 +1,206 @@
+#include "prm_def.h"
+#include "thread_team.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Prototypes. Random walk chains. */
+void rw_chain_init (rw_chain * ch, const dataset * ds, const xbpm_prm * prm,
+                    double * supmat, int axis, size_t nrand,
+                    uint64_t seed, uint64_t stream);
+
+void rw_chain_run (rw_chain * ch, size_t ntrials);
+
+void rw_chain_free (rw_chain * ch);
+
+void rw_memo_reset (rw_memo * memo);
+
+kdelta positions_calc (const dataset * ds, const double * supmat,
+                       const double * nominal_pos, double * pos);
+
+/* Replicas shared with the team's threads. Chain [2 * rep + axis] is the
+ * chain of axis (0 = H, 1 = V) of replica rep.
+ */
+typedef struct
+{
+    rw_chain * chain;
+    int nrep;
+    size_t ntrials;             /* Trials per chain in this round. */
+} pt_replicas;
+
+/* Run a round of every replica assigned to thread tid.
+ */
+static void pt_round_task (void * arg, int tid, int nthreads)
+{
+    pt_replicas * pt = (pt_replicas *) arg;
+    for (int rep = tid; rep < pt->nrep; rep += nthreads)
+    {
+        rw_chain_run(&pt->chain[2 * rep],     pt->ntrials);
+        rw_chain_run(&pt->chain[2 * rep + 1], pt->ntrials);
+    }
+}
+
+/* Exchange the states (matrix elements, terms and chi2) of chains a and b.
+ * Temperatures, step sizes and random streams stay with the chains; their
+ * caches of evaluated states start anew.
+ */
+static void pt_states_swap (rw_chain * a, rw_chain * b)
+{
+    double tmp[8];
+    roi_terms tt;
+    double chi2;
+
+    memcpy(tmp,       a->supmat, 8 * sizeof(double));
+    memcpy(a->supmat, b->supmat, 8 * sizeof(double));
+    memcpy(b->supmat, tmp,       8 * sizeof(double));
+
+    tt = a->terms;   a->terms = b->terms;   b->terms = tt;
+    chi2 = a->chi2;  a->chi2  = b->chi2;    b->chi2  = chi2;
+
+    if (a->memo.slot != NULL) rw_memo_reset(&a->memo);
+    if (b->memo.slot != NULL) rw_memo_reset(&b->memo);
+}
+
+/* Optimize the suppression matrix by parallel tempering (replica
+ * exchange). prm->nreplicas replicas of the walk run at fixed inverse
+ * temperatures in a geometric ladder, beta * pt_ratio^rep, from the
+ * hottest (rep = 0) to the coldest; each replica does the nrand/2 trials
+ * per axis of a single walk. Every pt_swap trials the states of
+ * neighbouring replicas are exchanged with the Metropolis probability
+ * min(1, exp((beta_i - beta_j) * Bk * (chi2_i - chi2_j))), alternating
+ * even and odd pairs, for H and V independently. supmat receives the
+ * best state found.
+ */
+rw_stats parallel_tempering (dataset * ds, xbpm_prm * prm, double * supmat,
+                             double * pos_h, double * pos_v)
+{
+    int nrep = prm->nreplicas;
+    int rep, axis, parity = 0;
+    size_t done, ntrials = (prm->nrand + 1) / 2;
+    double best[2], dexp;
+    int best_rep[2] = {0, 0};
+
+    int nthreads = (prm->nthreads > 0) ? prm->nthreads : team_cores();
+    if (nthreads > nrep) nthreads = nrep;
+
+    rw_chain * chain    = calloc(2 * nrep, sizeof(rw_chain));
+    double * supmats    = calloc(16 * nrep, sizeof(double));
+    size_t * swap_try   = calloc(2 * nrep, sizeof(size_t));
+    size_t * swap_acc   = calloc(2 * nrep, sizeof(size_t));
+    if (chain == NULL || supmats == NULL ||
+        swap_try == NULL || swap_acc == NULL)
+    {
+        printf(" ERROR (parallel_tempering): could not allocate memory"
+               " for replicas. Aborting.\n");
+        exit(-1);
+    }
+
+    /* Replicas' chains, each with its own random stream. The last stream
+     * is used for the swap decisions. Streams are counted from the
+     * run's one. */
+    uint64_t seed = prm->seed;
+    pcg32_random_t rng;
+    pcg32_init_r(&rng, seed, prm->stream + 2 * nrep);
+
+    for (rep = 0; rep < nrep; rep++)
+    {
+        memcpy(supmats + 16 * rep, supmat, 16 * sizeof(double));
+        for (axis = 0; axis < 2; axis++)
+        {
+            rw_chain * ch = &chain[2 * rep + axis];
+            rw_chain_init(ch, ds, prm, supmats + 16 * rep + 8 * axis, axis,
+                          ntrials, seed, prm->stream + 2 * rep + axis);
+            ch->beta   = prm->beta * pow(prm->pt_ratio, rep);
+            ch->anneal = 0;
+        }
+    }
+    best[0] = chain[0].chi2;
+    best[1] = chain[1].chi2;
+
+    thread_team * team = team_create(nthreads);
+    pt_replicas pt = {chain, nrep, 0};
+
+    for (done = 0; done < ntrials; done += pt.ntrials)
+    {
+        /* Run all replicas concurrently up to the next swap. */
+        pt.ntrials = ntrials - done;
+        if (pt.ntrials > prm->pt_swap) pt.ntrials = prm->pt_swap;
+        team_run(team, pt_round_task, &pt);
+
+        for (axis = 0; axis < 2; axis++)
+        {
+            /* Attempt swaps of neighbouring replicas. */
+            for (rep = parity; rep + 1 < nrep; rep += 2)
+            {
+                rw_chain * ci = &chain[2 * rep + axis];
+                rw_chain * cj = &chain[2 * (rep + 1) + axis];
+                swap_try[2 * rep + axis]++;
+                dexp = (ci->beta - cj->beta) * Bk * (ci->chi2 - cj->chi2);
+                if (dexp >= 0.0 || pcg_double_r(&rng) <= exp(dexp))
+                {
+                    pt_states_swap(ci, cj);
+                    swap_acc[2 * rep + axis]++;
+                }
+            }
+
+            /* Keep the best state. */
+            for (rep = 0; rep < nrep; rep++)
+            {
+                rw_chain * ch = &chain[2 * rep + axis];
+                if (ch->chi2 < best[axis])
+                {
+                    best[axis] = ch->chi2;
+                    best_rep[axis] = rep;
+                    memcpy(supmat + 8 * axis, ch->supmat, 8 * sizeof(double));
+                }
+            }
+        }
+        parity ^= 1;
+    }
+    team_destroy(team);
+
+    /* Swap statistics. */
+    printf("##### Parallel tempering: %d replicas, %d threads,"
+           " swaps every %zu trials.\n", nrep, nthreads, prm->pt_swap);
+    printf("  pair        beta_i        beta_j   H swaps   V swaps\n");
+    for (rep = 0; rep + 1 < nrep; rep++)
+    {
+        printf(" %2d-%-2d  %12.4g  %12.4g  ", rep, rep + 1,
+               chain[2 * rep].beta, chain[2 * (rep + 1)].beta);
+        for (axis = 0; axis < 2; axis++)
+        {
+            size_t ntry = swap_try[2 * rep + axis];
+            printf(" %6.2lf %%", (ntry > 0) ?
+                   100.0 * (double) swap_acc[2 * rep + axis] / ntry : 0.0);
+        }
+        printf("\n");
+    }
+    printf(" Best chi2 H = %.6g (replica %d), V = %.6g (replica %d)\n\n",
+           best[0], best_rep[0], best[1], best_rep[1]);
+
+    /* Statistics of the coldest replica. */
+    rw_chain * ch = &chain[2 * (nrep - 1)];
+    rw_stats rws = {ch[0].imat,   ch[1].imat,
+                    ch[0].accept, ch[1].accept,
+                    ch[0].beta,   ch[1].beta,
+                    ch[0].step,   ch[1].step,
+                    best[0],      best[1], 0, 0};
+
+    for (rep = 0; rep < 2 * nrep; rep++)
+    {
+        rws.memo_lookups += chain[rep].memo.lookups;
+        rws.memo_hits    += chain[rep].memo.hits;
+        rws.failed       += chain[rep].nfailed;
+        rw_chain_free(&chain[rep]);
+    }
+    free(chain);
+    free(supmats);
+    free(swap_try);
+    free(swap_acc);
+
+    /* Final positions. */
+    positions_calc(ds, supmat,     ds->nom_h, pos_h);
+    positions_calc(ds, supmat + 8, ds->nom_v, pos_v);
+    return rws;
+}
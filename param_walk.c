@@ -0,0 +1,253 @@
+#include "prm_def.h"
+#include "simd_kernels.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Prototypes. Random walk chains. */
+void rw_chain_init (rw_chain * ch, const dataset * ds, const xbpm_prm * prm,
+                    double * supmat, int axis, size_t nrand,
+                    uint64_t seed, uint64_t stream);
+
+int rw_chain_cool (rw_chain * ch, size_t ii);
+
+void rw_chain_free (rw_chain * ch);
+
+/* Prototypes. Delta and sigma terms of ROI sites, and fit of the positions
+ * given by them.
+ */
+roi_terms roi_terms_alloc (const roi_data * rd, int axis, int single);
+
+void roi_terms_free (roi_terms * rt);
+
+void roi_terms_calc (roi_terms * rt, const double * supmat);
+
+void roi_terms_update (roi_terms * rt, size_t ielem, double dterm);
+
+kdchi2 roi_terms_fit (const roi_terms * rt, size_t ielem, double dterm);
+
+void roi_terms_fit_multi (const roi_terms * rt, const fit_move * mv, int mm,
+                          kdchi2 * kc);
+
+kdelta positions_calc (const dataset * ds, const double * supmat,
+                       const double * nominal_pos, double * pos);
+
+
+/* Build the map pm of parameterisation mode from the initial matrix
+ * supmat, and its initial parameters.
+ * PARAM_GAINS:  4 blade gains scaling the columns of supmat (H and V);
+ *               the parameters start at 1.
+ * PARAM_SHARED: the H delta row, the V delta row and a sigma row shared
+ *               by H and V, which starts at the mean of both.
+ */
+static void param_map_build (int mode, const double * supmat,
+                             param_map * pm)
+{
+    int ee, jj;
+
+    memset(pm, 0, sizeof(param_map));
+    switch (mode)
+    {
+    case PARAM_GAINS:
+        pm->npar = 4;
+        for (ee = 0; ee < 16; ee++)
+        {
+            pm->map[ee * pm->npar + ee % 4] = supmat[ee];
+        }
+        for (jj = 0; jj < 4; jj++) pm->par[jj] = 1.0;
+        break;
+
+    case PARAM_SHARED:
+        pm->npar = 12;
+        for (jj = 0; jj < 4; jj++)
+        {
+            pm->map[jj * pm->npar + jj]            = 1.0;
+            pm->map[(8 + jj) * pm->npar + 4 + jj]  = 1.0;
+            pm->map[(4 + jj) * pm->npar + 8 + jj]  = 1.0;
+            pm->map[(12 + jj) * pm->npar + 8 + jj] = 1.0;
+            pm->par[jj]     = supmat[jj];
+            pm->par[4 + jj] = supmat[8 + jj];
+            pm->par[8 + jj] = 0.5 * (supmat[4 + jj] + supmat[12 + jj]);
+        }
+        break;
+
+    default:
+        printf(" ERROR (param_map_build): unknown parameterisation %d."
+               " Aborting.\n", mode);
+        exit(-1);
+    }
+}
+
+
+/* Matrix supmat of the parameters of map pm.
+ */
+static void param_map_apply (const param_map * pm, double * supmat)
+{
+    for (int ee = 0; ee < 16; ee++)
+    {
+        supmat[ee] = 0.0;
+        for (int jj = 0; jj < pm->npar; jj++)
+        {
+            supmat[ee] += pm->map[ee * pm->npar + jj] * pm->par[jj];
+        }
+    }
+}
+
+
+/* Move mv of half axis of the matrix for a change dpar of parameter jj
+ * of map pm. Returns the number of blades it moves (0 if none).
+ */
+static int param_move (const param_map * pm, int axis, int jj, double dpar,
+                       fit_move * mv)
+{
+    int nb = 0;
+
+    memset(mv, 0, sizeof(fit_move));
+    for (int ib = 0; ib < 4; ib++)
+    {
+        double md = pm->map[(8 * axis + ib) * pm->npar + jj];
+        double ms = pm->map[(8 * axis + 4 + ib) * pm->npar + jj];
+        if (md == 0.0 && ms == 0.0) continue;
+        if (nb == 2)
+        {
+            printf(" ERROR (param_move): a parameter moves more than two"
+                   " blades. Aborting.\n");
+            exit(-1);
+        }
+        mv->bl[nb] = ib;
+        mv->ad[nb] = dpar * md;
+        mv->as[nb] = dpar * ms;
+        nb++;
+    }
+    return nb;
+}
+
+
+/* Random walk of the parameters of a reduced parameterisation
+ * (prm->param_mode) of the matrix supmat, proposing moves of one
+ * parameter at a time, which may change both halves. The H and V chi2
+ * are added up; temperature, step and stopping criteria follow the
+ * single walk rules, on the sum.
+ */
+rw_stats param_walk (dataset * ds, xbpm_prm * prm, double * supmat,
+                     double * pos_h, double * pos_v)
+{
+    const char * names[3] = {"full", "blade gains", "shared sigma row"};
+    param_map pm;
+    rw_chain ch;
+    roi_terms * terms[2];
+    fit_move mv[2];
+    int nb[2], axis, jj, ee;
+    double chi2[2], trial[2], dpar;
+    size_t imat[2] = {0, 0}, accept[2] = {0, 0};
+    const double * rnd;
+
+    param_map_build(prm->param_mode, supmat, &pm);
+    param_map_apply(&pm, supmat);
+
+    /* The chain of the H half carries the random numbers, temperature,
+     * step and counters; the V terms are kept aside. */
+    rw_chain_init(&ch, ds, prm, supmat, 0, prm->nrand,
+                  prm->seed, prm->stream);
+    roi_terms terms_v = roi_terms_alloc(&ds->rd, 1, prm->single);
+    roi_terms_calc(&terms_v, supmat + 8);
+    terms[0] = &ch.terms;
+    terms[1] = &terms_v;
+    chi2[0]  = ch.chi2;
+    chi2[1]  = roi_terms_fit(&terms_v, 0, 0.0).chi2;
+    ch.chi2  = chi2[0] + chi2[1];
+    ch.chi2_win = ch.chi2;
+    ch.nsteps   = pm.npar;
+
+    for (size_t it = 0; it < ch.nrand && !ch.stop; it++)
+    {
+        size_t ii = ch.iter++;
+
+        if (ch.rpos + 3 > RW_RBUF)
+        {
+            pcg32x_fill(&ch.rng, ch.rbuf, RW_RBUF);
+            ch.rpos = 0;
+        }
+        rnd = ch.rbuf + ch.rpos;
+        ch.rpos += 3;
+
+        /* Pick a parameter and a sign. */
+        jj   = (int) (rnd[0] * pm.npar);
+        dpar = (rnd[1] > 0.5) ? -ch.steps[jj] : ch.steps[jj];
+
+        /* Skip if an element would become zero. */
+        for (ee = 0; ee < 16; ee++)
+        {
+            if (pm.map[ee * pm.npar + jj] != 0.0 &&
+                supmat[ee] + dpar * pm.map[ee * pm.npar + jj] == 0.0) break;
+        }
+        if (ee < 16) continue;
+
+        /* Fit of each half the parameter moves. */
+        ch.imat++;
+        ch.el_prop[jj]++;
+        for (axis = 0; axis < 2; axis++)
+        {
+            trial[axis] = chi2[axis];
+            nb[axis] = param_move(&pm, axis, jj, dpar, &mv[axis]);
+            if (nb[axis] == 0) continue;
+
+            kdchi2 kc;
+            roi_terms_fit_multi(terms[axis], &mv[axis], 1, &kc);
+            if (kc.failed) break;
+            trial[axis] = kc.chi2;
+            imat[axis]++;
+        }
+
+        /* Accept or reject (a failed scaling rejects the change). */
+        if (axis == 2 &&
+            rnd[2] <= exp(-(trial[0] + trial[1] - ch.chi2) * ch.beta * Bk))
+        {
+            pm.par[jj] += dpar;
+            for (ee = 0; ee < 16; ee++)
+            {
+                double dterm = dpar * pm.map[ee * pm.npar + jj];
+                if (dterm == 0.0) continue;
+                supmat[ee] += dterm;
+                roi_terms_update(terms[ee / 8], ee % 8, dterm);
+            }
+            for (axis = 0; axis < 2; axis++)
+            {
+                if (nb[axis] > 0) accept[axis]++;
+                chi2[axis] = trial[axis];
+            }
+            ch.chi2 = chi2[0] + chi2[1];
+            ch.el_acc[jj]++;
+            ch.old_accept = ch.accept;
+            ch.accept++;
+        }
+
+        /* Temperature and step; the V terms are recalculated with the
+         * H ones. */
+        if (rw_chain_cool(&ch, ii)) roi_terms_calc(&terms_v, supmat + 8);
+    }
+
+    /* Parameters found. */
+    printf("##### Parameterisation: %s, %d parameters.\n",
+           names[prm->param_mode], pm.npar);
+    for (jj = 0; jj < pm.npar; jj++)
+    {
+        printf(" %10.6lf%s", pm.par[jj], (jj % 4 == 3) ? "\n" : " ");
+    }
+    printf(" Acceptance rate        = %6.2lf %%\n\n",
+           100.0 * (double) ch.accept / (double) (ch.imat ? ch.imat : 1));
+
+    rw_stats rws = {imat[0], imat[1], accept[0], accept[1],
+                    ch.beta, ch.beta, ch.step, ch.step,
+                    chi2[0], chi2[1], 0, 0,
+                    ch.iter, ch.iter, ch.stop, ch.stop};
+
+    roi_terms_free(&terms_v);
+    rw_chain_free(&ch);
+
+    /* Final positions. */
+    positions_calc(ds, supmat,     ds->nom_h, pos_h);
+    positions_calc(ds, supmat + 8, ds->nom_v, pos_v);
+    return rws;
+}
@@ -1,4 +1,5 @@
 #include "prm_def.h"
+#include "simd_kernels.h"
 // #include "pcg_random.h"
 
 #include <errno.h>
@@ -10,6 +11,88 @@
 /* prototype: help text. */
 void help(void);
 
+/* Prototype: cooling schedule code of a name. */
+int rw_schedule_by_name (const char * name);
+
+/* Codes of the options given only by long names. */
+enum
+{
+    OPT_PT_RATIO = 256,
+    OPT_PT_SWAP,
+    OPT_JITTER,
+    OPT_STREAM,
+    OPT_SPECULATE,
+    OPT_CACHE,
+    OPT_VARPRO,
+    OPT_POLISH,
+    OPT_CMA,
+    OPT_POPSIZE,
+    OPT_COMPARE,
+    OPT_TOL,
+    OPT_WINDOW,
+    OPT_STEP_MIN,
+    OPT_TIME,
+    OPT_TARGET,
+    OPT_SCHEDULE,
+    OPT_ELEMENT_STEPS,
+    OPT_CONVERT,
+    OPT_NO_DATA_CACHE,
+    OPT_NPY_OUT
+};
+
+/* Parse the coarse levels schedule, "stride[:fraction],...", from the
+ * coarsest level to the finest; the full ROI comes last with the trials
+ * left. Levels without a fraction share the trials equally with the full
+ * ROI.
+ */
+static void levels_parse (const char * sched, xbpm_prm * prm)
+{
+    char buffer[256], * tok, * save, * colon;
+    double fsum = 0.0;
+    int il, nfree = 0;
+
+    strncpy(buffer, sched, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = '\0';
+    prm->nlevels = 0;
+
+    for (tok = strtok_r(buffer, ",", &save); tok != NULL;
+         tok = strtok_r(NULL, ",", &save))
+    {
+        if (prm->nlevels == LEVELS_MAX)
+        {
+            printf(" ERROR: at most %d coarse levels. Aborting.\n",
+                   LEVELS_MAX);
+            exit(-1);
+        }
+        il = prm->nlevels++;
+        prm->level_stride[il] = (size_t) strtoul(tok, NULL, 10);
+        colon = strchr(tok, ':');
+        prm->level_frac[il] = (colon != NULL) ? atof(colon + 1) : -1.0;
+
+        if (prm->level_stride[il] < 2 ||
+            (colon != NULL && prm->level_frac[il] <= 0.0))
+        {
+            printf(" ERROR: invalid level '%s' (stride must be at least 2"
+                   " and fraction positive). Aborting.\n", tok);
+            exit(-1);
+        }
+        if (colon != NULL) fsum += prm->level_frac[il];
+        else nfree++;
+    }
+
+    for (il = 0; il < prm->nlevels; il++)
+    {
+        if (prm->level_frac[il] < 0.0)
+            prm->level_frac[il] = (1.0 - fsum) / (nfree + 1);
+    }
+    if (fsum >= 1.0)
+    {
+        printf(" ERROR: coarse levels take all the trials. Aborting.\n");
+        exit(-1);
+    }
+}
+
+
 /* Initialize parameters.
  * Define default values for the general parameters.
  */
@@ -21,9 +104,44 @@ void parameters_initialize (xbpm_prm * prm)
     prm->roi_from =   -4.0;
     prm->roi_to   =    4.0;
     prm->nsites   =      0;
+    prm->simd     = SIMD_AUTO;
+    prm->single   =      0;
+    prm->nthreads =      0;
+    prm->nreplicas =     1;
+    prm->pt_ratio =    1.5;
+    prm->pt_swap  =    100;
+    prm->nstarts  =      1;
+    prm->jitter   =   0.01;
+    prm->seed     =      0;
+    prm->seed_set =      0;
+    prm->stream   =      0;
+    prm->ntries   =      1;
+    prm->speculate =     0;
+    prm->split    =     -1;
+    prm->memo     =      0;
+    prm->varpro   =      0;
+    prm->polish   =    0.0;
+    prm->cma      =      0;
+    prm->popsize  =      0;
+    prm->compare  =      0;
+    prm->wall     =    0.0;
+    prm->param_mode = PARAM_FULL;
+    prm->tol      =    0.0;
+    prm->window   =  10000;
+    prm->step_min =    0.0;
+    prm->time     =    0.0;
+    prm->time_end =    0.0;
+    prm->target   =    0.0;
+    prm->schedule =  SCHED_DEFAULT;
+    prm->sched_prm =   0.0;
+    prm->element_steps = 0;
+    prm->nlevels  =      0;
     strcpy(prm->datafile, "");
     strcpy(prm->matfile, "");
     prm->outfile[0] = '\0';
+    prm->convfile[0] = '\0';
+    prm->npyout[0] = '\0';
+    prm->data_cache = 1;
 }
 
 
@@ -40,15 +158,47 @@ xbpm_prm parameters_read (int argc, char **argv)
     {
         /* "name", no_argument / required_argument, 0 /
             &verbose_flag, 'symbol' */
-        {"help",  no_argument, 0, 'H'},
+        {"help",    no_argument,       0, 'H'},
+        {"kernels", required_argument, 0, 'k'},
+        {"float",   no_argument,       0, 'F'},
+        {"threads", required_argument, 0, 'j'},
+        {"replicas", required_argument, 0, 'R'},
+        {"pt-ratio", required_argument, 0, OPT_PT_RATIO},
+        {"pt-swap",  required_argument, 0, OPT_PT_SWAP},
+        {"starts",   required_argument, 0, 'K'},
+        {"jitter",   required_argument, 0, OPT_JITTER},
+        {"seed",     required_argument, 0, 'S'},
+        {"stream",   required_argument, 0, OPT_STREAM},
+        {"tries",    required_argument, 0, 'M'},
+        {"speculate", required_argument, 0, OPT_SPECULATE},
+        {"split",    required_argument, 0, 'p'},
+        {"cache",    no_argument,       0, OPT_CACHE},
+        {"varpro",   no_argument,       0, OPT_VARPRO},
+        {"polish",   required_argument, 0, OPT_POLISH},
+        {"cma",      no_argument,       0, OPT_CMA},
+        {"popsize",  required_argument, 0, OPT_POPSIZE},
+        {"compare",  no_argument,       0, OPT_COMPARE},
+        {"params",   required_argument, 0, 'P'},
+        {"tol",      required_argument, 0, OPT_TOL},
+        {"window",   required_argument, 0, OPT_WINDOW},
+        {"step-min", required_argument, 0, OPT_STEP_MIN},
+        {"time",     required_argument, 0, OPT_TIME},
+        {"target",   required_argument, 0, OPT_TARGET},
+        {"schedule", required_argument, 0, OPT_SCHEDULE},
+        {"element-steps", no_argument,  0, OPT_ELEMENT_STEPS},
+        {"convert",  required_argument, 0, OPT_CONVERT},
+        {"no-data-cache", no_argument,  0, OPT_NO_DATA_CACHE},
+        {"npy-out",  required_argument, 0, OPT_NPY_OUT},
+        {"levels",   required_argument, 0, 'L'},
         //{"split",  no_argument, 0, 'S'},
         {0, 0, 0, 0}
     };
     /* getopt_long stores the option index here. */
     int option_index = 0;
 
-    while ((opt = getopt_long(argc, argv, "hHb:d:f:m:n:o:r:s:u:",
-                            long_options, &option_index)) != -1)
+    while ((opt = getopt_long(argc, argv, "hHb:d:Ff:j:k:K:L:m:M:n:"
+                              "o:p:P:r:R:s:S:u:",
+                              long_options, &option_index)) != -1)
     {
         switch (opt)
         {
@@ -56,10 +206,100 @@ xbpm_prm parameters_read (int argc, char **argv)
             prm.beta = atof(optarg);
             break;
         
+        case OPT_CACHE:             /* Cache evaluated states. */
+            prm.memo = 1;
+            break;
+
+        case OPT_VARPRO:            /* Walk the sigma rows only. */
+            prm.varpro = 1;
+            break;
+
+        case OPT_CMA:               /* Optimize by CMA-ES. */
+            prm.cma = 1;
+            break;
+
+        case OPT_POPSIZE:           /* CMA-ES population. */
+            prm.popsize = atoi(optarg);
+            break;
+
+        case OPT_COMPARE:           /* CMA-ES against the walk. */
+            prm.cma     = 1;
+            prm.compare = 1;
+            break;
+
+        case OPT_TOL:               /* Stop: chi2 improvement. */
+            prm.tol = atof(optarg);
+            break;
+
+        case OPT_WINDOW:            /* Window of the improvement. */
+            prm.window = (size_t) strtoul(optarg, NULL, 10);
+            break;
+
+        case OPT_STEP_MIN:          /* Stop: step floor. */
+            prm.step_min = atof(optarg);
+            break;
+
+        case OPT_TIME:              /* Stop: time budget. */
+            prm.time = atof(optarg);
+            break;
+
+        case OPT_TARGET:            /* Stop: target chi2. */
+            prm.target = atof(optarg);
+            break;
+
+        case OPT_SCHEDULE:          /* Cooling schedule[:parameter]. */
+        {
+            char * colon = strchr(optarg, ':');
+            if (colon != NULL)
+            {
+                *colon = '\0';
+                prm.sched_prm = atof(colon + 1);
+            }
+            prm.schedule = rw_schedule_by_name(optarg);
+            if (prm.schedule < 0 || prm.sched_prm < 0.0)
+            {
+                printf(" ERROR: unknown cooling schedule '%s' (use default,"
+                       " exp, lam or target, with a positive parameter)."
+                       " Aborting.\n", optarg);
+                exit(-1);
+            }
+            break;
+        }
+
+        case OPT_CONVERT:           /* Write a binary data file. */
+            strcpy(prm.convfile, optarg);
+            break;
+
+        case OPT_NPY_OUT:           /* Results to .npy files. */
+            strcpy(prm.npyout, optarg);
+            break;
+
+        case OPT_NO_DATA_CACHE:     /* Do not cache text data. */
+            prm.data_cache = 0;
+            break;
+
+        case OPT_ELEMENT_STEPS:     /* Adapt a step per element. */
+            prm.element_steps = 1;
+            break;
+
+        case OPT_POLISH:            /* Levenberg-Marquardt refinement. */
+            prm.polish = atof(optarg);
+            if (prm.polish <= 0.0)
+            {
+                printf(" ERROR: the refinement tolerance must be"
+                       " positive. Aborting.\n");
+                exit(-1);
+            }
+            break;
+
         case 'd':                   /* Input data file. */
             strcpy(prm.datafile, optarg);
             break;
         
+        case 'F':                   /* Single precision evaluation. */
+            prm.single = 1;
+            break;
+
         case 'f':                    /* ROI initial index. */
             prm.roi_from = atof(optarg);
             break;
@@ -72,10 +312,55 @@ xbpm_prm parameters_read (int argc, char **argv)
             help();
             break;
 
+        case 'j':                   /* Number of threads. */
+            prm.nthreads = atoi(optarg);
+            break;
+
+        case 'k':                   /* Vector kernels. */
+            prm.simd = simd_level_by_name(optarg);
+            if (prm.simd == -2)
+            {
+                printf(" ERROR: unknown kernels '%s' (use auto, scalar,"
+                       " sse2, avx2 or avx512). Aborting.\n", optarg);
+                exit(-1);
+            }
+            break;
+
+        case 'K':                   /* Multi-start walks. */
+            prm.nstarts = atoi(optarg);
+            break;
+
+        case OPT_JITTER:            /* Jitter of start matrices. */
+            prm.jitter = atof(optarg);
+            break;
+
+        case 'P':                   /* Parameterisation of the matrix. */
+            if (strcmp(optarg, "full") == 0)
+                prm.param_mode = PARAM_FULL;
+            else if (strcmp(optarg, "gains") == 0)
+                prm.param_mode = PARAM_GAINS;
+            else if (strcmp(optarg, "shared") == 0)
+                prm.param_mode = PARAM_SHARED;
+            else
+            {
+                printf(" ERROR: unknown parameterisation '%s' (use full,"
+                       " gains or shared). Aborting.\n", optarg);
+                exit(-1);
+            }
+            break;
+
+        case 'L':                   /* Coarse ROI levels. */
+            levels_parse(optarg, &prm);
+            break;
+
         case 'm':                   /* Initial matrix file. */
             strcpy(prm.matfile, optarg);
             break;
         
+        case 'M':                   /* Candidates per trial. */
+            prm.ntries = atoi(optarg);
+            break;
+
         case 'n':                   /* Total number of sites. */
             prm.nsites = (size_t) strtoul(optarg, NULL, 10);
             break;
@@ -84,14 +369,43 @@ xbpm_prm parameters_read (int argc, char **argv)
             strcpy(prm.outfile, optarg);
             break;
         
+        case 'p':                    /* Threads splitting the ROI. */
+            prm.split = atoi(optarg);
+            break;
+
         case 'r':                    /* Number of random changes. */
             prm.nrand = (int) atof(optarg);
             break;
 
+        case 'R':                    /* Parallel tempering replicas. */
+            prm.nreplicas = atoi(optarg);
+            break;
+
+        case OPT_PT_RATIO:           /* Ratio of replicas' beta. */
+            prm.pt_ratio = atof(optarg);
+            break;
+
+        case OPT_PT_SWAP:            /* Trials between swaps. */
+            prm.pt_swap = (size_t) strtoul(optarg, NULL, 10);
+            break;
+
         case 's':                    /* Step size. */
             prm.step = atof(optarg);
             break;
 
+        case 'S':                    /* Seed of random streams. */
+            prm.seed     = (uint64_t) strtoull(optarg, NULL, 0);
+            prm.seed_set = 1;
+            break;
+
+        case OPT_STREAM:             /* First random stream. */
+            prm.stream = (uint64_t) strtoull(optarg, NULL, 0);
+            break;
+
+        case OPT_SPECULATE:          /* Speculative batch width. */
+            prm.speculate = atoi(optarg);
+            break;
+
         case 'u':                  /* ROI last index. */
             prm.roi_to = atof(optarg);
             break;
@@ -110,10 +424,144 @@ xbpm_prm parameters_read (int argc, char **argv)
         exit(-1);
     }
 
-    if (prm.nsites == 0)
+    if (prm.nreplicas < 1 || prm.pt_ratio <= 0.0 || prm.pt_swap == 0)
+    {
+        printf(" ERROR: replicas, ratio and swap interval of parallel"
+            " tempering must be positive. Aborting.\n");
+        exit(-1);
+    }
+
+    if (prm.ntries < 1 || prm.ntries > MTM_MAX)
+    {
+        printf(" ERROR: number of candidates per trial must be between"
+               " 1 and %d. Aborting.\n", MTM_MAX);
+        exit(-1);
+    }
+
+    if (prm.speculate > 1 &&
+        (prm.ntries > 1 || prm.nstarts > 1 || prm.nreplicas > 1))
+    {
+        printf(" ERROR: speculative execution applies to the single"
+            " Metropolis walk only (no -M, -K or -R). Aborting.\n");
+        exit(-1);
+    }
+
+    if (prm.split > ROI_SPLIT_MAX)
+    {
+        printf(" ERROR: at most %d threads may split the ROI."
+               " Aborting.\n", ROI_SPLIT_MAX);
+        exit(-1);
+    }
+
+    if (prm.split > 1 && prm.speculate > 1)
+    {
+        printf(" ERROR: ROI split (-p) and speculative execution"
+            " cannot be combined. Aborting.\n");
+        exit(-1);
+    }
+
+    if (prm.split > 1 && (prm.nreplicas > 1 || prm.nstarts > 1 ||
+                          prm.cma || prm.ntries > 1))
+    {
+        printf(" ERROR: ROI split (-p) applies to the plain walk only,"
+            " not to -R, -K, --cma or -M. Aborting.\n");
+        exit(-1);
+    }
+
+    if (prm.memo && (prm.ntries > 1 || prm.speculate > 1 ||
+                     prm.schedule == SCHED_TARGET))
+    {
+        printf(" ERROR: the states cache applies to single proposal"
+            " trials only (no -M or --speculate), and not to the target"
+            " schedule. Aborting.\n");
+        exit(-1);
+    }
+
+    if (prm.varpro && (prm.ntries > 1 || prm.speculate > 1 ||
+                       prm.split > 1 || prm.memo || prm.single))
+    {
+        printf(" ERROR: the sigma-only walk (--varpro) cannot be combined"
+            " with -M, --speculate, -p, --cache or -F. Aborting.\n");
+        exit(-1);
+    }
+
+    if (prm.cma && (prm.nreplicas > 1 || prm.nstarts > 1 ||
+                    prm.ntries > 1 || prm.speculate > 1 || prm.varpro ||
+                    prm.nlevels > 0))
+    {
+        printf(" ERROR: CMA-ES (--cma) cannot be combined with -R, -K,"
+            " -M, --speculate, --varpro or -L. Aborting.\n");
+        exit(-1);
+    }
+
+    if (prm.param_mode != PARAM_FULL &&
+        (prm.nreplicas > 1 || prm.nstarts > 1 || prm.ntries > 1 ||
+         prm.speculate > 1 || prm.split > 1 || prm.memo || prm.varpro ||
+         prm.nlevels > 0 || prm.cma || prm.polish > 0.0))
+    {
+        printf(" ERROR: reduced parameterisations (-P) are walked by a"
+            " single chain, without -R, -K, -M, --speculate, -p, --cache,"
+            " --varpro, -L, --cma or --polish. Aborting.\n");
+        exit(-1);
+    }
+
+    if (prm.tol < 0.0 || prm.window < ACCEPT_CHECK_INTERVAL ||
+        prm.step_min < 0.0 || prm.time < 0.0 || prm.target < 0.0)
+    {
+        printf(" ERROR: stopping criteria must be positive, and the"
+            " window at least %d trials. Aborting.\n",
+            ACCEPT_CHECK_INTERVAL);
+        exit(-1);
+    }
+
+    if ((prm.tol > 0.0 || prm.step_min > 0.0 || prm.target > 0.0 ||
+         prm.time > 0.0) && prm.nreplicas > 1)
+    {
+        printf(" ERROR: stopping criteria do not apply to parallel"
+            " tempering. Aborting.\n");
+        exit(-1);
+    }
+
+    if ((prm.tol > 0.0 || prm.step_min > 0.0 || prm.target > 0.0) &&
+        prm.cma)
+    {
+        printf(" ERROR: only the time budget (--time) applies to"
+            " CMA-ES. Aborting.\n");
+        exit(-1);
+    }
+
+    if ((prm.schedule != SCHED_DEFAULT || prm.element_steps) &&
+        (prm.nreplicas > 1 || prm.cma))
+    {
+        printf(" ERROR: cooling schedules and element steps do not apply"
+            " to parallel tempering or CMA-ES. Aborting.\n");
+        exit(-1);
+    }
+
+    if (prm.popsize != 0 && (prm.popsize < 4 || prm.popsize > 4096))
+    {
+        printf(" ERROR: the CMA-ES population must be between 4 and"
+            " 4096. Aborting.\n");
+        exit(-1);
+    }
+
+    if (prm.nlevels > 0 && prm.nreplicas > 1)
+    {
+        printf(" ERROR: coarse ROI levels (-L) and parallel tempering"
+            " cannot be combined. Aborting.\n");
+        exit(-1);
+    }
+
+    if (prm.nstarts < 1)
+    {
+        printf(" ERROR: number of walks must be positive. Aborting.\n");
+        exit(-1);
+    }
+
+    if (prm.nstarts > 1 && prm.nreplicas > 1)
     {
-        printf(" ERROR: number of sites not defined."
-            " Use '-h' to see options. Aborting.\n");
+        printf(" ERROR: multi-start (-K) and parallel tempering (-R)"
+            " cannot be combined. Aborting.\n");
         exit(-1);
     }
 
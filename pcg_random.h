@@ -3,54 +3,144 @@
  * on 2023-11-21.
  */
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifndef PCG_RANDOM
 #define PCG_RANDOM 1
 
-// #ifndef RMAX
-#define RMAX  9223372036854775808.0    /* 2**63 */
-//#define RMAX  2147483648.0    /* 2**31 */
-
-static uint64_t       state      = 0x4d595df4d0f33173;   // Or something seed-dependent
 static uint64_t const multiplier = 6364136223846793005u;
-static uint64_t const increment  = 1442695040888963407u; // Or an arbitrary odd constant
 
-static uint32_t rotr32 (uint32_t x, unsigned r)
+static inline uint32_t rotr32 (uint32_t x, unsigned r)
 {
   return x >> r | x << (-r & 31);
 }
 
-uint32_t pcg32 (void)
+/* Generator with its own state and stream (increment), so that several
+ * chains may draw random numbers independently (and concurrently). A
+ * sequence is fully determined by the (seed, stream) pair given to
+ * pcg32_init_r.
+ */
+typedef struct
+{
+  uint64_t state;
+  uint64_t inc;                                /* Must be odd.     */
+} pcg32_random_t;
+
+static inline uint32_t pcg32_r (pcg32_random_t * rng)
 {
-  uint64_t x = state;
-  unsigned count = (unsigned)(x >> 59);        /* 59 = 64 - 5      */
-  
-  state = x * multiplier + increment;
-  x ^= x >> 18;                                /* 18 = (64 - 27)/2 */
-  return rotr32((uint32_t)(x >> 27), count);   /* 27 = 32 - 5      */
+  uint64_t x = rng->state;
+  unsigned count = (unsigned)(x >> 59);
+
+  rng->state = x * multiplier + rng->inc;
+  x ^= x >> 18;
+  return rotr32((uint32_t)(x >> 27), count);
 }
 
-void pcg32_init (uint64_t seed)
+/* Seed generator rng; each stream gives an independent sequence. */
+static inline void pcg32_init_r (pcg32_random_t * rng,
+                                 uint64_t seed, uint64_t stream)
 {
-  state = seed + increment;
-  (void)pcg32();
+  rng->state = 0u;
+  rng->inc   = (stream << 1u) | 1u;
+  (void)pcg32_r(rng);
+  rng->state += seed;
+  (void)pcg32_r(rng);
 }
 
-long double pcg_double (void)
+/* Advance generator rng by delta steps (delta may be huge: the jump
+ * takes O(log delta) operations), as if pcg32_r was called delta times.
+ * From M. E. O'Neill's pcg_advance_lcg_64.
+ */
+static inline void pcg32_advance_r (pcg32_random_t * rng, uint64_t delta)
 {
-  /* Assemble a 64-bit random integer. */
-  uint64_t x = ((uint64_t) pcg32() << 31) | pcg32();
+  uint64_t cur_mult = multiplier;
+  uint64_t cur_plus = rng->inc;
+  uint64_t acc_mult = 1u;
+  uint64_t acc_plus = 0u;
 
-  //printf(" DEBUG x: %li \n", x);
-  
-  /* Cast to double and normalize it. */
-  return x / RMAX;
-  //return (double) x / RMAX;
-  //return ((double)x * 100.0) / RMAX;
+  while (delta > 0)
+  {
+    if (delta & 1u)
+    {
+      acc_mult *= cur_mult;
+      acc_plus  = acc_plus * cur_mult + cur_plus;
+    }
+    cur_plus  = (cur_mult + 1u) * cur_plus;
+    cur_mult *= cur_mult;
+    delta    /= 2;
+  }
+  rng->state = acc_mult * rng->state + acc_plus;
+}
+
+/* Double in [1, 2) with the 52 high bits of x as mantissa, minus 1:
+ * uniform in [0, 1) without any division or long double arithmetic.
+ */
+static inline double pcg_bits_double (uint64_t x)
+{
+  union { uint64_t u; double d; } b;
+  b.u = (x >> 12) | UINT64_C(0x3FF0000000000000);
+  return b.d - 1.0;
+}
+
+/* Random number in [0, 1) from two outputs of rng. */
+static inline double pcg_double_r (pcg32_random_t * rng)
+{
+  uint64_t hi = pcg32_r(rng);
+  return pcg_bits_double((hi << 32) | pcg32_r(rng));
 }
 
-/* Generic alias for the standard PCG generator. */
-//double (*pcg_rand)() = &pcg_double;
+/* Block generator: PCG_LANES generators stepped together, which the
+ * compiler can vectorize. The lanes are consecutive subsequences, 2^61
+ * steps apart, of one (seed, stream) sequence.
+ */
+#define PCG_LANES  8
+
+typedef struct
+{
+  uint64_t state[PCG_LANES];
+  uint64_t inc;
+} pcg32x_random_t;
+
+static inline void pcg32x_init (pcg32x_random_t * rng,
+                                uint64_t seed, uint64_t stream)
+{
+  pcg32_random_t lane;
+  pcg32_init_r(&lane, seed, stream);
+  rng->inc = lane.inc;
+  for (int ll = 0; ll < PCG_LANES; ll++)
+  {
+    rng->state[ll] = lane.state;
+    pcg32_advance_r(&lane, UINT64_C(1) << 61);
+  }
+}
+
+/* Fill buf with nn uniform numbers in [0, 1). Each round of the lanes
+ * gives PCG_LANES / 2 numbers; outputs beyond nn are discarded.
+ */
+static inline void pcg32x_fill (pcg32x_random_t * rng, double * buf,
+                                size_t nn)
+{
+  uint32_t out[PCG_LANES];
+  size_t ii, jj;
+
+  for (ii = 0; ii < nn; ii += PCG_LANES / 2)
+  {
+    for (int ll = 0; ll < PCG_LANES; ll++)
+    {
+      uint64_t x = rng->state[ll];
+      unsigned count = (unsigned)(x >> 59);
+
+      rng->state[ll] = x * multiplier + rng->inc;
+      x ^= x >> 18;
+      out[ll] = rotr32((uint32_t)(x >> 27), count);
+    }
+    for (jj = 0; jj < PCG_LANES / 2 && ii + jj < nn; jj++)
+    {
+      buf[ii + jj] = pcg_bits_double(((uint64_t) out[jj] << 32)
+                                     | out[jj + PCG_LANES / 2]);
+    }
+  }
+}
 
 #endif
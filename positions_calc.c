@@ -1,6 +1,10 @@
 // #include "prm_def.h"
 #include "matrix_operations.h"
+#include "simd_kernels.h"
+#include "thread_team.h"
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <math.h>
 
 /* Calculate positions (pos) by multiplying blades' measurements in dataset
@@ -12,21 +16,8 @@
 void raw_positions_calc (const dataset * ds, const double * supmat,
                          double * pos)
 {
-    double delta, sigma;
-    for (size_t ii = 0; ii < ds->nsites; ii++)
-    {
-        delta = supmat[0] * ds->to[ii]
-              + supmat[1] * ds->ti[ii] 
-              + supmat[2] * ds->bi[ii]
-              + supmat[3] * ds->bo[ii]; 
-
-        sigma = supmat[4] * ds->to[ii]
-              + supmat[5] * ds->ti[ii] 
-              + supmat[6] * ds->bi[ii]
-              + supmat[7] * ds->bo[ii]; 
-
-        pos[ii] = (delta / sigma);
-    }
+    const double * const blades[4] = {ds->to, ds->ti, ds->bi, ds->bo};
+    simd.raw_positions(blades, supmat, pos, ds->nsites);
 }
 
 
@@ -55,18 +46,27 @@ kdelta positions_scaling (const double * xp, const double * yp,
 }    
 
 
-/* Calculate positions multiplying by coefficients of suppression matrix.
- * Then scale calculated positions based on nominal positions.
+/* Return the column of blade ib readings in the compacted ROI data rd, in
+ * the order of the suppression matrix columns (to, ti, bi, bo).
  */
-kdelta positions_calc (const dataset * ds, const double * supmat,
-                       const double * nominal_pos, double * pos)
+const double * roi_blade_column (const roi_data * rd, size_t ib)
 {
+    switch (ib)
+    {
+    case 0:  return rd->to;
+    case 1:  return rd->ti;
+    case 2:  return rd->bi;
+    default: return rd->bo;
+    }
+}
 
-    
-    /* Calculate positions (whole grid) according to suppression matrix. */
-    raw_positions_calc(ds, supmat, pos);
 
-    /* Scale positions. Only the ROI is relevant for scaling. */
+/* Scale raw positions pos (whole grid) based on nominal positions.
+ * Only the ROI is relevant for scaling.
+ */
+static kdelta positions_rescale (const dataset * ds,
+                                 const double * nominal_pos, double * pos)
+{
     kdelta kd = positions_scaling(pos, nominal_pos, &(ds->roi));
 
     /* If scaling is not successful. */
@@ -85,3 +85,485 @@ kdelta positions_calc (const dataset * ds, const double * supmat,
     return kd;
 }
 
+
+/* Calculate positions multiplying by coefficients of suppression matrix.
+ * Then scale calculated positions based on nominal positions.
+ */
+kdelta positions_calc (const dataset * ds, const double * supmat,
+                       const double * nominal_pos, double * pos)
+{
+    /* Calculate positions (whole grid) according to suppression matrix. */
+    raw_positions_calc(ds, supmat, pos);
+
+    return positions_rescale(ds, nominal_pos, pos);
+}
+
+
+/* Single precision counterpart of roi_blade_column.
+ */
+const float * roi_blade_column_f (const roi_data * rd, size_t ib)
+{
+    switch (ib)
+    {
+    case 0:  return rd->fto;
+    case 1:  return rd->fti;
+    case 2:  return rd->fbi;
+    default: return rd->fbo;
+    }
+}
+
+
+/* Allocate the delta and sigma terms of the ROI data rd for the horizontal
+ * (axis = 0) or vertical (axis = 1) positions, in single precision if
+ * single is not zero. The terms must be calculated by roi_terms_calc.
+ */
+roi_terms roi_terms_alloc (const roi_data * rd, int axis, int single)
+{
+    roi_terms rt;
+    size_t elsize = single ? sizeof(float) : sizeof(double);
+
+    rt.rd      = rd;
+    rt.nominal = (axis == 0) ? rd->nom_h : rd->nom_v;
+    rt.single  = single;
+    rt.mem     = aligned_alloc(ROI_ALIGN, 2 * rd->npad * elsize);
+    if (rt.mem == NULL)
+    {
+        printf(" ERROR (roi_terms_alloc): could not allocate memory"
+               " for delta/sigma terms. Aborting.\n");
+        exit(-1);
+    }
+    memset(rt.mem, 0, 2 * rd->npad * elsize);
+
+    rt.delta  = single ? NULL : (double *) rt.mem;
+    rt.sigma  = single ? NULL : rt.delta + rd->npad;
+    rt.fdelta = single ? (float *) rt.mem : NULL;
+    rt.fsigma = single ? rt.fdelta + rd->npad : NULL;
+    rt.team   = NULL;
+    return rt;
+}
+
+
+/* Free up the memory of terms rt.
+ */
+void roi_terms_free (roi_terms * rt)
+{
+    free(rt->mem);
+    rt->mem = NULL;
+}
+
+
+/* Calculate the delta and sigma terms of every ROI site separately, that
+ * is, the products of the blades' measurements by the first and second rows
+ * of the (half) suppression matrix supmat. Positions are delta / sigma.
+ * The terms are stored in the order of the compacted ROI data. Single
+ * precision terms are calculated in double and rounded.
+ */
+void roi_terms_calc (roi_terms * rt, const double * supmat)
+{
+    const roi_data * rd = rt->rd;
+    double delta, sigma;
+    for (size_t ii = 0; ii < rd->nsites; ii++)
+    {
+        delta = supmat[0] * rd->to[ii]
+              + supmat[1] * rd->ti[ii] 
+              + supmat[2] * rd->bi[ii]
+              + supmat[3] * rd->bo[ii]; 
+
+        sigma = supmat[4] * rd->to[ii]
+              + supmat[5] * rd->ti[ii] 
+              + supmat[6] * rd->bi[ii]
+              + supmat[7] * rd->bo[ii]; 
+
+        if (rt->single)
+        {
+            rt->fdelta[ii] = (float) delta;
+            rt->fsigma[ii] = (float) sigma;
+        }
+        else
+        {
+            rt->delta[ii] = delta;
+            rt->sigma[ii] = sigma;
+        }
+    }
+}
+
+
+/* Add the change dterm of element ielem to the terms of sites lo to hi - 1
+ * (see roi_terms_update).
+ */
+static void terms_update_range (roi_terms * rt, size_t ielem, double dterm,
+                                size_t lo, size_t hi)
+{
+    const roi_data * rd = rt->rd;
+    if (rt->single)
+    {
+        float * ft = (ielem < 4) ? rt->fdelta : rt->fsigma;
+        const float * fb = roi_blade_column_f(rd, ielem % 4);
+        float fd = (float) dterm;
+        for (size_t ii = lo; ii < hi; ii++)
+        {
+            ft[ii] += fd * fb[ii];
+        }
+    }
+    else
+    {
+        vector_axpy(dterm, roi_blade_column(rd, ielem % 4) + lo,
+                    ((ielem < 4) ? rt->delta : rt->sigma) + lo, hi - lo);
+    }
+}
+
+
+/* Range [lo, hi) of the nn ROI sites handled by thread tid of nthreads:
+ * contiguous chunks, multiple of ROI_PAD sites to keep them aligned.
+ */
+static void roi_split_range (size_t nn, int tid, int nthreads,
+                             size_t * lo, size_t * hi)
+{
+    size_t chunk = (nn + nthreads - 1) / nthreads;
+    chunk = (chunk + ROI_PAD - 1) / ROI_PAD * ROI_PAD;
+    *lo = (size_t) tid * chunk;
+    if (*lo > nn) *lo = nn;
+    *hi = (*lo + chunk < nn) ? *lo + chunk : nn;
+}
+
+
+/* Change of element ielem of the terms rt, split over a team. */
+typedef struct
+{
+    roi_terms * rt;
+    size_t ielem;
+    double dterm;
+} roi_split_update;
+
+static void roi_update_task (void * arg, int tid, int nthreads)
+{
+    roi_split_update * su = (roi_split_update *) arg;
+    size_t lo, hi;
+    roi_split_range(su->rt->rd->nsites, tid, nthreads, &lo, &hi);
+    terms_update_range(su->rt, su->ielem, su->dterm, lo, hi);
+}
+
+
+/* Add the change dterm of element ielem (0 to 7) of half the suppression
+ * matrix to the terms rt: blade (ielem % 4) readings times dterm are added
+ * to delta (ielem < 4) or to sigma. The sites are split over the team of
+ * rt, if any.
+ */
+void roi_terms_update (roi_terms * rt, size_t ielem, double dterm)
+{
+    if (rt->team != NULL)
+    {
+        roi_split_update su = {rt, ielem, dterm};
+        team_run(rt->team, roi_update_task, &su);
+    }
+    else
+    {
+        terms_update_range(rt, ielem, dterm, 0, rt->rd->nsites);
+    }
+}
+
+
+/* Scaling parameters and chi2 from regression sums (Sx, Sxx, Sy, Sxy, Syy)
+ * of nsites positions shifted by x0 and nominal positions shifted by y0.
+ */
+static kdchi2 sums_fit (const double sums[5], size_t nsites,
+                        double x0, double y0)
+{
+    kdchi2 kc = {1.0, 0.0, 0.0, 1};
+    double nn  = (double) nsites;
+    double sx  = sums[0], sxx = sums[1], sy = sums[2];
+    double sxy = sums[3], syy = sums[4];
+
+    /* Centered sums. */
+    double cxx = sxx - sx * sx / nn;
+    double cxy = sxy - sx * sy / nn;
+    double cyy = syy - sy * sy / nn;
+
+    kc.k     = cxy / cxx;
+    kc.delta = (sy - kc.k * sx) / nn + y0 - kc.k * x0;
+
+    /* If scaling is not successful. */
+    if (isnan(kc.k) || isnan(kc.delta) || isinf(kc.k))
+    {
+        kc.k = 1.0;
+        kc.delta = 0.0;
+        return kc;
+    }
+    kc.failed = 0;
+
+    if (nsites > 1)
+    {
+        kc.chi2 = (cyy - kc.k * cxy) / (nn - 1.0);
+        if (kc.chi2 < 0.0) kc.chi2 = 0.0;
+    }
+    return kc;
+}
+
+
+/* Position of the first ROI site after a change dterm of element ielem
+ * of the terms rt; sums are shifted by it.
+ */
+static double fit_x0 (const roi_terms * rt, size_t ielem, double dterm)
+{
+    double ad = (ielem < 4) ? dterm : 0.0;
+    double as = (ielem < 4) ? 0.0 : dterm;
+
+    if (rt->single)
+    {
+        const float * fb = roi_blade_column_f(rt->rd, ielem % 4);
+        float fad = (float) ad, fas = (float) as;
+        return (double) ((rt->fdelta[0] + fad * fb[0])
+                       / (rt->fsigma[0] + fas * fb[0]));
+    }
+    const double * blade = roi_blade_column(rt->rd, ielem % 4);
+    return (rt->delta[0] + ad * blade[0]) / (rt->sigma[0] + as * blade[0]);
+}
+
+
+/* Regression sums of sites lo to hi - 1 of the positions given by the
+ * terms rt after a change dterm of element ielem, shifted by x0 and y0.
+ */
+static void fit_sums_range (const roi_terms * rt, size_t ielem, double dterm,
+                            double x0, double y0, size_t lo, size_t hi,
+                            double sums[5])
+{
+    double ad = (ielem < 4) ? dterm : 0.0;
+    double as = (ielem < 4) ? 0.0 : dterm;
+
+    if (rt->single)
+    {
+        const float * fb = roi_blade_column_f(rt->rd, ielem % 4);
+        simd.fit_sums_f32(rt->fdelta + lo, rt->fsigma + lo,
+                          (float) ad, (float) as, fb + lo, rt->nominal + lo,
+                          x0, y0, hi - lo, sums);
+    }
+    else
+    {
+        const double * blade = roi_blade_column(rt->rd, ielem % 4);
+        simd.fit_sums(rt->delta + lo, rt->sigma + lo, ad, as, blade + lo,
+                      rt->nominal + lo, x0, y0, hi - lo, sums);
+    }
+}
+
+
+/* Fit of a change of the terms rt, split over a team: partial sums of
+ * each thread's sites.
+ */
+typedef struct
+{
+    const roi_terms * rt;
+    size_t ielem;
+    double dterm;
+    double x0, y0;
+    double part[5 * ROI_SPLIT_MAX];
+} roi_split_fit;
+
+static void roi_fit_task (void * arg, int tid, int nthreads)
+{
+    roi_split_fit * sf = (roi_split_fit *) arg;
+    size_t lo, hi;
+    roi_split_range(sf->rt->rd->nsites, tid, nthreads, &lo, &hi);
+    fit_sums_range(sf->rt, sf->ielem, sf->dterm, sf->x0, sf->y0, lo, hi,
+                   sf->part + 5 * tid);
+}
+
+
+/* Fit the scaling parameters k and delta of the positions given by ROI
+ * delta and sigma terms rt, after a trial change dterm of element ielem
+ * (0 to 7) of half the suppression matrix (see roi_terms_update); dterm
+ * may be zero. Returns k, delta and the chi2 of the scaled positions
+ * against the nominal ones, as chi2_calc would, in a single unit-stride
+ * pass over the ROI and without writing positions. The terms are left
+ * untouched, thus a rejected change costs nothing to undo.
+ *
+ * Sums are accumulated shifted by the values of the first ROI site, which
+ * keeps the closed-form chi2 free of cancellation. Single precision terms
+ * give single precision positions, accumulated in double. With a team in
+ * rt, each thread sums its own range of sites.
+ */
+kdchi2 roi_terms_fit (const roi_terms * rt, size_t ielem, double dterm)
+{
+    kdchi2 kc = {1.0, 0.0, 0.0, 1};
+    const roi_data * rd = rt->rd;
+    double x0, y0, sums[5];
+
+    if (rd->nsites == 0) return kc;
+
+    y0 = rt->nominal[0];
+    x0 = fit_x0(rt, ielem, dterm);
+    if (rt->team != NULL)
+    {
+        roi_split_fit sf = {rt, ielem, dterm, x0, y0, {0.0}};
+        int nthreads = rt->team->nthreads;
+        team_run(rt->team, roi_fit_task, &sf);
+
+        /* Partial sums are added up in a fixed order. */
+        memset(sums, 0, sizeof(sums));
+        for (int tid = 0; tid < nthreads; tid++)
+        {
+            for (int jj = 0; jj < 5; jj++) sums[jj] += sf.part[5 * tid + jj];
+        }
+    }
+    else
+    {
+        fit_sums_range(rt, ielem, dterm, x0, y0, 0, rd->nsites, sums);
+    }
+
+    return sums_fit(sums, rd->nsites, x0, y0);
+}
+
+
+/* Variable projection fit of an axis: given the sigma row sigrow of half
+ * the suppression matrix, solve for the delta row delrow giving the least
+ * squares positions of the ROI sites of rd (nominal positions nominal).
+ * The scaled positions k (a.b)/(c.b) + d are linear in k a and d, and the
+ * shift d is the delta row d c itself, so the best delta row is that of
+ * a 4-unknown linear regression on the blades' readings b/(c.b), with
+ * k = 1 and d = 0. Returns 0 and the chi2 of the fit in *chi2, or -1 if
+ * it could not be solved.
+ */
+int roi_varpro_fit (const roi_data * rd, const double * nominal,
+                    const double * sigrow, double * delrow, double * chi2)
+{
+    const double * const bl[4] = {rd->to, rd->ti, rd->bi, rd->bo};
+    double aa[16], sums[15], y0;
+    size_t jj, ll, kk;
+
+    if (rd->nsites < 2) return -1;
+
+    /* Normal equations, nominal positions shifted by y0. */
+    y0 = nominal[0];
+    simd.varpro_sums(bl, nominal, sigrow, y0, rd->nsites, sums);
+    for (jj = 0, kk = 0; jj < 4; jj++)
+    {
+        for (ll = jj; ll < 4; ll++, kk++)
+        {
+            aa[4 * jj + ll] = aa[4 * ll + jj] = sums[kk];
+        }
+        delrow[jj] = sums[10 + jj];
+    }
+
+    if (linear_solve(aa, delrow, 4) != 0) return -1;
+
+    /* Residual sum of squares at the optimum, Syy - delrow . Szy. */
+    *chi2 = sums[14];
+    for (jj = 0; jj < 4; jj++)
+    {
+        *chi2 -= delrow[jj] * sums[10 + jj];
+        delrow[jj] += y0 * sigrow[jj];
+    }
+    if (!isfinite(*chi2)) return -1;
+    *chi2 = (*chi2 > 0.0) ? *chi2 / (double) (rd->nsites - 1) : 0.0;
+    return 0;
+}
+
+
+/* Fit the scaling parameters of mm candidate changes mv (each of one or
+ * two elements, see fit_move) of the terms rt in a single pass over the
+ * ROI, which is read once for all candidates. Results go to kc[0:mm], as
+ * roi_terms_fit would give them one by one; mm is at most MTM_MAX.
+ */
+void roi_terms_fit_multi (const roi_terms * rt, const fit_move * mv, int mm,
+                          kdchi2 * kc)
+{
+    const roi_data * rd = rt->rd;
+    double x0[MTM_MAX], sums[5 * MTM_MAX];
+    double y0;
+    int im;
+
+    if (mm > MTM_MAX)
+    {
+        printf(" ERROR (roi_terms_fit_multi): more than %d candidates."
+               " Aborting.\n", MTM_MAX);
+        exit(-1);
+    }
+    if (rd->nsites == 0)
+    {
+        for (im = 0; im < mm; im++) kc[im] = (kdchi2) {1.0, 0.0, 0.0, 1};
+        return;
+    }
+
+    y0 = rt->nominal[0];
+    if (rt->single)
+    {
+        const float * const bl[4] = {rd->fto, rd->fti, rd->fbi, rd->fbo};
+        for (im = 0; im < mm; im++)
+        {
+            const fit_move * m = &mv[im];
+            float b0 = bl[m->bl[0]][0], b1 = bl[m->bl[1]][0];
+            x0[im] = (double) ((rt->fdelta[0] + (float) m->ad[0] * b0
+                                              + (float) m->ad[1] * b1)
+                             / (rt->fsigma[0] + (float) m->as[0] * b0
+                                              + (float) m->as[1] * b1));
+        }
+        simd.fit_sums_multi_f32(rt->fdelta, rt->fsigma, bl, rt->nominal,
+                                x0, y0, rd->nsites, mv, mm, sums);
+    }
+    else
+    {
+        const double * const bl[4] = {rd->to, rd->ti, rd->bi, rd->bo};
+        for (im = 0; im < mm; im++)
+        {
+            const fit_move * m = &mv[im];
+            double b0 = bl[m->bl[0]][0], b1 = bl[m->bl[1]][0];
+            x0[im] = (rt->delta[0] + m->ad[0] * b0 + m->ad[1] * b1)
+                   / (rt->sigma[0] + m->as[0] * b0 + m->as[1] * b1);
+        }
+        simd.fit_sums_multi(rt->delta, rt->sigma, bl, rt->nominal,
+                            x0, y0, rd->nsites, mv, mm, sums);
+    }
+
+    for (im = 0; im < mm; im++)
+    {
+        kc[im] = sums_fit(sums + 5 * im, rd->nsites, x0[im], y0);
+    }
+}
+
+
+/* Do nothing; measures the cost of running a task on a team. */
+static void roi_empty_task (void * arg, int tid, int nthreads)
+{
+    (void) arg;
+    (void) tid;
+    (void) nthreads;
+}
+
+
+/* Calibrate the number of ROI sites above which splitting the fit of the
+ * terms rt over team pays off. The fit time per site, t, is measured on
+ * rt itself and the cost of a team task, s, with an empty one; a split
+ * fit takes about s + n t / nthreads instead of n t. The threshold is
+ * twice the break-even size, to leave a margin for the sum reduction.
+ */
+size_t roi_split_threshold (roi_terms * rt, thread_team * team)
+{
+    struct thread_team * own = rt->team;
+    size_t nn = rt->rd->nsites, reps;
+    double t0, t_site, t_sync;
+    volatile double chi2 = 0.0;
+
+    if (nn == 0 || team->nthreads < 2) return (size_t) -1;
+
+    rt->team = NULL;
+    reps = 0;
+    t0 = clock_seconds();
+    do
+    {
+        chi2 += roi_terms_fit(rt, reps % 8, 0.0).chi2;
+        reps++;
+    } while ((t_site = clock_seconds() - t0) < 5.0e-3);
+    t_site /= (double) (reps * nn);
+    rt->team = own;
+
+    reps = 0;
+    t0 = clock_seconds();
+    do
+    {
+        team_run(team, roi_empty_task, NULL);
+        reps++;
+    } while ((t_sync = clock_seconds() - t0) < 5.0e-3);
+    t_sync /= (double) reps;
+
+    return (size_t) (2.0 * t_sync
+                     / (t_site * (1.0 - 1.0 / team->nthreads))) + 1;
+}
@@ -1,8 +1,94 @@
 #ifndef PRM
 #define PRM
 
-#define MAX_LINE 1024
+#include "pcg_random.h"
+
+/* Columns of a data file row: nominal H and V positions, then the
+ * current and its deviation of each blade (to, ti, bi, bo).
+ */
+#define DATA_COLUMNS    10
+
+/* Smallest chunk of a data file parsed by a thread (bytes). */
+#define DATA_CHUNK_MIN  (1 << 20)
+
+/* Binary columnar data files (data_cache.c): magic, format version,
+ * header size (bytes, page aligned columns), bytes hashed at each end
+ * of the source text file, and extension of the cache of a text file.
+ */
+#define DATA_CACHE_MAGIC    "XBPMDAT"
+#define DATA_CACHE_VERSION  2
+#define DATA_CACHE_HEADER   4096
+#define DATA_CACHE_HASHED   65536
+#define DATA_CACHE_EXT      ".xbd"
+
+/* Positions closer than this fraction of the span of the sites are on
+ * the same line or column of the grid. */
+#define GRID_TOL  1.0e-6
+
+/* Maximum number of dimensions of a .npy array read (npy_io.c). */
+#define NPY_DIMS_MAX  4
+
+/* Number of random numbers drawn at a time by a walk chain (three per
+ * trial: element, sign and acceptance).
+ */
+#define RW_RBUF  768
+
+/* Maximum number of candidates of a multiple-try Metropolis trial. */
+#define MTM_MAX  32
+
+/* Maximum number of threads splitting the ROI of a chain. */
+#define ROI_SPLIT_MAX  64
+
+/* Number of slots of the cache of evaluated states of a chain (a power
+ * of 2, well above the states a chain visits between rate checks), the
+ * entries after which it starts a new epoch, and the longest probe.
+ */
+#define RW_MEMO_SIZE   1024
+#define RW_MEMO_LOAD   (RW_MEMO_SIZE / 2)
+#define RW_MEMO_PROBE  16
+
+/* Parameterisations of the suppression matrix, and maximum number of
+ * parameters. */
+#define PARAM_FULL    0
+#define PARAM_GAINS   1
+#define PARAM_SHARED  2
+#define PARAM_MAX     16
+
+/* Acceptance rate check interval (iterations). */
+#define ACCEPT_CHECK_INTERVAL  250
+
+/* Acceptance rate aimed at by the step feedback of the schedules. */
+#define ACCEPT_TARGET  0.44
+
+/* Cooling schedules: the original one, exponential, Lam-Delosme and
+ * target acceptance feedback. */
+#define SCHED_DEFAULT  0
+#define SCHED_EXP      1
+#define SCHED_LAM      2
+#define SCHED_TARGET   3
+
+/* Reasons for a chain to stop: trials done, chi2 improvement below the
+ * tolerance over a window, step below the floor, time budget, target
+ * chi2 reached. */
+#define STOP_NONE     0
+#define STOP_TOL      1
+#define STOP_STEP     2
+#define STOP_TIME     3
+#define STOP_TARGET   4
+
+/* Maximum number of coarse ROI levels. */
+#define LEVELS_MAX  8
+
+/* Temperature constant. Analogous to 1/kB. */
+#define Bk  1.0e7
+
+/* Alignment (bytes) of the compacted ROI columns and number of sites
+ * their lengths are padded to (the widest vector width, in floats).
+ */
+#define ROI_ALIGN     64
+#define ROI_PAD       (ROI_ALIGN / sizeof(float))
 #include <stddef.h>
+#include <stdint.h>
 
 /* Struct for parameters.
  */
@@ -16,6 +102,44 @@ typedef struct
     double beta;                /* Inverse of temperature.        */
     double step;                /* Random step size.              */
     char outfile[256];          /* Output file name.              */
+    char convfile[256];         /* Binary data file to write.     */
+    char npyout[256];           /* Prefix of .npy results files.  */
+    int data_cache;             /* Use the cache of a text file.  */
+    int simd;                   /* Vector kernels level.          */
+    int single;                 /* Single precision evaluation.   */
+    int nthreads;               /* Number of threads (0: auto).   */
+    int nreplicas;              /* Parallel tempering replicas.   */
+    double pt_ratio;            /* Ratio of neighbour replicas' beta. */
+    size_t pt_swap;             /* Trials between swap attempts.  */
+    int nstarts;                /* Number of multi-start walks.   */
+    double jitter;              /* Relative jitter of start matrices. */
+    uint64_t seed;              /* Seed of the random streams.    */
+    int seed_set;               /* Seed given (else from urandom). */
+    uint64_t stream;            /* First random stream of the run. */
+    int ntries;                 /* Candidates per trial (MTM).    */
+    int speculate;              /* Proposals evaluated at a time. */
+    int split;                  /* Threads splitting the ROI of a */
+                                /* chain (0: no, -1: calibrated). */
+    int memo;                   /* Cache evaluated lattice states. */
+    int varpro;                 /* Walk the sigma rows only.      */
+    double polish;              /* LM refinement tolerance (0: no). */
+    int cma;                    /* Optimize by CMA-ES.            */
+    int popsize;                /* CMA-ES population (0: default). */
+    int compare;                /* Compare CMA-ES with the walk.  */
+    double wall;                /* CMA-ES time limit (s, 0: none). */
+    int param_mode;             /* Parameterisation (PARAM_*).    */
+    double tol;                 /* Stop: relative chi2 improvement */
+    size_t window;              /* over window trials,            */
+    double step_min;            /* step floor,                    */
+    double time;                /* time budget (s),               */
+    double time_end;            /* (monotonic clock deadline)     */
+    double target;              /* target chi2 (0: unused).       */
+    int schedule;               /* Cooling schedule (SCHED_*),    */
+    double sched_prm;           /* its parameter (0: default).    */
+    int element_steps;          /* Adapt a step per element.      */
+    int nlevels;                /* Coarse ROI levels, and their   */
+    size_t level_stride[LEVELS_MAX];  /* row/column strides and   */
+    double level_frac[LEVELS_MAX];    /* shares of the trials.    */
 } xbpm_prm;
 
 
@@ -28,12 +152,58 @@ typedef struct
 } roi_struct;
 
 
+/* Struct for a compacted copy of the ROI data: nominal positions and
+ * blades' currents of the ROI sites, in the order of roi_struct.idx.
+ * Columns are contiguous, aligned to ROI_ALIGN and padded (with zeros)
+ * to a multiple of ROI_PAD; all share a single allocation.
+ */
+typedef struct
+{
+    size_t nsites;              /* Number of ROI sites.               */
+    size_t npad;                /* Length of the padded columns.      */
+    double * nom_h, * nom_v;    /* Nominal positions.                 */
+    double * to, * ti, * bi, * bo;  /* Blades' currents.              */
+    float  * fto, * fti, * fbi, * fbo;  /* Single precision currents. */
+    void   * arena;             /* Allocation holding all columns.    */
+} roi_data;
+
+
+/* Struct for the delta and sigma terms of the ROI sites for one axis
+ * (products of the blades' currents by the rows of half the suppression
+ * matrix), kept up to date along a walk. Single precision terms
+ * (single != 0) are evaluated with double precision accumulators.
+ */
+typedef struct
+{
+    const roi_data * rd;        /* ROI data the terms refer to.       */
+    const double * nominal;     /* ROI nominal positions of the axis. */
+    int single;                 /* Single precision terms.            */
+    double * delta, * sigma;    /* Double precision terms.            */
+    float  * fdelta, * fsigma;  /* Single precision terms.            */
+    void   * mem;               /* Allocation holding the terms.      */
+    struct thread_team * team;  /* Team splitting the ROI, or NULL.   */
+} roi_terms;
+
+
+/* Regular grid of the sites, inferred from their positions: site
+ * ord_sites[iy * nx + ix] is at (h0 + ix * dh, v0 + iy * dv).
+ */
+typedef struct
+{
+    int regular;                /* Sites are a full nx x ny lattice. */
+    size_t nx, ny;              /* Columns (h) and lines (v).        */
+    double h0, v0;              /* Position of the first site,       */
+    double dh, dv;              /* and spacings.                     */
+} grid_info;
+
+
 /* Struct for data.
  */
 typedef struct
 {
     size_t nsites;           /* Number of sites.                         */
     size_t * ord_sites;      /* Indices for the correct position order.  */
+    grid_info grid;          /* Regular grid of the sites, if any.       */
     double * nom_h, * nom_v; /* Nominal values of positions (sites).     */
 
     /* Pointers to blades' currents and std devs.   */
@@ -43,6 +213,17 @@ typedef struct
     double * bo, * sbo;         /* Bottom, out.     */
 
     roi_struct roi;             /* Index for the sites within the ROI. */
+    roi_data   rd;              /* Compacted copy of the ROI data.     */
+
+    /* Coarse ROI levels (subsamples of the ROI), walked before it. */
+    int nlevels;
+    roi_struct level_roi[LEVELS_MAX];
+    roi_data   level_rd[LEVELS_MAX];
+
+    /* Mapping of a binary data file the columns and ord_sites point
+     * into (NULL if they are allocated). */
+    void * map;
+    size_t map_size;
 } dataset;
 
 
@@ -53,15 +234,113 @@ typedef struct
     double k, delta;
 } kdelta;
 
+/* Scaling parameters and chi2 of the scaled positions within the ROI;
+ * failed is set, with k = 1 and delta = 0, if the scaling could not be
+ * fitted.
+ */
+typedef struct
+{
+    double k, delta, chi2;
+    int failed;
+} kdchi2;
+
 /* Random walk statistics.
  */
 typedef struct
 {
-    size_t imat_h, imat_v;   /* Number of changes in H and V. */
-    size_t accept;           /* Number of accepted changes.   */
-    double beta;             /* Final inverse temperature.    */
+    size_t imat_h, imat_v;      /* Number of changes in H and V.   */
+    size_t accept_h, accept_v;  /* Number of accepted changes.     */
+    double beta_h, beta_v;      /* Final inverse temperatures.     */
+    double step_h, step_v;      /* Final step sizes.               */
+    double chi2_h, chi2_v;      /* Final chi2 (ROI).               */
+    size_t memo_lookups;        /* Cache lookups (both axes).      */
+    size_t memo_hits;           /* Cache hits.                     */
+    size_t iter_h, iter_v;      /* Trials run.                     */
+    int stop_h, stop_v;         /* Why the chains stopped (STOP_*). */
+    size_t failed;              /* Failed scalings (both axes).    */
 } rw_stats;
 
+/* Linear map of a parameter vector onto the suppression matrix:
+ * supmat[e] = sum_j map[e * npar + j] * par[j]. Within each half, a
+ * parameter moves the elements of at most two blades (columns).
+ */
+typedef struct
+{
+    int npar;                   /* Number of parameters.            */
+    double map[16 * PARAM_MAX]; /* Map (16 x npar, row-major).      */
+    double par[PARAM_MAX];      /* Parameters.                      */
+} param_map;
+
+
+/* Levenberg-Marquardt refinement statistics.
+ */
+typedef struct
+{
+    int iter_h, iter_v;         /* Iterations in H and V.          */
+    double chi2_h0, chi2_v0;    /* Initial chi2 (ROI).             */
+    double chi2_h, chi2_v;      /* Final chi2 (ROI).               */
+} lm_stats;
+
+/* Cache of the fits of the states a chain has evaluated. Between rate
+ * checks a chain moves on a lattice, base + coord * step, where base is
+ * the matrix at the start of the epoch; states are keyed on their integer
+ * coordinates. Entries of former epochs are stale.
+ */
+typedef struct
+{
+    int16_t coord[8];           /* Lattice coordinates of a state.  */
+    uint32_t epoch;             /* Epoch the entry belongs to.      */
+    kdchi2 kc;                  /* Fit of the state.                */
+} rw_memo_entry;
+
+typedef struct
+{
+    rw_memo_entry * slot;       /* RW_MEMO_SIZE entries, or NULL.   */
+    uint32_t epoch;             /* Current epoch (from 1).          */
+    int16_t coord[8];           /* Coordinates of the chain state.  */
+    size_t used;                /* Entries of the current epoch.    */
+    size_t lookups, hits;
+} rw_memo;
+
+/* State of a random walk chain over half of the suppression matrix,
+ * the 8 elements of one axis (H or V). The chi2 of the two axes are
+ * independent, so each axis is optimized by its own chain, with its own
+ * random stream, temperature and step size.
+ */
+typedef struct
+{
+    const xbpm_prm * prm;
+    double * supmat;            /* Half matrix of the chain's axis.  */
+    roi_terms terms;            /* Delta and sigma terms of the ROI. */
+    pcg32x_random_t rng;        /* Random numbers stream.            */
+    double rbuf[RW_RBUF];       /* Random numbers drawn in advance.  */
+    size_t rpos;                /* Next random number in rbuf.       */
+    size_t nrand;               /* Number of trials.                 */
+    double beta, step;          /* Inverse of temperature, step.     */
+    double steps[PARAM_MAX];    /* Step of each element (parameter). */
+    int nsteps;                 /* Number of elements.               */
+    size_t el_prop[PARAM_MAX];  /* Proposals and acceptances of each */
+    size_t el_acc[PARAM_MAX];   /* element since the last rate check. */
+    double e_sum, e_sum2;       /* Sums of chi2 and chi2^2 over the  */
+    size_t e_n;                 /* trials since the last rate check. */
+    int anneal;                 /* Raise beta at low acceptance.     */
+    double chi2;                /* Current chi2.                     */
+    size_t iter;                /* Number of trials performed.       */
+    size_t imat, accept;        /* Number of changes and accepted.   */
+    size_t nfailed;             /* Changes whose scaling failed.     */
+    size_t old_accept;          /* Accepted at last rate check.      */
+    int nsplit, cpu0;           /* Threads splitting the ROI (0: no) */
+                                /* and first processor for them.     */
+    rw_memo memo;               /* Cache of evaluated states.        */
+    int axis;                   /* Axis of the chain (0: H, 1: V).   */
+    int stop;                   /* Reason to stop (STOP_*), or 0.    */
+    double chi2_win;            /* Chi2 and trial at the start of    */
+    size_t iter_win;            /* the convergence window.           */
+    const dataset * ds;         /* Data, with the ROI levels.        */
+} rw_chain;
+
+
+
 /* Define a structure for minimum and maximum.
  */
 typedef struct
@@ -1,33 +1,51 @@
 #include "prm_def.h"
+#include "simd_kernels.h"
 #include "pcg_random.h"
+#include "thread_team.h"
 #include <math.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
-/* Temperature constant. Analogous to 1/kB. */
-#define Bk  1.0e7
-
-/* Acceptance rate check interval (iterations). */
-#define ACCEPT_CHECK_INTERVAL  250
-
 /* Prototype. Calculate positions from suppression matrix and
  * blades' measurements.
  */
 kdelta positions_calc (const dataset * ds, const double * supmat,
                     double * nom_positions, double * positions);
 
+/* Prototypes. Delta and sigma terms of ROI sites, and fit of the positions
+ * given by them.
+ */
+roi_terms roi_terms_alloc (const roi_data * rd, int axis, int single);
+
+void roi_terms_free (roi_terms * rt);
+
+void roi_terms_calc (roi_terms * rt, const double * supmat);
+
+void roi_terms_update (roi_terms * rt, size_t ielem, double dterm);
+
+kdchi2 roi_terms_fit (const roi_terms * rt, size_t ielem, double dterm);
+
+void roi_terms_fit_multi (const roi_terms * rt, const fit_move * mv, int mm,
+                          kdchi2 * kc);
+
+size_t roi_split_threshold (roi_terms * rt, thread_team * team);
+
+int roi_varpro_fit (const roi_data * rd, const double * nominal,
+                    const double * sigrow, double * delrow, double * chi2);
+
 
 /* Change the value of an element of the gain array by a 'step'.
  */
-void mat_walk (double * supmat, double step)
+void mat_walk (double * supmat, double step, pcg32_random_t * rng)
 {
     /* Pick an element.
     */
-    int isite   = (int) (pcg_double() * 16);
+    int isite   = (int) (pcg_double_r(rng) * 16);
     /* Choose sign +/- (increase/decrease step).
     */
-    double sign = 1.0 ? -1.0 : (pcg_double() > 0.5);
+    double sign = (pcg_double_r(rng) > 0.5) ? -1.0 : 1.0;
     /* Add up in chosen matrix element value.
     */
     supmat[isite] += sign * step;
@@ -39,28 +57,28 @@ void mat_walk (double * supmat, double step)
 double chi2_calc(const double * v1, const double * v2,
                  const roi_struct * roi)
 {
-    double df, c2 = 0.0;
-    size_t idx;
-    for (size_t ii = 0; ii < roi->nsites; ii++)
-    {
-        idx = roi->idx[ii];
-        df  = v1[idx] - v2[idx];
-        c2 += df *  df;
-    }
     if (roi->nsites <= 1) return 0.0;
+    double c2 = simd.roi_diff2(v1, v2, roi->idx, roi->nsites);
     return c2 / ((double)(roi->nsites - 1));
 }
 
 
 /* Initialize seed with real random value from urandom device.
  */
-uint64_t seed_get()
+uint64_t seed_get(void)
 {
     /* Open urandom device.
     */
     FILE * sd = fopen("/dev/urandom", "rb");
     size_t nread;
-    uint64_t buffer;
+    uint64_t buffer = 0;
+
+    if (sd == NULL)
+    {
+        printf(" ERROR (seed_get): could not open /dev/urandom;"
+               " give a seed with -S. Aborting.\n");
+        exit(-1);
+    }
 
     /* Read 8 bytes from urandom into buffer. */
     nread = fread(&buffer, 8, 1, sd);
@@ -75,156 +93,1029 @@ uint64_t seed_get()
 }
 
 
-/* Perform random walk to optimize suppression matrix.
+/* Start a new epoch of the cache memo: the current state becomes the
+ * base of the lattice and former entries are stale.
  */
-rw_stats random_walk(dataset * ds, xbpm_prm * prm, double * supmat,
-                   double * pos_h, double * pos_v)
+void rw_memo_reset (rw_memo * memo)
 {
-    /* Counters. */
-    size_t ii = 0;
-    size_t accept = 0, old_accept = 0;
-
-    /* Inverse of temperature. */
-    double beta = prm->beta;
-    
-    /* Chi2 analysis.*/
-    double oldval;
-    double chi2_h, chi2_v, chi2_h_aft, chi2_v_aft;
-    double chi2, chi2_aft, dchi2;
-    double daccept;
-
-    /* Probability.*/
-    double prob;
-
-    /* Scaling parameters. */
-    kdelta kd;
-    
-    /* Initialize random seed. */
-    uint64_t seed = seed_get();
-    pcg32_init(seed);
-    
-    /* Calculate initial positions and deviation from nominal
-     * positions (chi2). */
-    positions_calc(ds, supmat, ds->nom_h, pos_h);
-    chi2_h = chi2_calc(ds->nom_h, pos_h, &ds->roi);
-    
-    positions_calc(ds, supmat + 8, ds->nom_v, pos_v);
-    chi2_v = chi2_calc(ds->nom_v, pos_v, &ds->roi);
-    
-    chi2_h_aft = chi2_h;
-    chi2_v_aft = chi2_v;
-    chi2       = (chi2_h + chi2_v);
-    chi2_aft   = chi2;
-
-    /* Try to change the matrix nrand times. */
-    size_t imat_h = 0;
-    size_t imat_v = 0;
-    size_t isite = 0;
-    double sign = 1.0;
-    for (ii = 0; ii < prm->nrand; ii++)
-    {
-        /* Pick an element of the suppression matrix. */
-        isite = (size_t) (pcg_double() * 16);
+    memo->epoch++;
+    memo->used = 0;
+    memset(memo->coord, 0, sizeof(memo->coord));
+}
 
-        /* Choose sign (increase/decrease step).      */
-        sign = (pcg_double() > 0.5) ? -1.0 : 1.0;
-        /* Add up in chosen matrix element value.     */
-        oldval = supmat[isite];
-        supmat[isite] += sign * prm->step;
 
-        /* Skip if new value would be zero. */
-        if (supmat[isite] == 0.0) 
+/* Slot of the cache memo for the state of coordinates coord: the entry
+ * of that state if cached in the current epoch (*hit set), else the free
+ * (stale) slot where it should go. NULL if the RW_MEMO_PROBE slots from
+ * its hash are all taken.
+ */
+static rw_memo_entry * rw_memo_find (rw_memo * memo, const int16_t * coord,
+                                     int * hit)
+{
+    uint64_t hh = 0xcbf29ce484222325u;
+    size_t islot, probe;
+
+    for (int ii = 0; ii < 8; ii++)
+    {
+        hh = (hh ^ (uint16_t) coord[ii]) * 0x100000001b3u;
+    }
+    islot = (size_t) (hh ^ (hh >> 32)) & (RW_MEMO_SIZE - 1);
+
+    *hit = 0;
+    for (probe = 0; probe < RW_MEMO_PROBE; probe++)
+    {
+        rw_memo_entry * en = &memo->slot[(islot + probe)
+                                         & (RW_MEMO_SIZE - 1)];
+        if (en->epoch != memo->epoch) return en;
+        if (memcmp(en->coord, coord, sizeof(en->coord)) == 0)
+        {
+            *hit = 1;
+            return en;
+        }
+    }
+    return NULL;
+}
+
+
+/* Fit of the change dterm (a step of sign sign) of element ielem of the
+ * chain ch state, from the cache if it was evaluated in this epoch.
+ */
+static kdchi2 rw_chain_fit (rw_chain * ch, size_t ielem, double dterm,
+                            int sign)
+{
+    rw_memo * memo = &ch->memo;
+    rw_memo_entry * en;
+    int16_t coord[8];
+    int hit;
+    kdchi2 kc;
+
+    if (memo->slot == NULL) return roi_terms_fit(&ch->terms, ielem, dterm);
+
+    memcpy(coord, memo->coord, sizeof(coord));
+    coord[ielem] += sign;
+    memo->lookups++;
+    en = rw_memo_find(memo, coord, &hit);
+    if (hit)
+    {
+        memo->hits++;
+        return en->kc;
+    }
+
+    kc = roi_terms_fit(&ch->terms, ielem, dterm);
+    if (en != NULL)
+    {
+        memcpy(en->coord, coord, sizeof(coord));
+        en->epoch = memo->epoch;
+        en->kc    = kc;
+        if (++memo->used == RW_MEMO_LOAD) rw_memo_reset(memo);
+    }
+    return kc;
+}
+
+
+/* Set the delta row of the chain ch state to the best one for its sigma
+ * row (variable projection) and return the chi2.
+ */
+static double rw_chain_project (rw_chain * ch)
+{
+    double chi2;
+
+    if (roi_varpro_fit(ch->terms.rd, ch->terms.nominal, ch->supmat + 4,
+                       ch->supmat, &chi2) != 0)
+    {
+        printf(" ERROR (rw_chain_project): could not solve the delta"
+               " row of the matrix. Aborting.\n");
+        exit(-1);
+    }
+    return chi2;
+}
+
+
+/* Initialize chain over the half matrix supmat of the given axis.
+ */
+void rw_chain_init (rw_chain * ch, const dataset * ds, const xbpm_prm * prm,
+                    double * supmat, int axis, size_t nrand,
+                    uint64_t seed, uint64_t stream)
+{
+    ch->prm    = prm;
+    ch->supmat = supmat;
+    ch->terms  = roi_terms_alloc(&ds->rd, axis, prm->single);
+    ch->nrand  = nrand;
+    ch->beta   = prm->beta;
+    ch->step   = prm->step;
+    ch->nsteps = 8;
+    for (int ie = 0; ie < PARAM_MAX; ie++) ch->steps[ie] = prm->step;
+    memset(ch->el_prop, 0, sizeof(ch->el_prop));
+    memset(ch->el_acc, 0, sizeof(ch->el_acc));
+    ch->e_sum  = ch->e_sum2 = 0.0;
+    ch->e_n    = 0;
+    ch->anneal = 1;
+    ch->iter   = 0;
+    ch->imat   = 0;
+    ch->accept = 0;
+    ch->nfailed = 0;
+    ch->old_accept = 0;
+    ch->nsplit = 0;
+    ch->cpu0   = 0;
+    ch->axis   = axis;
+    ch->ds     = ds;
+    pcg32x_init(&ch->rng, seed, stream);
+    ch->rpos = RW_RBUF;
+
+    /* Cache of evaluated states, if requested. */
+    memset(&ch->memo, 0, sizeof(rw_memo));
+    if (prm->memo)
+    {
+        ch->memo.slot = calloc(RW_MEMO_SIZE, sizeof(rw_memo_entry));
+        if (ch->memo.slot == NULL)
+        {
+            printf(" ERROR (rw_chain_init): could not allocate memory"
+                   " for the states cache. Aborting.\n");
+            exit(-1);
+        }
+        rw_memo_reset(&ch->memo);
+    }
+
+    /* Initial deviation from nominal positions (chi2). */
+    if (prm->varpro) ch->chi2 = rw_chain_project(ch);
+    roi_terms_calc(&ch->terms, supmat);
+    if (!prm->varpro) ch->chi2 = roi_terms_fit(&ch->terms, 0, 0.0).chi2;
+    ch->stop     = STOP_NONE;
+    ch->chi2_win = ch->chi2;
+    ch->iter_win = 0;
+}
+
+
+/* Set change k of move mv to a change dterm of element ielem (0 to 7) of
+ * the half matrix.
+ */
+static void fit_move_set (fit_move * mv, int k, size_t ielem, double dterm)
+{
+    mv->bl[k] = (int) (ielem % 4);
+    mv->ad[k] = (ielem < 4) ? dterm : 0.0;
+    mv->as[k] = (ielem < 4) ? 0.0 : dterm;
+}
+
+
+/* Perform a multiple-try Metropolis trial of chain ch, with the random
+ * numbers rnd (4 per candidate). Candidates y_j, j < M, each change one
+ * element of the current matrix x by +/- step; all are evaluated in one
+ * pass over the ROI. One of them, y, is selected with probability
+ * proportional to its weight w = exp(-chi2 * beta * Bk). A reference set
+ * is drawn the same way around y, its last member being x itself, and y
+ * is accepted with probability min(1, sum w(y_j) / sum w(x*_j)). Weights
+ * are scaled by the smallest chi2 of each set, to avoid underflow.
+ */
+static void rw_chain_mtm (rw_chain * ch, const double * rnd)
+{
+    int mm = ch->prm->ntries, jj, sel;
+    double * supmat = ch->supmat;
+    double bB = ch->beta * Bk;
+    double newval[MTM_MAX], cy, cx, sy, sx, pick, prob;
+    size_t ielem[MTM_MAX];
+    int valid[MTM_MAX];
+    fit_move mv[MTM_MAX];
+    kdchi2 ky[MTM_MAX], kx[MTM_MAX];
+
+    /* Candidates around x. */
+    memset(mv, 0, mm * sizeof(fit_move));
+    for (jj = 0; jj < mm; jj++, rnd += 2)
+    {
+        ielem[jj]  = (size_t) (rnd[0] * 8);
+        double st  = ch->steps[ielem[jj]];
+        newval[jj] = supmat[ielem[jj]] + ((rnd[1] > 0.5) ? -st : st);
+        fit_move_set(&mv[jj], 0, ielem[jj], newval[jj] - supmat[ielem[jj]]);
+    }
+    roi_terms_fit_multi(&ch->terms, mv, mm, ky);
+    ch->imat++;
+
+    /* Select y by weight. Candidates with a zero element or whose
+     * scaling failed have no weight. */
+    cy = INFINITY;
+    for (jj = 0; jj < mm; jj++)
+    {
+        valid[jj] = (newval[jj] != 0.0 && !ky[jj].failed);
+        if (valid[jj] && ky[jj].chi2 < cy) cy = ky[jj].chi2;
+    }
+    if (isinf(cy)) return;
+
+    sy = 0.0;
+    for (jj = 0; jj < mm; jj++)
+    {
+        if (valid[jj]) sy += exp(-(ky[jj].chi2 - cy) * bB);
+    }
+    pick = *rnd++ * sy;
+    for (sel = 0; sel < mm - 1; sel++)
+    {
+        if (valid[sel] && (pick -= exp(-(ky[sel].chi2 - cy) * bB)) < 0.0)
+            break;
+    }
+    while (!valid[sel]) sel--;
+
+    /* Reference set around y, as moves from x of y's element and of the
+     * reference's one. */
+    size_t es = ielem[sel];
+    double ds = newval[sel] - supmat[es], xval, dref;
+    ch->el_prop[es]++;
+    memset(mv, 0, mm * sizeof(fit_move));
+    for (jj = 0; jj < mm - 1; jj++, rnd += 2)
+    {
+        size_t ee = (size_t) (rnd[0] * 8);
+        xval = (ee == es) ? newval[sel] : supmat[ee];
+        xval += (rnd[1] > 0.5) ? -ch->steps[ee] : ch->steps[ee];
+        dref = xval - supmat[ee];
+        valid[jj] = (xval != 0.0);
+        if (ee == es)
+        {
+            fit_move_set(&mv[jj], 0, ee, dref);
+        }
+        else
+        {
+            fit_move_set(&mv[jj], 0, es, ds);
+            fit_move_set(&mv[jj], 1, ee, dref);
+        }
+    }
+    roi_terms_fit_multi(&ch->terms, mv, mm - 1, kx);
+
+    cx = ch->chi2;
+    for (jj = 0; jj < mm - 1; jj++)
+    {
+        valid[jj] = valid[jj] && !kx[jj].failed;
+        if (valid[jj] && kx[jj].chi2 < cx) cx = kx[jj].chi2;
+    }
+    sx = exp(-(ch->chi2 - cx) * bB);
+    for (jj = 0; jj < mm - 1; jj++)
+    {
+        if (valid[jj]) sx += exp(-(kx[jj].chi2 - cx) * bB);
+    }
+
+    /* Accept or reject y. */
+    prob = exp(-(cy - cx) * bB) * sy / sx;
+    if (prob > 1.0) prob = 1.0;
+    if (*rnd <= prob)
+    {
+        supmat[es] = newval[sel];
+        ch->chi2 = ky[sel].chi2;
+        roi_terms_update(&ch->terms, es, ds);
+        ch->el_acc[es]++;
+        ch->old_accept = ch->accept;
+        ch->accept++;
+    }
+}
+
+
+/* Stopping criterion of chain ch met at trial ii (STOP_*), if any: the
+ * target chi2, the step floor, the time budget, or a relative chi2
+ * improvement below the tolerance over the last window of trials.
+ */
+static int rw_chain_converged (rw_chain * ch, size_t ii)
+{
+    const xbpm_prm * prm = ch->prm;
+    int converged;
+
+    if (prm->target > 0.0 && ch->chi2 <= prm->target) return STOP_TARGET;
+    if (ch->step < prm->step_min) return STOP_STEP;
+    if (prm->time_end > 0.0 && clock_seconds() >= prm->time_end)
+        return STOP_TIME;
+
+    if (prm->tol > 0.0 && ii - ch->iter_win >= prm->window)
+    {
+        converged = (ch->chi2_win - ch->chi2) < prm->tol * ch->chi2_win;
+        ch->chi2_win = ch->chi2;
+        ch->iter_win = ii;
+        if (converged) return STOP_TOL;
+    }
+    return STOP_NONE;
+}
+
+
+/* Original schedule: beta is raised by 1% when the rate daccept is
+ * below 10%, and the step divided by 1 + log2(1 + daccept). The rate is
+ * counted since the last acceptance, as it always was. Returns whether
+ * the step changed.
+ */
+static int sched_default (rw_chain * ch, double rate, double prm)
+{
+    double daccept = (double)(ch->accept - ch->old_accept)
+                   / ACCEPT_CHECK_INTERVAL;
+    (void) rate;
+    (void) prm;
+
+    if (daccept < 0.1 && ch->anneal)
+    {
+        ch->beta *= 1.01;
+    }
+    ch->old_accept = ch->accept;
+    ch->step /= 1.0 + log2(1.0 + daccept);
+    return daccept > 0.0;
+}
+
+
+/* Exponential schedule: beta is multiplied by prm (default 1.01) and the
+ * step follows the acceptance rate towards ACCEPT_TARGET.
+ */
+static int sched_exp (rw_chain * ch, double rate, double prm)
+{
+    if (ch->anneal) ch->beta *= (prm > 0.0) ? prm : 1.01;
+    ch->step *= exp(rate - ACCEPT_TARGET);
+    return 1;
+}
+
+
+/* Lam-Delosme schedule: beta is raised by
+ *   lambda / sigma * 1 / (beta sigma)^2 * 4 rho (1 - rho)^2 / (2 - rho)^2
+ * where sigma is the spread of the energy (chi2 * Bk) over the last
+ * trials, rho the acceptance rate and lambda the quality factor prm
+ * (default 0.1); at most doubled at a check. The step follows the
+ * acceptance rate towards ACCEPT_TARGET, where the schedule is fastest.
+ */
+static int sched_lam (rw_chain * ch, double rate, double prm)
+{
+    double lambda = (prm > 0.0) ? prm : 0.1;
+    double nn = (double) ch->e_n, var, sigma, bs, dbeta;
+
+    if (ch->anneal && nn > 1.0)
+    {
+        var = (ch->e_sum2 - ch->e_sum * ch->e_sum / nn) / (nn - 1.0);
+        sigma = (var > 0.0) ? Bk * sqrt(var) : 0.0;
+        if (sigma > 0.0)
+        {
+            bs = ch->beta * sigma;
+            dbeta = lambda / sigma / (bs * bs) * 4.0 * rate
+                  * (1.0 - rate) * (1.0 - rate)
+                  / ((2.0 - rate) * (2.0 - rate));
+            ch->beta += (dbeta < ch->beta) ? dbeta : ch->beta;
+        }
+    }
+    ch->step *= exp(rate - ACCEPT_TARGET);
+    return 1;
+}
+
+
+/* Target acceptance schedule: the target rate decreases linearly from
+ * prm (default ACCEPT_TARGET) to 1% over the trials, and beta follows
+ * the measured rate towards it. The step is kept, since it would take
+ * over the feedback (small steps are accepted whatever beta).
+ */
+static int sched_target (rw_chain * ch, double rate, double prm)
+{
+    double a0 = (prm > 0.0) ? prm : ACCEPT_TARGET;
+    double tt = (double) ch->iter / (double) (ch->nrand ? ch->nrand : 1);
+    double at;
+
+    if (tt > 1.0) tt = 1.0;
+    at = a0 + (0.01 - a0) * tt;
+    if (ch->anneal) ch->beta *= exp(2.0 * (rate - at));
+    return 0;
+}
+
+
+/* Cooling schedules, by SCHED_* code. */
+static const struct
+{
+    const char * name;
+    int (*cool) (rw_chain * ch, double rate, double prm);
+} rw_schedules[] =
+{
+    {"default", sched_default},
+    {"exp",     sched_exp},
+    {"lam",     sched_lam},
+    {"target",  sched_target},
+};
+
+
+/* SCHED_* code of the schedule name, or -1 if unknown.
+ */
+int rw_schedule_by_name (const char * name)
+{
+    int nn = (int) (sizeof(rw_schedules) / sizeof(rw_schedules[0]));
+    for (int is = 0; is < nn; is++)
+    {
+        if (strcmp(name, rw_schedules[is].name) == 0) return is;
+    }
+    return -1;
+}
+
+
+/* Steps of the elements of chain ch after the global step changed by the
+ * factor gf: all equal to it, or (prm->element_steps) each scaled by gf
+ * and by exp(a_i - rate), a_i being the acceptance rate of the element,
+ * within a factor 1000 of the global step.
+ */
+static void rw_chain_steps (rw_chain * ch, double gf, double rate)
+{
+    double ai, ss;
+
+    for (int ie = 0; ie < ch->nsteps; ie++)
+    {
+        if (!ch->prm->element_steps)
         {
-            supmat[isite] = oldval;
+            ch->steps[ie] = ch->step;
             continue;
         }
+        ss = ch->steps[ie] * gf;
+        if (ch->el_prop[ie] >= 5)
+        {
+            ai = (double) ch->el_acc[ie] / (double) ch->el_prop[ie];
+            ss *= exp(ai - rate);
+        }
+        if (ss > 1.0e3 * ch->step) ss = 1.0e3 * ch->step;
+        if (ss < 1.0e-3 * ch->step) ss = 1.0e-3 * ch->step;
+        ch->steps[ie] = ss;
+    }
+}
+
+
+/* Adjust temperature and step of chain ch every ACCEPT_CHECK_INTERVAL
+ * trials by its cooling schedule (prm->schedule), given the acceptance
+ * rate over the interval; ii is the trial number. Then the stopping
+ * criteria are checked (ch->stop). Returns 1 if they were adjusted (and
+ * the terms recalculated), 0 otherwise.
+ */
+int rw_chain_cool (rw_chain * ch, size_t ii)
+{
+    double step0 = ch->step, rate;
+    size_t nprop = 0, nacc = 0;
+
+    ch->e_sum  += ch->chi2;
+    ch->e_sum2 += ch->chi2 * ch->chi2;
+    ch->e_n++;
+
+    if (ii % ACCEPT_CHECK_INTERVAL == 0 && ii > 0)
+    {
+        for (int ie = 0; ie < ch->nsteps; ie++)
+        {
+            nprop += ch->el_prop[ie];
+            nacc  += ch->el_acc[ie];
+        }
+        rate = nprop ? (double) nacc / (double) nprop : 0.0;
 
-        /* Recalculate positions and chi2. Check h and v separately.
-         * Minimization step takes only ROI into account. */ 
-        if (isite < 8)
+        /* New temperature and step. The cache starts a new epoch at
+         * every check, so that it neither fills up nor its coordinates
+         * wrap on a lattice kept for long. */
+        if (rw_schedules[ch->prm->schedule].cool(ch, rate,
+                                                 ch->prm->sched_prm) ||
+            ch->prm->element_steps)
         {
-            /* Horizontal changes. */
-            kd = positions_calc(ds, supmat, ds->nom_h, pos_h);
-            chi2_h_aft = chi2_calc(ds->nom_h, pos_h, &ds->roi);            
-            imat_h++;
+            rw_chain_steps(ch, ch->step / step0, rate);
+        }
+        rw_memo_reset(&ch->memo);
+        memset(ch->el_prop, 0, sizeof(ch->el_prop));
+        memset(ch->el_acc, 0, sizeof(ch->el_acc));
+        ch->e_sum = ch->e_sum2 = 0.0;
+        ch->e_n   = 0;
+
+        /* Recalculate terms to discard rounding drift of updates (the
+         * sigma-only walk does not use them). */
+        if (!ch->prm->varpro) roi_terms_calc(&ch->terms, ch->supmat);
+
+        ch->stop = rw_chain_converged(ch, ii);
+        return 1;
+    }
+    return 0;
+}
+
+
+/* Perform ntrials steps of the random walk of chain ch over its sigma
+ * row only, the delta row being solved for every state (prm->varpro).
+ * The delta and sigma terms are not used, and not kept up to date.
+ */
+static void rw_chain_run_varpro (rw_chain * ch, size_t ntrials)
+{
+    size_t ii, ielem;
+    double oldval, dchi2, prob, chi2, delrow[4];
+    double * supmat = ch->supmat;
+    const double * rnd;
+
+    for (size_t it = 0; it < ntrials && !ch->stop; it++)
+    {
+        ii = ch->iter++;
+
+        if (ch->rpos + 3 > RW_RBUF)
+        {
+            pcg32x_fill(&ch->rng, ch->rbuf, RW_RBUF);
+            ch->rpos = 0;
+        }
+        rnd = ch->rbuf + ch->rpos;
+        ch->rpos += 3;
+
+        /* Step an element of the sigma row. */
+        ielem  = 4 + (size_t) (rnd[0] * 4);
+        oldval = supmat[ielem];
+        supmat[ielem] += (rnd[1] > 0.5) ? -ch->steps[ielem]
+                                        :  ch->steps[ielem];
+        if (supmat[ielem] == 0.0)
+        {
+            supmat[ielem] = oldval;
+            continue;
+        }
+
+        /* Best delta row of the new sigma row; reject if singular. */
+        ch->imat++;
+        ch->el_prop[ielem]++;
+        if (roi_varpro_fit(ch->terms.rd, ch->terms.nominal, supmat + 4,
+                           delrow, &chi2) != 0)
+        {
+            supmat[ielem] = oldval;
+            continue;
+        }
+
+        dchi2 = chi2 - ch->chi2;
+        prob  = exp(-dchi2 * ch->beta * Bk);
+        if (prob > 1.0) prob = 1.0;
+
+        if (rnd[2] <= prob)
+        {
+            ch->chi2 = chi2;
+            memcpy(supmat, delrow, sizeof(delrow));
+            ch->el_acc[ielem]++;
+            ch->old_accept = ch->accept;
+            ch->accept++;
         }
         else
         {
-            /* Vertical changes. */
-            kd = positions_calc(ds, supmat + 8, ds->nom_v, pos_v);
-            chi2_v_aft = chi2_calc(ds->nom_v, pos_v, &ds->roi);
-            imat_v++;
+            supmat[ielem] = oldval;
+        }
+
+        rw_chain_cool(ch, ii);
+    }
+}
+
+
+/* Perform ntrials more steps of the random walk of chain ch. The walk
+ * may thus be run in several segments. With more than one candidate per
+ * trial (prm->ntries), trials are multiple-try Metropolis ones. With
+ * prm->varpro, only the sigma row is walked (rw_chain_run_varpro).
+ */
+void rw_chain_run (rw_chain * ch, size_t ntrials)
+{
+    size_t ii, ielem;
+    double oldval, dterm, dchi2, prob, sign;
+    double * supmat = ch->supmat;
+    const double * rnd;
+    int mm = ch->prm->ntries;
+    size_t nrnd = (mm > 1) ? 4 * (size_t) mm : 3;
+    kdchi2 kc;
+
+    if (ch->prm->varpro)
+    {
+        rw_chain_run_varpro(ch, ntrials);
+        return;
+    }
+
+    for (size_t it = 0; it < ntrials && !ch->stop; it++)
+    {
+        ii = ch->iter++;
+
+        /* Random numbers of the trial: element, sign and acceptance. */
+        if (ch->rpos + nrnd > RW_RBUF)
+        {
+            pcg32x_fill(&ch->rng, ch->rbuf, RW_RBUF);
+            ch->rpos = 0;
+        }
+        rnd = ch->rbuf + ch->rpos;
+        ch->rpos += nrnd;
+
+        if (mm > 1)
+        {
+            rw_chain_mtm(ch, rnd);
+            rw_chain_cool(ch, ii);
+            continue;
+        }
+
+        /* Pick an element of the half suppression matrix. */
+        ielem = (size_t) (rnd[0] * 8);
+
+        /* Choose sign (increase/decrease step).      */
+        sign = (rnd[1] > 0.5) ? -1.0 : 1.0;
+        /* Add up in chosen matrix element value.     */
+        oldval = supmat[ielem];
+        supmat[ielem] += sign * ch->steps[ielem];
+
+        /* Skip if new value would be zero. */
+        if (supmat[ielem] == 0.0) 
+        {
+            supmat[ielem] = oldval;
+            continue;
         }
-        
+
+        /* Recalculate scaling and chi2 with the change of the delta or
+         * sigma terms, which are added up to the cached ones only if the
+         * change is accepted. Minimization takes only ROI into account. */
+        dterm = supmat[ielem] - oldval;
+        kc = rw_chain_fit(ch, ielem, dterm, (sign > 0.0) ? 1 : -1);
+        ch->imat++;
+        ch->el_prop[ielem]++;
+
         /* If the scaling failed, reject change. */
-        if (kd.k == 1.0) 
+        if (kc.failed)
         {
-            printf("\n");
+            ch->nfailed++;
+            supmat[ielem] = oldval;
             continue;
         }
-           
+
         /* Calculate the change in chi2. */
-        chi2_aft = (chi2_h_aft + chi2_v_aft);
-        dchi2    = chi2_aft - chi2;
+        dchi2 = kc.chi2 - ch->chi2;
 
         /* Probability of acceptance. */
-        prob = exp(-dchi2 * beta * Bk);
+        prob = exp(-dchi2 * ch->beta * Bk);
 
         /* probability = min(1, prob). */
         if (prob > 1.0) prob = 1.0;
 
         /* Accept or reject change. */
-        if (pcg_double() <= prob)
+        if (rnd[2] <= prob)
         {
-            /* If change is accomplished, copy state values 
-             * to former variables and reduce temperature. */
-            chi2 = chi2_aft;
-            chi2_h = chi2_h_aft;
-            chi2_v = chi2_v_aft;
-            old_accept = accept;
-            accept++;
+            /* If change is accomplished, keep the new chi2 and terms. */
+            ch->chi2 = kc.chi2;
+            roi_terms_update(&ch->terms, ielem, dterm);
+            ch->memo.coord[ielem] += (sign > 0.0) ? 1 : -1;
+            ch->el_acc[ielem]++;
+            ch->old_accept = ch->accept;
+            ch->accept++;
         }
         else
         {
             /* If change is rejected, restore former value. */
-            supmat[isite] = oldval;
-            chi2_aft = chi2;
-            chi2_h_aft = chi2_h;
-            chi2_v_aft = chi2_v;
+            supmat[ielem] = oldval;
         }
 
         /* Decide whether to decrease temperature. */
-        if (ii % ACCEPT_CHECK_INTERVAL == 0 && ii > 0)
+        rw_chain_cool(ch, ii);
+    }
+}
+
+
+/* Free up the memory of chain ch.
+ */
+void rw_chain_free (rw_chain * ch)
+{
+    roi_terms_free(&ch->terms);
+    free(ch->memo.slot);
+    ch->memo.slot = NULL;
+}
+
+
+/* Proposal of a speculative batch and its evaluation. */
+typedef struct
+{
+    size_t ielem;               /* Element changed.                 */
+    double newval, dterm;       /* Its new value and the change.    */
+    kdchi2 kc;                  /* Fit with the change.             */
+} rw_proposal;
+
+/* Speculative batch shared with the team's threads. */
+typedef struct
+{
+    const rw_chain * ch;
+    rw_proposal * prop;
+    size_t nb;                  /* Number of proposals.             */
+} rw_batch;
+
+
+/* Evaluate the proposals of a batch against the current chain state.
+ */
+static void rw_batch_task (void * arg, int tid, int nthreads)
+{
+    rw_batch * bt = (rw_batch *) arg;
+    for (size_t kk = (size_t) tid; kk < bt->nb; kk += (size_t) nthreads)
+    {
+        rw_proposal * pr = &bt->prop[kk];
+        if (pr->newval == 0.0) continue;
+        pr->kc = roi_terms_fit(&bt->ch->terms, pr->ielem, pr->dterm);
+    }
+}
+
+
+/* Perform ntrials more steps of the random walk of chain ch, evaluating
+ * up to width proposals at a time on the threads of team. Every proposal
+ * of a batch is evaluated against the current state, as if those before
+ * it were rejected; the decisions are then taken in order with their own
+ * random numbers, the first acceptance is committed and the proposals
+ * after it are discarded (their random numbers are used by the next
+ * batch). Batches end at temperature and step updates, thus the walk is
+ * exactly the one rw_chain_run would perform.
+ */
+void rw_chain_run_spec (rw_chain * ch, size_t ntrials, thread_team * team,
+                        size_t width)
+{
+    double * supmat = ch->supmat;
+    double dchi2, prob;
+    size_t kk, nb, ii;
+    const double * rnd;
+
+    rw_proposal * prop = malloc(width * sizeof(rw_proposal));
+    if (prop == NULL)
+    {
+        printf(" ERROR (rw_chain_run_spec): could not allocate memory"
+               " for proposals. Aborting.\n");
+        exit(-1);
+    }
+    rw_batch bt = {ch, prop, 0};
+
+    while (ntrials > 0 && !ch->stop)
+    {
+        if (ch->rpos == RW_RBUF)
+        {
+            pcg32x_fill(&ch->rng, ch->rbuf, RW_RBUF);
+            ch->rpos = 0;
+        }
+
+        /* Batch size: up to the next rate check (included) and within
+         * the random numbers already drawn. */
+        ii = ch->iter;
+        nb = ACCEPT_CHECK_INTERVAL - ii % ACCEPT_CHECK_INTERVAL + 1;
+        if (ii % ACCEPT_CHECK_INTERVAL == 0 && ii > 0) nb = 1;
+        if (nb > width) nb = width;
+        if (nb > ntrials) nb = ntrials;
+        if (nb > (RW_RBUF - ch->rpos) / 3) nb = (RW_RBUF - ch->rpos) / 3;
+
+        for (kk = 0; kk < nb; kk++)
         {
-            daccept = (double)(accept - old_accept) / ACCEPT_CHECK_INTERVAL;
-            if (daccept < 0.1)
+            rnd = ch->rbuf + ch->rpos + 3 * kk;
+            rw_proposal * pr = &prop[kk];
+            pr->ielem  = (size_t) (rnd[0] * 8);
+            pr->newval = supmat[pr->ielem]
+                       + ((rnd[1] > 0.5) ? -1.0 : 1.0)
+                       * ch->steps[pr->ielem];
+            pr->dterm  = pr->newval - supmat[pr->ielem];
+        }
+        bt.nb = nb;
+        team_run(team, rw_batch_task, &bt);
+
+        /* Decisions, in order, up to the first acceptance. */
+        for (kk = 0; kk < nb; kk++)
+        {
+            rw_proposal * pr = &prop[kk];
+            rnd = ch->rbuf + ch->rpos;
+            ii  = ch->iter++;
+            ch->rpos += 3;
+            ntrials--;
+
+            if (pr->newval == 0.0) continue;
+
+            ch->imat++;
+            ch->el_prop[pr->ielem]++;
+            if (pr->kc.failed)
             {
-                beta *= 1.01;
+                ch->nfailed++;
+                continue;
             }
-            old_accept = accept;
 
-            /* Reduce step size based on acceptance rate. */
-            prm->step /= 1.0 + log2(1.0 + daccept);
+            dchi2 = pr->kc.chi2 - ch->chi2;
+            prob  = exp(-dchi2 * ch->beta * Bk);
+            if (prob > 1.0) prob = 1.0;
+
+            if (rnd[2] <= prob)
+            {
+                supmat[pr->ielem] = pr->newval;
+                ch->chi2 = pr->kc.chi2;
+                roi_terms_update(&ch->terms, pr->ielem, pr->dterm);
+                ch->el_acc[pr->ielem]++;
+                ch->old_accept = ch->accept;
+                ch->accept++;
+                rw_chain_cool(ch, ii);
+                break;
+            }
+            rw_chain_cool(ch, ii);
         }
     }
+    free(prop);
+}
 
-    /* Final positions. */
-    positions_calc(ds, supmat,     ds->nom_h, pos_h);
-    positions_calc(ds, supmat + 8, ds->nom_v, pos_v);
 
-    // DEBUG : print ROI
-    /*
-    printf("\n\n##### (RANDOM WALK) ROI: #####\n");
-    for (size_t ii = 0; ii < ds->roi.nsites; ii++)
+/* Move chain ch to the ROI data rd: the terms are recalculated over its
+ * sites, keeping the team, and so is the chi2. The cache is restarted,
+ * since cached fits belong to the former sites.
+ */
+static void rw_chain_level (rw_chain * ch, const roi_data * rd)
+{
+    thread_team * team = ch->terms.team;
+
+    roi_terms_free(&ch->terms);
+    ch->terms = roi_terms_alloc(rd, ch->axis, ch->prm->single);
+    ch->terms.team = team;
+    if (ch->prm->varpro) ch->chi2 = rw_chain_project(ch);
+    roi_terms_calc(&ch->terms, ch->supmat);
+    if (!ch->prm->varpro) ch->chi2 = roi_terms_fit(&ch->terms, 0, 0.0).chi2;
+    ch->chi2_win = ch->chi2;
+    ch->iter_win = ch->iter;
+    rw_memo_reset(&ch->memo);
+}
+
+
+/* Run the nrand trials of chain ch through the coarse ROI levels of the
+ * data, if any, and then the full ROI, which takes the trials left. Each
+ * level starts where the former one stopped, with its temperature and
+ * step. A stopping criterion met on a coarse level ends that level only,
+ * and its trials left go to the full ROI; the time budget ends the walk.
+ * A level stopped by the step floor gives the next one the step it
+ * started with.
+ * The trials run speculatively on team if it is not NULL.
+ */
+static void rw_chain_levels (rw_chain * ch, thread_team * team)
+{
+    const dataset * ds = ch->ds;
+    size_t ntrials;
+    double step0, steps0[PARAM_MAX];
+
+    for (int il = 0; il < ds->nlevels; il++)
     {
-        printf(" %10.4f %10.4f",
-               ds->nom_h[ds->roi.idx[ii]], ds->nom_v[ds->roi.idx[ii]]);
-        printf(" %10.4f %10.4f\n",
-               pos_h[ds->roi.idx[ii]], pos_v[ds->roi.idx[ii]]);
+        ntrials = (size_t) (ch->prm->level_frac[il] * ch->nrand);
+        rw_chain_level(ch, &ds->level_rd[il]);
+        step0 = ch->step;
+        memcpy(steps0, ch->steps, sizeof(steps0));
+        if (team != NULL)
+            rw_chain_run_spec(ch, ntrials, team,
+                              (size_t) ch->prm->speculate);
+        else
+            rw_chain_run(ch, ntrials);
+        if (ch->stop == STOP_TIME) return;
+
+        /* A level whose step fell below the floor starts the next one
+         * with its own initial step, not at the floor. */
+        if (ch->stop == STOP_STEP)
+        {
+            ch->step = step0;
+            memcpy(ch->steps, steps0, sizeof(steps0));
+        }
+        ch->stop = STOP_NONE;
     }
-    printf("\n");
-    */
-    // DEBUG
+    if (ds->nlevels > 0) rw_chain_level(ch, &ds->rd);
+
+    ntrials = ch->nrand - ch->iter;
+    if (team != NULL)
+        rw_chain_run_spec(ch, ntrials, team, (size_t) ch->prm->speculate);
+    else
+        rw_chain_run(ch, ntrials);
+}
+
+
+/* Thread entry point running a chain, speculatively if requested, on a
+ * team of its own (half the threads, one of the two chains each). With
+ * ch->nsplit threads, the ROI evaluations of the chain are split over a
+ * team pinned to processors ch->cpu0 on.
+ */
+static void * rw_chain_thread (void * arg)
+{
+    rw_chain * ch = (rw_chain *) arg;
+    const xbpm_prm * prm = ch->prm;
+
+    if (ch->nsplit > 1)
+    {
+        thread_team * team = team_create(ch->nsplit);
+        team_pin(team, ch->cpu0);
+        ch->terms.team = team;
+        rw_chain_levels(ch, NULL);
+        ch->terms.team = NULL;
+        team_destroy(team);
+    }
+    else if (prm->speculate > 1)
+    {
+        int nthreads = (prm->nthreads > 0) ? prm->nthreads : team_cores();
+        nthreads /= 2;
+        if (nthreads < 1) nthreads = 1;
+        if (nthreads > prm->speculate) nthreads = prm->speculate;
+
+        thread_team * team = team_create(nthreads);
+        rw_chain_levels(ch, team);
+        team_destroy(team);
+    }
+    else
+    {
+        rw_chain_levels(ch, NULL);
+    }
+    return NULL;
+}
 
-    return (rw_stats) {imat_h, imat_v, accept, beta};
-}
\ No newline at end of file
+
+/* Statistics of the H (chain[0]) and V (chain[1]) chains of a walk.
+ */
+static rw_stats rw_chains_stats (const rw_chain * chain)
+{
+    return (rw_stats) {chain[0].imat,   chain[1].imat,
+                       chain[0].accept, chain[1].accept,
+                       chain[0].beta,   chain[1].beta,
+                       chain[0].step,   chain[1].step,
+                       chain[0].chi2,   chain[1].chi2,
+                       chain[0].memo.lookups + chain[1].memo.lookups,
+                       chain[0].memo.hits    + chain[1].memo.hits,
+                       chain[0].iter,   chain[1].iter,
+                       chain[0].stop,   chain[1].stop,
+                       chain[0].nfailed + chain[1].nfailed};
+}
+
+
+/* Perform a complete random walk of matrix supmat, H and V chains one
+ * after the other in the calling thread, drawing random numbers from
+ * streams stream and stream + 1 of seed. Positions are not calculated.
+ * Used by engines which run many walks concurrently.
+ */
+rw_stats random_walk_serial (const dataset * ds, const xbpm_prm * prm,
+                             double * supmat, uint64_t seed, uint64_t stream)
+{
+    rw_chain chain[2];
+    int axis;
+
+    rw_chain_init(&chain[0], ds, prm, supmat,     0,
+                  (prm->nrand + 1) / 2, seed, stream);
+    rw_chain_init(&chain[1], ds, prm, supmat + 8, 1,
+                  prm->nrand / 2,       seed, stream + 1);
+
+    for (axis = 0; axis < 2; axis++)
+    {
+        rw_chain_levels(&chain[axis], NULL);
+        rw_chain_free(&chain[axis]);
+    }
+    return rw_chains_stats(chain);
+}
+
+
+/* Number of threads splitting the ROI of each chain of a walk: as given
+ * by prm->split or, if it is negative, half the threads when the ROI is
+ * larger than the calibrated threshold of terms rt.
+ */
+static int rw_split_threads (const xbpm_prm * prm, roi_terms * rt)
+{
+    int nthreads = (prm->nthreads > 0) ? prm->nthreads : team_cores();
+    size_t threshold;
+
+    if (prm->split >= 0)
+    {
+        if (prm->split > 1)
+        {
+            printf("##### ROI split over %d threads per chain.\n\n",
+                   prm->split);
+        }
+        return prm->split;
+    }
+
+    nthreads /= 2;
+    if (nthreads > ROI_SPLIT_MAX) nthreads = ROI_SPLIT_MAX;
+    if (nthreads < 2 || prm->speculate > 1 || prm->varpro ||
+        prm->ntries > 1) return 0;
+
+    thread_team * team = team_create(nthreads);
+    threshold = roi_split_threshold(rt, team);
+    team_destroy(team);
+
+    if (rt->rd->nsites < threshold)
+    {
+        printf("##### ROI evaluated serially (%zu sites, split"
+               " threshold %zu).\n\n", rt->rd->nsites, threshold);
+        return 0;
+    }
+    printf("##### ROI split over %d threads per chain (%zu sites,"
+           " threshold %zu).\n\n", nthreads, rt->rd->nsites, threshold);
+    return nthreads;
+}
+
+
+/* Perform random walk to optimize suppression matrix. The horizontal and
+ * vertical halves of the matrix are optimized by two independent chains,
+ * run concurrently, which share the nrand trials.
+ */
+rw_stats random_walk(dataset * ds, xbpm_prm * prm, double * supmat,
+                   double * pos_h, double * pos_v)
+{
+    rw_chain chain[2];
+    pthread_t thread[2];
+    int axis;
+
+    /* Each chain draws from its own stream of the run's seed. */
+    rw_chain_init(&chain[0], ds, prm, supmat,     0,
+                  (prm->nrand + 1) / 2, prm->seed, prm->stream);
+    rw_chain_init(&chain[1], ds, prm, supmat + 8, 1,
+                  prm->nrand / 2,       prm->seed, prm->stream + 1);
+
+    /* Data-parallel evaluation of large ROIs. */
+    int nsplit = rw_split_threads(prm, &chain[0].terms);
+    for (axis = 0; axis < 2; axis++)
+    {
+        chain[axis].nsplit = nsplit;
+        chain[axis].cpu0   = axis * nsplit;
+    }
+
+    for (axis = 0; axis < 2; axis++)
+    {
+        if (pthread_create(&thread[axis], NULL, rw_chain_thread,
+                           &chain[axis]) != 0)
+        {
+            printf(" ERROR (random_walk): could not create chain"
+                   " thread. Aborting.\n");
+            exit(-1);
+        }
+    }
+    for (axis = 0; axis < 2; axis++)
+    {
+        pthread_join(thread[axis], NULL);
+        rw_chain_free(&chain[axis]);
+    }
+
+    /* Final positions. */
+    positions_calc(ds, supmat,     ds->nom_h, pos_h);
+    positions_calc(ds, supmat + 8, ds->nom_v, pos_v);
+
+    return rw_chains_stats(chain);
+}
@@ -0,0 +1,1485 @@
+#include "simd_kernels.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+/* Number of sites of each block of the blocked reductions (a multiple
+ * of the widest vector width).
+ */
+#define SIMD_BLOCK  256
+
+/* Upper limit of the block starting at site ib. */
+#define BLOCK_END(ib, nn) \
+    (((ib) + SIMD_BLOCK < (nn)) ? (ib) + SIMD_BLOCK : (nn))
+
+
+/* -------------------------------------------------------------------- */
+/* Scalar kernels (reference and fallback).                             */
+/* -------------------------------------------------------------------- */
+
+static void raw_positions_scalar (const double * const bl[4],
+                                  const double * s, double * pos, size_t nn)
+{
+    double delta, sigma;
+    for (size_t ii = 0; ii < nn; ii++)
+    {
+        delta = s[0] * bl[0][ii] + s[1] * bl[1][ii]
+              + s[2] * bl[2][ii] + s[3] * bl[3][ii];
+        sigma = s[4] * bl[0][ii] + s[5] * bl[1][ii]
+              + s[6] * bl[2][ii] + s[7] * bl[3][ii];
+        pos[ii] = delta / sigma;
+    }
+}
+
+
+static double roi_dot_scalar (const double * mA, const double * mB,
+                              const size_t * idx, size_t nn)
+{
+    double total = 0.0, part;
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        size_t ie = BLOCK_END(ib, nn);
+        part = 0.0;
+        for (size_t ii = ib; ii < ie; ii++)
+        {
+            part += mA[idx[ii]] * mB[idx[ii]];
+        }
+        total += part;
+    }
+    return total;
+}
+
+
+static double roi_sum_scalar (const double * mA, const size_t * idx,
+                              size_t nn)
+{
+    double total = 0.0, part;
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        size_t ie = BLOCK_END(ib, nn);
+        part = 0.0;
+        for (size_t ii = ib; ii < ie; ii++)
+        {
+            part += mA[idx[ii]];
+        }
+        total += part;
+    }
+    return total;
+}
+
+
+static double roi_diff2_scalar (const double * mA, const double * mB,
+                                const size_t * idx, size_t nn)
+{
+    double total = 0.0, part, df;
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        size_t ie = BLOCK_END(ib, nn);
+        part = 0.0;
+        for (size_t ii = ib; ii < ie; ii++)
+        {
+            df    = mA[idx[ii]] - mB[idx[ii]];
+            part += df * df;
+        }
+        total += part;
+    }
+    return total;
+}
+
+
+/* Tail of the regression sums, from site ii up to ie. */
+static inline void fit_sums_tail (const double * delta, const double * sigma,
+                                  double ad, double as, const double * blade,
+                                  const double * nominal,
+                                  double x0, double y0,
+                                  size_t ii, size_t ie, double pp[5])
+{
+    double xx, yy;
+    for (; ii < ie; ii++)
+    {
+        xx = (delta[ii] + ad * blade[ii]) / (sigma[ii] + as * blade[ii]) - x0;
+        yy = nominal[ii] - y0;
+        pp[0] += xx;
+        pp[1] += xx * xx;
+        pp[2] += yy;
+        pp[3] += xx * yy;
+        pp[4] += yy * yy;
+    }
+}
+
+
+static void fit_sums_scalar (const double * delta, const double * sigma,
+                             double ad, double as, const double * blade,
+                             const double * nominal, double x0, double y0,
+                             size_t nn, double sums[5])
+{
+    double pp[5];
+    memset(sums, 0, 5 * sizeof(double));
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        memset(pp, 0, sizeof(pp));
+        fit_sums_tail(delta, sigma, ad, as, blade, nominal, x0, y0,
+                      ib, BLOCK_END(ib, nn), pp);
+        for (int jj = 0; jj < 5; jj++) sums[jj] += pp[jj];
+    }
+}
+
+
+/* Tail of the single precision regression sums, from site ii up to ie.
+ * Positions are calculated in single precision, sums in double.
+ */
+static inline void fit_sums_f32_tail (const float * delta, const float * sigma,
+                                      float ad, float as, const float * blade,
+                                      const double * nominal,
+                                      double x0, double y0,
+                                      size_t ii, size_t ie, double pp[5])
+{
+    double xx, yy;
+    for (; ii < ie; ii++)
+    {
+        xx = (double) ((delta[ii] + ad * blade[ii])
+                     / (sigma[ii] + as * blade[ii])) - x0;
+        yy = nominal[ii] - y0;
+        pp[0] += xx;
+        pp[1] += xx * xx;
+        pp[2] += yy;
+        pp[3] += xx * yy;
+        pp[4] += yy * yy;
+    }
+}
+
+
+static void fit_sums_f32_scalar (const float * delta, const float * sigma,
+                                 float ad, float as, const float * blade,
+                                 const double * nominal, double x0, double y0,
+                                 size_t nn, double sums[5])
+{
+    double pp[5];
+    memset(sums, 0, 5 * sizeof(double));
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        memset(pp, 0, sizeof(pp));
+        fit_sums_f32_tail(delta, sigma, ad, as, blade, nominal, x0, y0,
+                          ib, BLOCK_END(ib, nn), pp);
+        for (int jj = 0; jj < 5; jj++) sums[jj] += pp[jj];
+    }
+}
+
+
+/* Tail of the regression sums of candidate move mv, from site ii up to
+ * ie; b0 and b1 are the blades of the move.
+ */
+static inline void fit_multi_tail (const double * delta, const double * sigma,
+                                   const double * b0, const double * b1,
+                                   const fit_move * mv,
+                                   const double * nominal,
+                                   double x0, double y0,
+                                   size_t ii, size_t ie, double pp[5])
+{
+    double xx, yy;
+    for (; ii < ie; ii++)
+    {
+        xx = (delta[ii] + mv->ad[0] * b0[ii] + mv->ad[1] * b1[ii])
+           / (sigma[ii] + mv->as[0] * b0[ii] + mv->as[1] * b1[ii]) - x0;
+        yy = nominal[ii] - y0;
+        pp[0] += xx;
+        pp[1] += xx * xx;
+        pp[2] += yy;
+        pp[3] += xx * yy;
+        pp[4] += yy * yy;
+    }
+}
+
+
+static void fit_sums_multi_scalar (const double * delta, const double * sigma,
+                                   const double * const bl[4],
+                                   const double * nominal, const double * x0,
+                                   double y0, size_t nn, const fit_move * mv,
+                                   int mm, double * sums)
+{
+    memset(sums, 0, 5 * mm * sizeof(double));
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        for (int im = 0; im < mm; im++)
+        {
+            double pp[5] = {0.0, 0.0, 0.0, 0.0, 0.0};
+            fit_multi_tail(delta, sigma, bl[mv[im].bl[0]], bl[mv[im].bl[1]],
+                           &mv[im], nominal, x0[im], y0,
+                           ib, BLOCK_END(ib, nn), pp);
+            for (int jj = 0; jj < 5; jj++) sums[5 * im + jj] += pp[jj];
+        }
+    }
+}
+
+
+/* Single precision tail of the regression sums of candidate move mv. */
+static inline void fit_multi_f32_tail (const float * delta,
+                                       const float * sigma,
+                                       const float * b0, const float * b1,
+                                       const float cf[4],
+                                       const double * nominal,
+                                       double x0, double y0,
+                                       size_t ii, size_t ie, double pp[5])
+{
+    double xx, yy;
+    for (; ii < ie; ii++)
+    {
+        xx = (double) ((delta[ii] + cf[0] * b0[ii] + cf[1] * b1[ii])
+                     / (sigma[ii] + cf[2] * b0[ii] + cf[3] * b1[ii])) - x0;
+        yy = nominal[ii] - y0;
+        pp[0] += xx;
+        pp[1] += xx * xx;
+        pp[2] += yy;
+        pp[3] += xx * yy;
+        pp[4] += yy * yy;
+    }
+}
+
+
+/* Single precision coefficients (ad[0], ad[1], as[0], as[1]) of a move. */
+static inline void fit_move_f32 (const fit_move * mv, float cf[4])
+{
+    cf[0] = (float) mv->ad[0];
+    cf[1] = (float) mv->ad[1];
+    cf[2] = (float) mv->as[0];
+    cf[3] = (float) mv->as[1];
+}
+
+
+static void fit_sums_multi_f32_scalar (const float * delta,
+                                       const float * sigma,
+                                       const float * const bl[4],
+                                       const double * nominal,
+                                       const double * x0, double y0, size_t nn,
+                                       const fit_move * mv, int mm,
+                                       double * sums)
+{
+    float cf[4];
+    memset(sums, 0, 5 * mm * sizeof(double));
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        for (int im = 0; im < mm; im++)
+        {
+            double pp[5] = {0.0, 0.0, 0.0, 0.0, 0.0};
+            fit_move_f32(&mv[im], cf);
+            fit_multi_f32_tail(delta, sigma, bl[mv[im].bl[0]],
+                               bl[mv[im].bl[1]], cf, nominal, x0[im], y0,
+                               ib, BLOCK_END(ib, nn), pp);
+            for (int jj = 0; jj < 5; jj++) sums[5 * im + jj] += pp[jj];
+        }
+    }
+}
+
+
+/* Tail of the variable projection sums (see varpro_sums) of sites ii to
+ * ie, added up to pp. */
+static inline void varpro_tail (const double * const bl[4],
+                                const double * nominal, const double * sg,
+                                double y0, size_t ii, size_t ie,
+                                double pp[15])
+{
+    double zz[4], rs, yy;
+    int jj, ll, kk;
+    for (; ii < ie; ii++)
+    {
+        rs = 1.0 / (sg[0] * bl[0][ii] + sg[1] * bl[1][ii]
+                  + sg[2] * bl[2][ii] + sg[3] * bl[3][ii]);
+        yy = nominal[ii] - y0;
+        for (jj = 0; jj < 4; jj++) zz[jj] = bl[jj][ii] * rs;
+        for (jj = 0, kk = 0; jj < 4; jj++)
+        {
+            for (ll = jj; ll < 4; ll++) pp[kk++] += zz[jj] * zz[ll];
+        }
+        for (jj = 0; jj < 4; jj++) pp[10 + jj] += zz[jj] * yy;
+        pp[14] += yy * yy;
+    }
+}
+
+
+static void varpro_sums_scalar (const double * const bl[4],
+                                const double * nominal, const double * sg,
+                                double y0, size_t nn, double sums[15])
+{
+    memset(sums, 0, 15 * sizeof(double));
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        double pp[15] = {0.0};
+        varpro_tail(bl, nominal, sg, y0, ib, BLOCK_END(ib, nn), pp);
+        for (int jj = 0; jj < 15; jj++) sums[jj] += pp[jj];
+    }
+}
+
+
+#ifdef SIMD_X86
+
+/* -------------------------------------------------------------------- */
+/* SSE2 kernels (2 lanes). SSE2 has no gather, indexed loads are done   */
+/* element by element.                                                   */
+/* -------------------------------------------------------------------- */
+
+__attribute__((target("sse2")))
+static inline double hsum_sse2 (__m128d vv)
+{
+    return _mm_cvtsd_f64(vv) + _mm_cvtsd_f64(_mm_unpackhi_pd(vv, vv));
+}
+
+
+__attribute__((target("sse2")))
+static void raw_positions_sse2 (const double * const bl[4],
+                                const double * s, double * pos, size_t nn)
+{
+    size_t ii = 0;
+    __m128d b0, b1, b2, b3, dd, ss;
+    for (; ii + 2 <= nn; ii += 2)
+    {
+        b0 = _mm_loadu_pd(bl[0] + ii);
+        b1 = _mm_loadu_pd(bl[1] + ii);
+        b2 = _mm_loadu_pd(bl[2] + ii);
+        b3 = _mm_loadu_pd(bl[3] + ii);
+        dd = _mm_add_pd(
+                _mm_add_pd(_mm_mul_pd(_mm_set1_pd(s[0]), b0),
+                           _mm_mul_pd(_mm_set1_pd(s[1]), b1)),
+                _mm_add_pd(_mm_mul_pd(_mm_set1_pd(s[2]), b2),
+                           _mm_mul_pd(_mm_set1_pd(s[3]), b3)));
+        ss = _mm_add_pd(
+                _mm_add_pd(_mm_mul_pd(_mm_set1_pd(s[4]), b0),
+                           _mm_mul_pd(_mm_set1_pd(s[5]), b1)),
+                _mm_add_pd(_mm_mul_pd(_mm_set1_pd(s[6]), b2),
+                           _mm_mul_pd(_mm_set1_pd(s[7]), b3)));
+        _mm_storeu_pd(pos + ii, _mm_div_pd(dd, ss));
+    }
+    const double * tl[4] = {bl[0] + ii, bl[1] + ii, bl[2] + ii, bl[3] + ii};
+    raw_positions_scalar(tl, s, pos + ii, nn - ii);
+}
+
+
+__attribute__((target("sse2")))
+static inline __m128d gather_sse2 (const double * mA, const size_t * idx)
+{
+    return _mm_set_pd(mA[idx[1]], mA[idx[0]]);
+}
+
+
+__attribute__((target("sse2")))
+static double roi_dot_sse2 (const double * mA, const double * mB,
+                            const size_t * idx, size_t nn)
+{
+    double total = 0.0;
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        size_t ii = ib, ie = BLOCK_END(ib, nn);
+        __m128d acc = _mm_setzero_pd();
+        for (; ii + 2 <= ie; ii += 2)
+        {
+            acc = _mm_add_pd(acc, _mm_mul_pd(gather_sse2(mA, idx + ii),
+                                             gather_sse2(mB, idx + ii)));
+        }
+        total += hsum_sse2(acc) + roi_dot_scalar(mA, mB, idx + ii, ie - ii);
+    }
+    return total;
+}
+
+
+__attribute__((target("sse2")))
+static double roi_sum_sse2 (const double * mA, const size_t * idx, size_t nn)
+{
+    double total = 0.0;
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        size_t ii = ib, ie = BLOCK_END(ib, nn);
+        __m128d acc = _mm_setzero_pd();
+        for (; ii + 2 <= ie; ii += 2)
+        {
+            acc = _mm_add_pd(acc, gather_sse2(mA, idx + ii));
+        }
+        total += hsum_sse2(acc) + roi_sum_scalar(mA, idx + ii, ie - ii);
+    }
+    return total;
+}
+
+
+__attribute__((target("sse2")))
+static double roi_diff2_sse2 (const double * mA, const double * mB,
+                              const size_t * idx, size_t nn)
+{
+    double total = 0.0;
+    __m128d df;
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        size_t ii = ib, ie = BLOCK_END(ib, nn);
+        __m128d acc = _mm_setzero_pd();
+        for (; ii + 2 <= ie; ii += 2)
+        {
+            df  = _mm_sub_pd(gather_sse2(mA, idx + ii),
+                             gather_sse2(mB, idx + ii));
+            acc = _mm_add_pd(acc, _mm_mul_pd(df, df));
+        }
+        total += hsum_sse2(acc) + roi_diff2_scalar(mA, mB, idx + ii, ie - ii);
+    }
+    return total;
+}
+
+
+__attribute__((target("sse2")))
+static void fit_sums_sse2 (const double * delta, const double * sigma,
+                           double ad, double as, const double * blade,
+                           const double * nominal, double x0, double y0,
+                           size_t nn, double sums[5])
+{
+    double pp[5];
+    __m128d vad = _mm_set1_pd(ad), vas = _mm_set1_pd(as);
+    __m128d vx0 = _mm_set1_pd(x0), vy0 = _mm_set1_pd(y0);
+    __m128d bb, xx, yy;
+
+    memset(sums, 0, 5 * sizeof(double));
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        size_t ii = ib, ie = BLOCK_END(ib, nn);
+        __m128d sx  = _mm_setzero_pd(), sxx = _mm_setzero_pd();
+        __m128d sy  = _mm_setzero_pd(), sxy = _mm_setzero_pd();
+        __m128d syy = _mm_setzero_pd();
+        for (; ii + 2 <= ie; ii += 2)
+        {
+            bb  = _mm_loadu_pd(blade + ii);
+            xx  = _mm_div_pd(
+                    _mm_add_pd(_mm_loadu_pd(delta + ii), _mm_mul_pd(vad, bb)),
+                    _mm_add_pd(_mm_loadu_pd(sigma + ii), _mm_mul_pd(vas, bb)));
+            xx  = _mm_sub_pd(xx, vx0);
+            yy  = _mm_sub_pd(_mm_loadu_pd(nominal + ii), vy0);
+            sx  = _mm_add_pd(sx,  xx);
+            sxx = _mm_add_pd(sxx, _mm_mul_pd(xx, xx));
+            sy  = _mm_add_pd(sy,  yy);
+            sxy = _mm_add_pd(sxy, _mm_mul_pd(xx, yy));
+            syy = _mm_add_pd(syy, _mm_mul_pd(yy, yy));
+        }
+        pp[0] = hsum_sse2(sx);
+        pp[1] = hsum_sse2(sxx);
+        pp[2] = hsum_sse2(sy);
+        pp[3] = hsum_sse2(sxy);
+        pp[4] = hsum_sse2(syy);
+        fit_sums_tail(delta, sigma, ad, as, blade, nominal, x0, y0,
+                      ii, ie, pp);
+        for (int jj = 0; jj < 5; jj++) sums[jj] += pp[jj];
+    }
+}
+
+
+/* Accumulate the regression sums of two sites, given x - x0 and y - y0. */
+#define ACCUMULATE_SUMS(add, fma, xx, yy) \
+    do {                                  \
+        sx  = add(sx, xx);                \
+        sxx = fma(xx, xx, sxx);           \
+        sy  = add(sy, yy);                \
+        sxy = fma(xx, yy, sxy);           \
+        syy = fma(yy, yy, syy);           \
+    } while (0)
+
+__attribute__((target("sse2")))
+static inline __m128d fma_sse2 (__m128d aa, __m128d bb, __m128d cc)
+{
+    return _mm_add_pd(_mm_mul_pd(aa, bb), cc);
+}
+
+
+__attribute__((target("sse2")))
+static void fit_sums_f32_sse2 (const float * delta, const float * sigma,
+                               float ad, float as, const float * blade,
+                               const double * nominal, double x0, double y0,
+                               size_t nn, double sums[5])
+{
+    double pp[5];
+    __m128  vad = _mm_set1_ps(ad), vas = _mm_set1_ps(as);
+    __m128d vx0 = _mm_set1_pd(x0), vy0 = _mm_set1_pd(y0);
+    __m128  bb, xf;
+    __m128d xx, yy;
+
+    memset(sums, 0, 5 * sizeof(double));
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        size_t ii = ib, ie = BLOCK_END(ib, nn);
+        __m128d sx  = _mm_setzero_pd(), sxx = _mm_setzero_pd();
+        __m128d sy  = _mm_setzero_pd(), sxy = _mm_setzero_pd();
+        __m128d syy = _mm_setzero_pd();
+        for (; ii + 4 <= ie; ii += 4)
+        {
+            bb = _mm_loadu_ps(blade + ii);
+            xf = _mm_div_ps(
+                    _mm_add_ps(_mm_loadu_ps(delta + ii), _mm_mul_ps(vad, bb)),
+                    _mm_add_ps(_mm_loadu_ps(sigma + ii), _mm_mul_ps(vas, bb)));
+
+            xx = _mm_sub_pd(_mm_cvtps_pd(xf), vx0);
+            yy = _mm_sub_pd(_mm_loadu_pd(nominal + ii), vy0);
+            ACCUMULATE_SUMS(_mm_add_pd, fma_sse2, xx, yy);
+
+            xx = _mm_sub_pd(_mm_cvtps_pd(_mm_movehl_ps(xf, xf)), vx0);
+            yy = _mm_sub_pd(_mm_loadu_pd(nominal + ii + 2), vy0);
+            ACCUMULATE_SUMS(_mm_add_pd, fma_sse2, xx, yy);
+        }
+        pp[0] = hsum_sse2(sx);
+        pp[1] = hsum_sse2(sxx);
+        pp[2] = hsum_sse2(sy);
+        pp[3] = hsum_sse2(sxy);
+        pp[4] = hsum_sse2(syy);
+        fit_sums_f32_tail(delta, sigma, ad, as, blade, nominal, x0, y0,
+                          ii, ie, pp);
+        for (int jj = 0; jj < 5; jj++) sums[jj] += pp[jj];
+    }
+}
+
+
+__attribute__((target("sse2")))
+static void fit_sums_multi_sse2 (const double * delta, const double * sigma,
+                                 const double * const bl[4],
+                                 const double * nominal, const double * x0,
+                                 double y0, size_t nn, const fit_move * mv,
+                                 int mm, double * sums)
+{
+    __m128d vy0 = _mm_set1_pd(y0);
+    __m128d b0, b1, nu, de, xx, yy;
+
+    memset(sums, 0, 5 * mm * sizeof(double));
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        for (int im = 0; im < mm; im++)
+        {
+            const double * p0 = bl[mv[im].bl[0]], * p1 = bl[mv[im].bl[1]];
+            __m128d ad0 = _mm_set1_pd(mv[im].ad[0]);
+            __m128d ad1 = _mm_set1_pd(mv[im].ad[1]);
+            __m128d as0 = _mm_set1_pd(mv[im].as[0]);
+            __m128d as1 = _mm_set1_pd(mv[im].as[1]);
+            __m128d vx0 = _mm_set1_pd(x0[im]);
+            __m128d sx  = _mm_setzero_pd(), sxx = _mm_setzero_pd();
+            __m128d sy  = _mm_setzero_pd(), sxy = _mm_setzero_pd();
+            __m128d syy = _mm_setzero_pd();
+            double pp[5];
+            size_t ii = ib, ie = BLOCK_END(ib, nn);
+            for (; ii + 2 <= ie; ii += 2)
+            {
+                b0 = _mm_loadu_pd(p0 + ii);
+                b1 = _mm_loadu_pd(p1 + ii);
+                nu = _mm_add_pd(_mm_mul_pd(ad0, b0), _mm_loadu_pd(delta + ii));
+                de = _mm_add_pd(_mm_mul_pd(as0, b0), _mm_loadu_pd(sigma + ii));
+                nu = _mm_add_pd(_mm_mul_pd(ad1, b1), nu);
+                de = _mm_add_pd(_mm_mul_pd(as1, b1), de);
+                xx = _mm_sub_pd(_mm_div_pd(nu, de), vx0);
+                yy = _mm_sub_pd(_mm_loadu_pd(nominal + ii), vy0);
+                ACCUMULATE_SUMS(_mm_add_pd, fma_sse2, xx, yy);
+            }
+            pp[0] = hsum_sse2(sx);
+            pp[1] = hsum_sse2(sxx);
+            pp[2] = hsum_sse2(sy);
+            pp[3] = hsum_sse2(sxy);
+            pp[4] = hsum_sse2(syy);
+            fit_multi_tail(delta, sigma, p0, p1, &mv[im], nominal,
+                           x0[im], y0, ii, ie, pp);
+            for (int jj = 0; jj < 5; jj++) sums[5 * im + jj] += pp[jj];
+        }
+    }
+}
+
+
+__attribute__((target("sse2")))
+static void fit_sums_multi_f32_sse2 (const float * delta, const float * sigma,
+                                     const float * const bl[4],
+                                     const double * nominal, const double * x0,
+                                     double y0, size_t nn, const fit_move * mv,
+                                     int mm, double * sums)
+{
+    __m128d vy0 = _mm_set1_pd(y0);
+    __m128 b0, b1, nu, de, xf;
+    __m128d xx, yy;
+    float cf[4];
+
+    memset(sums, 0, 5 * mm * sizeof(double));
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        for (int im = 0; im < mm; im++)
+        {
+            const float * p0 = bl[mv[im].bl[0]], * p1 = bl[mv[im].bl[1]];
+            fit_move_f32(&mv[im], cf);
+            __m128 ad0 = _mm_set1_ps(cf[0]), ad1 = _mm_set1_ps(cf[1]);
+            __m128 as0 = _mm_set1_ps(cf[2]), as1 = _mm_set1_ps(cf[3]);
+            __m128d vx0 = _mm_set1_pd(x0[im]);
+            __m128d sx  = _mm_setzero_pd(), sxx = _mm_setzero_pd();
+            __m128d sy  = _mm_setzero_pd(), sxy = _mm_setzero_pd();
+            __m128d syy = _mm_setzero_pd();
+            double pp[5];
+            size_t ii = ib, ie = BLOCK_END(ib, nn);
+            for (; ii + 4 <= ie; ii += 4)
+            {
+                b0 = _mm_loadu_ps(p0 + ii);
+                b1 = _mm_loadu_ps(p1 + ii);
+                nu = _mm_add_ps(_mm_mul_ps(ad0, b0), _mm_loadu_ps(delta + ii));
+                de = _mm_add_ps(_mm_mul_ps(as0, b0), _mm_loadu_ps(sigma + ii));
+                nu = _mm_add_ps(_mm_mul_ps(ad1, b1), nu);
+                de = _mm_add_ps(_mm_mul_ps(as1, b1), de);
+                xf = _mm_div_ps(nu, de);
+
+                xx = _mm_sub_pd(_mm_cvtps_pd(xf), vx0);
+                yy = _mm_sub_pd(_mm_loadu_pd(nominal + ii), vy0);
+                ACCUMULATE_SUMS(_mm_add_pd, fma_sse2, xx, yy);
+
+                xx = _mm_sub_pd(_mm_cvtps_pd(_mm_movehl_ps(xf, xf)), vx0);
+                yy = _mm_sub_pd(_mm_loadu_pd(nominal + ii + 2), vy0);
+                ACCUMULATE_SUMS(_mm_add_pd, fma_sse2, xx, yy);
+            }
+            pp[0] = hsum_sse2(sx);
+            pp[1] = hsum_sse2(sxx);
+            pp[2] = hsum_sse2(sy);
+            pp[3] = hsum_sse2(sxy);
+            pp[4] = hsum_sse2(syy);
+            fit_multi_f32_tail(delta, sigma, p0, p1, cf, nominal,
+                               x0[im], y0, ii, ie, pp);
+            for (int jj = 0; jj < 5; jj++) sums[5 * im + jj] += pp[jj];
+        }
+    }
+}
+
+
+__attribute__((target("sse2")))
+static void varpro_sums_sse2 (const double * const bl[4],
+                              const double * nominal, const double * sg,
+                              double y0, size_t nn, double sums[15])
+{
+    __m128d vs[4], vy0 = _mm_set1_pd(y0), one = _mm_set1_pd(1.0);
+    __m128d zz[4], acc[15], rs, yy;
+    double pp[15];
+    int jj, ll, kk;
+
+    for (jj = 0; jj < 4; jj++) vs[jj] = _mm_set1_pd(sg[jj]);
+    memset(sums, 0, 15 * sizeof(double));
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        size_t ii = ib, ie = BLOCK_END(ib, nn);
+        for (jj = 0; jj < 15; jj++) acc[jj] = _mm_setzero_pd();
+        for (; ii + 2 <= ie; ii += 2)
+        {
+            rs = _mm_mul_pd(vs[0], _mm_loadu_pd(bl[0] + ii));
+            for (jj = 1; jj < 4; jj++)
+                rs = fma_sse2(vs[jj], _mm_loadu_pd(bl[jj] + ii), rs);
+            rs = _mm_div_pd(one, rs);
+            yy = _mm_sub_pd(_mm_loadu_pd(nominal + ii), vy0);
+            for (jj = 0; jj < 4; jj++)
+                zz[jj] = _mm_mul_pd(_mm_loadu_pd(bl[jj] + ii), rs);
+            for (jj = 0, kk = 0; jj < 4; jj++)
+            {
+                for (ll = jj; ll < 4; ll++, kk++)
+                    acc[kk] = fma_sse2(zz[jj], zz[ll], acc[kk]);
+            }
+            for (jj = 0; jj < 4; jj++)
+                acc[10 + jj] = fma_sse2(zz[jj], yy, acc[10 + jj]);
+            acc[14] = fma_sse2(yy, yy, acc[14]);
+        }
+        for (jj = 0; jj < 15; jj++) pp[jj] = hsum_sse2(acc[jj]);
+        varpro_tail(bl, nominal, sg, y0, ii, ie, pp);
+        for (jj = 0; jj < 15; jj++) sums[jj] += pp[jj];
+    }
+}
+
+
+/* -------------------------------------------------------------------- */
+/* AVX2 + FMA kernels (4 lanes, hardware gather).                       */
+/* -------------------------------------------------------------------- */
+
+__attribute__((target("avx2,fma")))
+static inline double hsum_avx2 (__m256d vv)
+{
+    __m128d lo = _mm256_castpd256_pd128(vv);
+    __m128d hi = _mm256_extractf128_pd(vv, 1);
+    lo = _mm_add_pd(lo, hi);
+    return _mm_cvtsd_f64(lo) + _mm_cvtsd_f64(_mm_unpackhi_pd(lo, lo));
+}
+
+
+__attribute__((target("avx2,fma")))
+static inline __m256d gather_avx2 (const double * mA, const size_t * idx)
+{
+    return _mm256_i64gather_pd(mA,
+                               _mm256_loadu_si256((const __m256i *) idx), 8);
+}
+
+
+__attribute__((target("avx2,fma")))
+static void raw_positions_avx2 (const double * const bl[4],
+                                const double * s, double * pos, size_t nn)
+{
+    size_t ii = 0;
+    __m256d b0, b1, b2, b3, dd, ss;
+    for (; ii + 4 <= nn; ii += 4)
+    {
+        b0 = _mm256_loadu_pd(bl[0] + ii);
+        b1 = _mm256_loadu_pd(bl[1] + ii);
+        b2 = _mm256_loadu_pd(bl[2] + ii);
+        b3 = _mm256_loadu_pd(bl[3] + ii);
+        dd = _mm256_mul_pd(_mm256_set1_pd(s[0]), b0);
+        dd = _mm256_fmadd_pd(_mm256_set1_pd(s[1]), b1, dd);
+        dd = _mm256_fmadd_pd(_mm256_set1_pd(s[2]), b2, dd);
+        dd = _mm256_fmadd_pd(_mm256_set1_pd(s[3]), b3, dd);
+        ss = _mm256_mul_pd(_mm256_set1_pd(s[4]), b0);
+        ss = _mm256_fmadd_pd(_mm256_set1_pd(s[5]), b1, ss);
+        ss = _mm256_fmadd_pd(_mm256_set1_pd(s[6]), b2, ss);
+        ss = _mm256_fmadd_pd(_mm256_set1_pd(s[7]), b3, ss);
+        _mm256_storeu_pd(pos + ii, _mm256_div_pd(dd, ss));
+    }
+    const double * tl[4] = {bl[0] + ii, bl[1] + ii, bl[2] + ii, bl[3] + ii};
+    raw_positions_scalar(tl, s, pos + ii, nn - ii);
+}
+
+
+__attribute__((target("avx2,fma")))
+static double roi_dot_avx2 (const double * mA, const double * mB,
+                            const size_t * idx, size_t nn)
+{
+    double total = 0.0;
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        size_t ii = ib, ie = BLOCK_END(ib, nn);
+        __m256d acc = _mm256_setzero_pd();
+        for (; ii + 4 <= ie; ii += 4)
+        {
+            acc = _mm256_fmadd_pd(gather_avx2(mA, idx + ii),
+                                  gather_avx2(mB, idx + ii), acc);
+        }
+        total += hsum_avx2(acc) + roi_dot_scalar(mA, mB, idx + ii, ie - ii);
+    }
+    return total;
+}
+
+
+__attribute__((target("avx2,fma")))
+static double roi_sum_avx2 (const double * mA, const size_t * idx, size_t nn)
+{
+    double total = 0.0;
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        size_t ii = ib, ie = BLOCK_END(ib, nn);
+        __m256d acc = _mm256_setzero_pd();
+        for (; ii + 4 <= ie; ii += 4)
+        {
+            acc = _mm256_add_pd(acc, gather_avx2(mA, idx + ii));
+        }
+        total += hsum_avx2(acc) + roi_sum_scalar(mA, idx + ii, ie - ii);
+    }
+    return total;
+}
+
+
+__attribute__((target("avx2,fma")))
+static double roi_diff2_avx2 (const double * mA, const double * mB,
+                              const size_t * idx, size_t nn)
+{
+    double total = 0.0;
+    __m256d df;
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        size_t ii = ib, ie = BLOCK_END(ib, nn);
+        __m256d acc = _mm256_setzero_pd();
+        for (; ii + 4 <= ie; ii += 4)
+        {
+            df  = _mm256_sub_pd(gather_avx2(mA, idx + ii),
+                                gather_avx2(mB, idx + ii));
+            acc = _mm256_fmadd_pd(df, df, acc);
+        }
+        total += hsum_avx2(acc) + roi_diff2_scalar(mA, mB, idx + ii, ie - ii);
+    }
+    return total;
+}
+
+
+__attribute__((target("avx2,fma")))
+static void fit_sums_avx2 (const double * delta, const double * sigma,
+                           double ad, double as, const double * blade,
+                           const double * nominal, double x0, double y0,
+                           size_t nn, double sums[5])
+{
+    double pp[5];
+    __m256d vad = _mm256_set1_pd(ad), vas = _mm256_set1_pd(as);
+    __m256d vx0 = _mm256_set1_pd(x0), vy0 = _mm256_set1_pd(y0);
+    __m256d bb, xx, yy;
+
+    memset(sums, 0, 5 * sizeof(double));
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        size_t ii = ib, ie = BLOCK_END(ib, nn);
+        __m256d sx  = _mm256_setzero_pd(), sxx = _mm256_setzero_pd();
+        __m256d sy  = _mm256_setzero_pd(), sxy = _mm256_setzero_pd();
+        __m256d syy = _mm256_setzero_pd();
+        for (; ii + 4 <= ie; ii += 4)
+        {
+            bb  = _mm256_loadu_pd(blade + ii);
+            xx  = _mm256_div_pd(
+                    _mm256_fmadd_pd(vad, bb, _mm256_loadu_pd(delta + ii)),
+                    _mm256_fmadd_pd(vas, bb, _mm256_loadu_pd(sigma + ii)));
+            xx  = _mm256_sub_pd(xx, vx0);
+            yy  = _mm256_sub_pd(_mm256_loadu_pd(nominal + ii), vy0);
+            sx  = _mm256_add_pd(sx, xx);
+            sxx = _mm256_fmadd_pd(xx, xx, sxx);
+            sy  = _mm256_add_pd(sy, yy);
+            sxy = _mm256_fmadd_pd(xx, yy, sxy);
+            syy = _mm256_fmadd_pd(yy, yy, syy);
+        }
+        pp[0] = hsum_avx2(sx);
+        pp[1] = hsum_avx2(sxx);
+        pp[2] = hsum_avx2(sy);
+        pp[3] = hsum_avx2(sxy);
+        pp[4] = hsum_avx2(syy);
+        fit_sums_tail(delta, sigma, ad, as, blade, nominal, x0, y0,
+                      ii, ie, pp);
+        for (int jj = 0; jj < 5; jj++) sums[jj] += pp[jj];
+    }
+}
+
+
+__attribute__((target("avx2,fma")))
+static void fit_sums_f32_avx2 (const float * delta, const float * sigma,
+                               float ad, float as, const float * blade,
+                               const double * nominal, double x0, double y0,
+                               size_t nn, double sums[5])
+{
+    double pp[5];
+    __m256  vad = _mm256_set1_ps(ad), vas = _mm256_set1_ps(as);
+    __m256d vx0 = _mm256_set1_pd(x0), vy0 = _mm256_set1_pd(y0);
+    __m256  bb, xf;
+    __m256d xx, yy;
+
+    memset(sums, 0, 5 * sizeof(double));
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        size_t ii = ib, ie = BLOCK_END(ib, nn);
+        __m256d sx  = _mm256_setzero_pd(), sxx = _mm256_setzero_pd();
+        __m256d sy  = _mm256_setzero_pd(), sxy = _mm256_setzero_pd();
+        __m256d syy = _mm256_setzero_pd();
+        for (; ii + 8 <= ie; ii += 8)
+        {
+            bb = _mm256_loadu_ps(blade + ii);
+            xf = _mm256_div_ps(
+                    _mm256_fmadd_ps(vad, bb, _mm256_loadu_ps(delta + ii)),
+                    _mm256_fmadd_ps(vas, bb, _mm256_loadu_ps(sigma + ii)));
+
+            xx = _mm256_sub_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(xf)),
+                               vx0);
+            yy = _mm256_sub_pd(_mm256_loadu_pd(nominal + ii), vy0);
+            ACCUMULATE_SUMS(_mm256_add_pd, _mm256_fmadd_pd, xx, yy);
+
+            xx = _mm256_sub_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(xf, 1)),
+                               vx0);
+            yy = _mm256_sub_pd(_mm256_loadu_pd(nominal + ii + 4), vy0);
+            ACCUMULATE_SUMS(_mm256_add_pd, _mm256_fmadd_pd, xx, yy);
+        }
+        pp[0] = hsum_avx2(sx);
+        pp[1] = hsum_avx2(sxx);
+        pp[2] = hsum_avx2(sy);
+        pp[3] = hsum_avx2(sxy);
+        pp[4] = hsum_avx2(syy);
+        fit_sums_f32_tail(delta, sigma, ad, as, blade, nominal, x0, y0,
+                          ii, ie, pp);
+        for (int jj = 0; jj < 5; jj++) sums[jj] += pp[jj];
+    }
+}
+
+
+__attribute__((target("avx2,fma")))
+static void fit_sums_multi_avx2 (const double * delta, const double * sigma,
+                                 const double * const bl[4],
+                                 const double * nominal, const double * x0,
+                                 double y0, size_t nn, const fit_move * mv,
+                                 int mm, double * sums)
+{
+    __m256d vy0 = _mm256_set1_pd(y0);
+    __m256d b0, b1, nu, de, xx, yy;
+
+    memset(sums, 0, 5 * mm * sizeof(double));
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        for (int im = 0; im < mm; im++)
+        {
+            const double * p0 = bl[mv[im].bl[0]], * p1 = bl[mv[im].bl[1]];
+            __m256d ad0 = _mm256_set1_pd(mv[im].ad[0]);
+            __m256d ad1 = _mm256_set1_pd(mv[im].ad[1]);
+            __m256d as0 = _mm256_set1_pd(mv[im].as[0]);
+            __m256d as1 = _mm256_set1_pd(mv[im].as[1]);
+            __m256d vx0 = _mm256_set1_pd(x0[im]);
+            __m256d sx  = _mm256_setzero_pd(), sxx = _mm256_setzero_pd();
+            __m256d sy  = _mm256_setzero_pd(), sxy = _mm256_setzero_pd();
+            __m256d syy = _mm256_setzero_pd();
+            double pp[5];
+            size_t ii = ib, ie = BLOCK_END(ib, nn);
+            for (; ii + 4 <= ie; ii += 4)
+            {
+                b0 = _mm256_loadu_pd(p0 + ii);
+                b1 = _mm256_loadu_pd(p1 + ii);
+                nu = _mm256_fmadd_pd(ad0, b0, _mm256_loadu_pd(delta + ii));
+                de = _mm256_fmadd_pd(as0, b0, _mm256_loadu_pd(sigma + ii));
+                nu = _mm256_fmadd_pd(ad1, b1, nu);
+                de = _mm256_fmadd_pd(as1, b1, de);
+                xx = _mm256_sub_pd(_mm256_div_pd(nu, de), vx0);
+                yy = _mm256_sub_pd(_mm256_loadu_pd(nominal + ii), vy0);
+                ACCUMULATE_SUMS(_mm256_add_pd, _mm256_fmadd_pd, xx, yy);
+            }
+            pp[0] = hsum_avx2(sx);
+            pp[1] = hsum_avx2(sxx);
+            pp[2] = hsum_avx2(sy);
+            pp[3] = hsum_avx2(sxy);
+            pp[4] = hsum_avx2(syy);
+            fit_multi_tail(delta, sigma, p0, p1, &mv[im], nominal,
+                           x0[im], y0, ii, ie, pp);
+            for (int jj = 0; jj < 5; jj++) sums[5 * im + jj] += pp[jj];
+        }
+    }
+}
+
+
+__attribute__((target("avx2,fma")))
+static void fit_sums_multi_f32_avx2 (const float * delta, const float * sigma,
+                                     const float * const bl[4],
+                                     const double * nominal, const double * x0,
+                                     double y0, size_t nn, const fit_move * mv,
+                                     int mm, double * sums)
+{
+    __m256d vy0 = _mm256_set1_pd(y0);
+    __m256 b0, b1, nu, de, xf;
+    __m256d xx, yy;
+    float cf[4];
+
+    memset(sums, 0, 5 * mm * sizeof(double));
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        for (int im = 0; im < mm; im++)
+        {
+            const float * p0 = bl[mv[im].bl[0]], * p1 = bl[mv[im].bl[1]];
+            fit_move_f32(&mv[im], cf);
+            __m256 ad0 = _mm256_set1_ps(cf[0]), ad1 = _mm256_set1_ps(cf[1]);
+            __m256 as0 = _mm256_set1_ps(cf[2]), as1 = _mm256_set1_ps(cf[3]);
+            __m256d vx0 = _mm256_set1_pd(x0[im]);
+            __m256d sx  = _mm256_setzero_pd(), sxx = _mm256_setzero_pd();
+            __m256d sy  = _mm256_setzero_pd(), sxy = _mm256_setzero_pd();
+            __m256d syy = _mm256_setzero_pd();
+            double pp[5];
+            size_t ii = ib, ie = BLOCK_END(ib, nn);
+            for (; ii + 8 <= ie; ii += 8)
+            {
+                b0 = _mm256_loadu_ps(p0 + ii);
+                b1 = _mm256_loadu_ps(p1 + ii);
+                nu = _mm256_fmadd_ps(ad0, b0, _mm256_loadu_ps(delta + ii));
+                de = _mm256_fmadd_ps(as0, b0, _mm256_loadu_ps(sigma + ii));
+                nu = _mm256_fmadd_ps(ad1, b1, nu);
+                de = _mm256_fmadd_ps(as1, b1, de);
+                xf = _mm256_div_ps(nu, de);
+
+                xx = _mm256_sub_pd(
+                        _mm256_cvtps_pd(_mm256_castps256_ps128(xf)), vx0);
+                yy = _mm256_sub_pd(_mm256_loadu_pd(nominal + ii), vy0);
+                ACCUMULATE_SUMS(_mm256_add_pd, _mm256_fmadd_pd, xx, yy);
+
+                xx = _mm256_sub_pd(
+                        _mm256_cvtps_pd(_mm256_extractf128_ps(xf, 1)), vx0);
+                yy = _mm256_sub_pd(_mm256_loadu_pd(nominal + ii + 4), vy0);
+                ACCUMULATE_SUMS(_mm256_add_pd, _mm256_fmadd_pd, xx, yy);
+            }
+            pp[0] = hsum_avx2(sx);
+            pp[1] = hsum_avx2(sxx);
+            pp[2] = hsum_avx2(sy);
+            pp[3] = hsum_avx2(sxy);
+            pp[4] = hsum_avx2(syy);
+            fit_multi_f32_tail(delta, sigma, p0, p1, cf, nominal,
+                               x0[im], y0, ii, ie, pp);
+            for (int jj = 0; jj < 5; jj++) sums[5 * im + jj] += pp[jj];
+        }
+    }
+}
+
+
+__attribute__((target("avx2,fma")))
+static void varpro_sums_avx2 (const double * const bl[4],
+                              const double * nominal, const double * sg,
+                              double y0, size_t nn, double sums[15])
+{
+    __m256d vs[4], vy0 = _mm256_set1_pd(y0), one = _mm256_set1_pd(1.0);
+    __m256d zz[4], acc[15], rs, yy;
+    double pp[15];
+    int jj, ll, kk;
+
+    for (jj = 0; jj < 4; jj++) vs[jj] = _mm256_set1_pd(sg[jj]);
+    memset(sums, 0, 15 * sizeof(double));
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        size_t ii = ib, ie = BLOCK_END(ib, nn);
+        for (jj = 0; jj < 15; jj++) acc[jj] = _mm256_setzero_pd();
+        for (; ii + 4 <= ie; ii += 4)
+        {
+            rs = _mm256_mul_pd(vs[0], _mm256_loadu_pd(bl[0] + ii));
+            for (jj = 1; jj < 4; jj++)
+                rs = _mm256_fmadd_pd(vs[jj], _mm256_loadu_pd(bl[jj] + ii), rs);
+            rs = _mm256_div_pd(one, rs);
+            yy = _mm256_sub_pd(_mm256_loadu_pd(nominal + ii), vy0);
+            for (jj = 0; jj < 4; jj++)
+                zz[jj] = _mm256_mul_pd(_mm256_loadu_pd(bl[jj] + ii), rs);
+            for (jj = 0, kk = 0; jj < 4; jj++)
+            {
+                for (ll = jj; ll < 4; ll++, kk++)
+                    acc[kk] = _mm256_fmadd_pd(zz[jj], zz[ll], acc[kk]);
+            }
+            for (jj = 0; jj < 4; jj++)
+                acc[10 + jj] = _mm256_fmadd_pd(zz[jj], yy, acc[10 + jj]);
+            acc[14] = _mm256_fmadd_pd(yy, yy, acc[14]);
+        }
+        for (jj = 0; jj < 15; jj++) pp[jj] = hsum_avx2(acc[jj]);
+        varpro_tail(bl, nominal, sg, y0, ii, ie, pp);
+        for (jj = 0; jj < 15; jj++) sums[jj] += pp[jj];
+    }
+}
+
+
+/* -------------------------------------------------------------------- */
+/* AVX-512F kernels (8 lanes).                                          */
+/* -------------------------------------------------------------------- */
+
+__attribute__((target("avx512f")))
+static inline __m512d gather_avx512 (const double * mA, const size_t * idx)
+{
+    return _mm512_i64gather_pd(_mm512_loadu_si512((const void *) idx),
+                               mA, 8);
+}
+
+
+__attribute__((target("avx512f")))
+static void raw_positions_avx512 (const double * const bl[4],
+                                  const double * s, double * pos, size_t nn)
+{
+    size_t ii = 0;
+    __m512d b0, b1, b2, b3, dd, ss;
+    for (; ii + 8 <= nn; ii += 8)
+    {
+        b0 = _mm512_loadu_pd(bl[0] + ii);
+        b1 = _mm512_loadu_pd(bl[1] + ii);
+        b2 = _mm512_loadu_pd(bl[2] + ii);
+        b3 = _mm512_loadu_pd(bl[3] + ii);
+        dd = _mm512_mul_pd(_mm512_set1_pd(s[0]), b0);
+        dd = _mm512_fmadd_pd(_mm512_set1_pd(s[1]), b1, dd);
+        dd = _mm512_fmadd_pd(_mm512_set1_pd(s[2]), b2, dd);
+        dd = _mm512_fmadd_pd(_mm512_set1_pd(s[3]), b3, dd);
+        ss = _mm512_mul_pd(_mm512_set1_pd(s[4]), b0);
+        ss = _mm512_fmadd_pd(_mm512_set1_pd(s[5]), b1, ss);
+        ss = _mm512_fmadd_pd(_mm512_set1_pd(s[6]), b2, ss);
+        ss = _mm512_fmadd_pd(_mm512_set1_pd(s[7]), b3, ss);
+        _mm512_storeu_pd(pos + ii, _mm512_div_pd(dd, ss));
+    }
+    const double * tl[4] = {bl[0] + ii, bl[1] + ii, bl[2] + ii, bl[3] + ii};
+    raw_positions_scalar(tl, s, pos + ii, nn - ii);
+}
+
+
+__attribute__((target("avx512f")))
+static double roi_dot_avx512 (const double * mA, const double * mB,
+                              const size_t * idx, size_t nn)
+{
+    double total = 0.0;
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        size_t ii = ib, ie = BLOCK_END(ib, nn);
+        __m512d acc = _mm512_setzero_pd();
+        for (; ii + 8 <= ie; ii += 8)
+        {
+            acc = _mm512_fmadd_pd(gather_avx512(mA, idx + ii),
+                                  gather_avx512(mB, idx + ii), acc);
+        }
+        total += _mm512_reduce_add_pd(acc)
+               + roi_dot_scalar(mA, mB, idx + ii, ie - ii);
+    }
+    return total;
+}
+
+
+__attribute__((target("avx512f")))
+static double roi_sum_avx512 (const double * mA, const size_t * idx,
+                              size_t nn)
+{
+    double total = 0.0;
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        size_t ii = ib, ie = BLOCK_END(ib, nn);
+        __m512d acc = _mm512_setzero_pd();
+        for (; ii + 8 <= ie; ii += 8)
+        {
+            acc = _mm512_add_pd(acc, gather_avx512(mA, idx + ii));
+        }
+        total += _mm512_reduce_add_pd(acc)
+               + roi_sum_scalar(mA, idx + ii, ie - ii);
+    }
+    return total;
+}
+
+
+__attribute__((target("avx512f")))
+static double roi_diff2_avx512 (const double * mA, const double * mB,
+                                const size_t * idx, size_t nn)
+{
+    double total = 0.0;
+    __m512d df;
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        size_t ii = ib, ie = BLOCK_END(ib, nn);
+        __m512d acc = _mm512_setzero_pd();
+        for (; ii + 8 <= ie; ii += 8)
+        {
+            df  = _mm512_sub_pd(gather_avx512(mA, idx + ii),
+                                gather_avx512(mB, idx + ii));
+            acc = _mm512_fmadd_pd(df, df, acc);
+        }
+        total += _mm512_reduce_add_pd(acc)
+               + roi_diff2_scalar(mA, mB, idx + ii, ie - ii);
+    }
+    return total;
+}
+
+
+__attribute__((target("avx512f")))
+static void fit_sums_avx512 (const double * delta, const double * sigma,
+                             double ad, double as, const double * blade,
+                             const double * nominal, double x0, double y0,
+                             size_t nn, double sums[5])
+{
+    double pp[5];
+    __m512d vad = _mm512_set1_pd(ad), vas = _mm512_set1_pd(as);
+    __m512d vx0 = _mm512_set1_pd(x0), vy0 = _mm512_set1_pd(y0);
+    __m512d bb, xx, yy;
+
+    memset(sums, 0, 5 * sizeof(double));
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        size_t ii = ib, ie = BLOCK_END(ib, nn);
+        __m512d sx  = _mm512_setzero_pd(), sxx = _mm512_setzero_pd();
+        __m512d sy  = _mm512_setzero_pd(), sxy = _mm512_setzero_pd();
+        __m512d syy = _mm512_setzero_pd();
+        for (; ii + 8 <= ie; ii += 8)
+        {
+            bb  = _mm512_loadu_pd(blade + ii);
+            xx  = _mm512_div_pd(
+                    _mm512_fmadd_pd(vad, bb, _mm512_loadu_pd(delta + ii)),
+                    _mm512_fmadd_pd(vas, bb, _mm512_loadu_pd(sigma + ii)));
+            xx  = _mm512_sub_pd(xx, vx0);
+            yy  = _mm512_sub_pd(_mm512_loadu_pd(nominal + ii), vy0);
+            sx  = _mm512_add_pd(sx, xx);
+            sxx = _mm512_fmadd_pd(xx, xx, sxx);
+            sy  = _mm512_add_pd(sy, yy);
+            sxy = _mm512_fmadd_pd(xx, yy, sxy);
+            syy = _mm512_fmadd_pd(yy, yy, syy);
+        }
+        pp[0] = _mm512_reduce_add_pd(sx);
+        pp[1] = _mm512_reduce_add_pd(sxx);
+        pp[2] = _mm512_reduce_add_pd(sy);
+        pp[3] = _mm512_reduce_add_pd(sxy);
+        pp[4] = _mm512_reduce_add_pd(syy);
+        fit_sums_tail(delta, sigma, ad, as, blade, nominal, x0, y0,
+                      ii, ie, pp);
+        for (int jj = 0; jj < 5; jj++) sums[jj] += pp[jj];
+    }
+}
+
+__attribute__((target("avx512f")))
+static void fit_sums_f32_avx512 (const float * delta, const float * sigma,
+                                 float ad, float as, const float * blade,
+                                 const double * nominal, double x0, double y0,
+                                 size_t nn, double sums[5])
+{
+    double pp[5];
+    __m512  vad = _mm512_set1_ps(ad), vas = _mm512_set1_ps(as);
+    __m512d vx0 = _mm512_set1_pd(x0), vy0 = _mm512_set1_pd(y0);
+    __m512  bb, xf;
+    __m256  xh;
+    __m512d xx, yy;
+
+    memset(sums, 0, 5 * sizeof(double));
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        size_t ii = ib, ie = BLOCK_END(ib, nn);
+        __m512d sx  = _mm512_setzero_pd(), sxx = _mm512_setzero_pd();
+        __m512d sy  = _mm512_setzero_pd(), sxy = _mm512_setzero_pd();
+        __m512d syy = _mm512_setzero_pd();
+        for (; ii + 16 <= ie; ii += 16)
+        {
+            bb = _mm512_loadu_ps(blade + ii);
+            xf = _mm512_div_ps(
+                    _mm512_fmadd_ps(vad, bb, _mm512_loadu_ps(delta + ii)),
+                    _mm512_fmadd_ps(vas, bb, _mm512_loadu_ps(sigma + ii)));
+
+            xx = _mm512_sub_pd(_mm512_cvtps_pd(_mm512_castps512_ps256(xf)),
+                               vx0);
+            yy = _mm512_sub_pd(_mm512_loadu_pd(nominal + ii), vy0);
+            ACCUMULATE_SUMS(_mm512_add_pd, _mm512_fmadd_pd, xx, yy);
+
+            xh = _mm256_castpd_ps(
+                    _mm512_extractf64x4_pd(_mm512_castps_pd(xf), 1));
+            xx = _mm512_sub_pd(_mm512_cvtps_pd(xh), vx0);
+            yy = _mm512_sub_pd(_mm512_loadu_pd(nominal + ii + 8), vy0);
+            ACCUMULATE_SUMS(_mm512_add_pd, _mm512_fmadd_pd, xx, yy);
+        }
+        pp[0] = _mm512_reduce_add_pd(sx);
+        pp[1] = _mm512_reduce_add_pd(sxx);
+        pp[2] = _mm512_reduce_add_pd(sy);
+        pp[3] = _mm512_reduce_add_pd(sxy);
+        pp[4] = _mm512_reduce_add_pd(syy);
+        fit_sums_f32_tail(delta, sigma, ad, as, blade, nominal, x0, y0,
+                          ii, ie, pp);
+        for (int jj = 0; jj < 5; jj++) sums[jj] += pp[jj];
+    }
+}
+
+
+__attribute__((target("avx512f")))
+static void fit_sums_multi_avx512 (const double * delta, const double * sigma,
+                                   const double * const bl[4],
+                                   const double * nominal, const double * x0,
+                                   double y0, size_t nn, const fit_move * mv,
+                                   int mm, double * sums)
+{
+    __m512d vy0 = _mm512_set1_pd(y0);
+    __m512d b0, b1, nu, de, xx, yy;
+
+    memset(sums, 0, 5 * mm * sizeof(double));
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        for (int im = 0; im < mm; im++)
+        {
+            const double * p0 = bl[mv[im].bl[0]], * p1 = bl[mv[im].bl[1]];
+            __m512d ad0 = _mm512_set1_pd(mv[im].ad[0]);
+            __m512d ad1 = _mm512_set1_pd(mv[im].ad[1]);
+            __m512d as0 = _mm512_set1_pd(mv[im].as[0]);
+            __m512d as1 = _mm512_set1_pd(mv[im].as[1]);
+            __m512d vx0 = _mm512_set1_pd(x0[im]);
+            __m512d sx  = _mm512_setzero_pd(), sxx = _mm512_setzero_pd();
+            __m512d sy  = _mm512_setzero_pd(), sxy = _mm512_setzero_pd();
+            __m512d syy = _mm512_setzero_pd();
+            double pp[5];
+            size_t ii = ib, ie = BLOCK_END(ib, nn);
+            for (; ii + 8 <= ie; ii += 8)
+            {
+                b0 = _mm512_loadu_pd(p0 + ii);
+                b1 = _mm512_loadu_pd(p1 + ii);
+                nu = _mm512_fmadd_pd(ad0, b0, _mm512_loadu_pd(delta + ii));
+                de = _mm512_fmadd_pd(as0, b0, _mm512_loadu_pd(sigma + ii));
+                nu = _mm512_fmadd_pd(ad1, b1, nu);
+                de = _mm512_fmadd_pd(as1, b1, de);
+                xx = _mm512_sub_pd(_mm512_div_pd(nu, de), vx0);
+                yy = _mm512_sub_pd(_mm512_loadu_pd(nominal + ii), vy0);
+                ACCUMULATE_SUMS(_mm512_add_pd, _mm512_fmadd_pd, xx, yy);
+            }
+            pp[0] = _mm512_reduce_add_pd(sx);
+            pp[1] = _mm512_reduce_add_pd(sxx);
+            pp[2] = _mm512_reduce_add_pd(sy);
+            pp[3] = _mm512_reduce_add_pd(sxy);
+            pp[4] = _mm512_reduce_add_pd(syy);
+            fit_multi_tail(delta, sigma, p0, p1, &mv[im], nominal,
+                           x0[im], y0, ii, ie, pp);
+            for (int jj = 0; jj < 5; jj++) sums[5 * im + jj] += pp[jj];
+        }
+    }
+}
+
+
+__attribute__((target("avx512f")))
+static void fit_sums_multi_f32_avx512 (const float * delta,
+                                       const float * sigma,
+                                       const float * const bl[4],
+                                       const double * nominal,
+                                       const double * x0, double y0, size_t nn,
+                                       const fit_move * mv, int mm,
+                                       double * sums)
+{
+    __m512d vy0 = _mm512_set1_pd(y0);
+    __m512 b0, b1, nu, de, xf;
+    __m256 xh;
+    __m512d xx, yy;
+    float cf[4];
+
+    memset(sums, 0, 5 * mm * sizeof(double));
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        for (int im = 0; im < mm; im++)
+        {
+            const float * p0 = bl[mv[im].bl[0]], * p1 = bl[mv[im].bl[1]];
+            fit_move_f32(&mv[im], cf);
+            __m512 ad0 = _mm512_set1_ps(cf[0]);
+            __m512 ad1 = _mm512_set1_ps(cf[1]);
+            __m512 as0 = _mm512_set1_ps(cf[2]);
+            __m512 as1 = _mm512_set1_ps(cf[3]);
+            __m512d vx0 = _mm512_set1_pd(x0[im]);
+            __m512d sx  = _mm512_setzero_pd(), sxx = _mm512_setzero_pd();
+            __m512d sy  = _mm512_setzero_pd(), sxy = _mm512_setzero_pd();
+            __m512d syy = _mm512_setzero_pd();
+            double pp[5];
+            size_t ii = ib, ie = BLOCK_END(ib, nn);
+            for (; ii + 16 <= ie; ii += 16)
+            {
+                b0 = _mm512_loadu_ps(p0 + ii);
+                b1 = _mm512_loadu_ps(p1 + ii);
+                nu = _mm512_fmadd_ps(ad0, b0, _mm512_loadu_ps(delta + ii));
+                de = _mm512_fmadd_ps(as0, b0, _mm512_loadu_ps(sigma + ii));
+                nu = _mm512_fmadd_ps(ad1, b1, nu);
+                de = _mm512_fmadd_ps(as1, b1, de);
+                xf = _mm512_div_ps(nu, de);
+
+                xx = _mm512_sub_pd(
+                        _mm512_cvtps_pd(_mm512_castps512_ps256(xf)), vx0);
+                yy = _mm512_sub_pd(_mm512_loadu_pd(nominal + ii), vy0);
+                ACCUMULATE_SUMS(_mm512_add_pd, _mm512_fmadd_pd, xx, yy);
+
+                xh = _mm256_castpd_ps(
+                        _mm512_extractf64x4_pd(_mm512_castps_pd(xf), 1));
+                xx = _mm512_sub_pd(_mm512_cvtps_pd(xh), vx0);
+                yy = _mm512_sub_pd(_mm512_loadu_pd(nominal + ii + 8), vy0);
+                ACCUMULATE_SUMS(_mm512_add_pd, _mm512_fmadd_pd, xx, yy);
+            }
+            pp[0] = _mm512_reduce_add_pd(sx);
+            pp[1] = _mm512_reduce_add_pd(sxx);
+            pp[2] = _mm512_reduce_add_pd(sy);
+            pp[3] = _mm512_reduce_add_pd(sxy);
+            pp[4] = _mm512_reduce_add_pd(syy);
+            fit_multi_f32_tail(delta, sigma, p0, p1, cf, nominal,
+                               x0[im], y0, ii, ie, pp);
+            for (int jj = 0; jj < 5; jj++) sums[5 * im + jj] += pp[jj];
+        }
+    }
+}
+
+
+__attribute__((target("avx512f")))
+static void varpro_sums_avx512 (const double * const bl[4],
+                                const double * nominal, const double * sg,
+                                double y0, size_t nn, double sums[15])
+{
+    __m512d vs[4], vy0 = _mm512_set1_pd(y0), one = _mm512_set1_pd(1.0);
+    __m512d zz[4], acc[15], rs, yy;
+    double pp[15];
+    int jj, ll, kk;
+
+    for (jj = 0; jj < 4; jj++) vs[jj] = _mm512_set1_pd(sg[jj]);
+    memset(sums, 0, 15 * sizeof(double));
+    for (size_t ib = 0; ib < nn; ib += SIMD_BLOCK)
+    {
+        size_t ii = ib, ie = BLOCK_END(ib, nn);
+        for (jj = 0; jj < 15; jj++) acc[jj] = _mm512_setzero_pd();
+        for (; ii + 8 <= ie; ii += 8)
+        {
+            rs = _mm512_mul_pd(vs[0], _mm512_loadu_pd(bl[0] + ii));
+            for (jj = 1; jj < 4; jj++)
+                rs = _mm512_fmadd_pd(vs[jj], _mm512_loadu_pd(bl[jj] + ii), rs);
+            rs = _mm512_div_pd(one, rs);
+            yy = _mm512_sub_pd(_mm512_loadu_pd(nominal + ii), vy0);
+            for (jj = 0; jj < 4; jj++)
+                zz[jj] = _mm512_mul_pd(_mm512_loadu_pd(bl[jj] + ii), rs);
+            for (jj = 0, kk = 0; jj < 4; jj++)
+            {
+                for (ll = jj; ll < 4; ll++, kk++)
+                    acc[kk] = _mm512_fmadd_pd(zz[jj], zz[ll], acc[kk]);
+            }
+            for (jj = 0; jj < 4; jj++)
+                acc[10 + jj] = _mm512_fmadd_pd(zz[jj], yy, acc[10 + jj]);
+            acc[14] = _mm512_fmadd_pd(yy, yy, acc[14]);
+        }
+        for (jj = 0; jj < 15; jj++) pp[jj] = _mm512_reduce_add_pd(acc[jj]);
+        varpro_tail(bl, nominal, sg, y0, ii, ie, pp);
+        for (jj = 0; jj < 15; jj++) sums[jj] += pp[jj];
+    }
+}
+
+#endif /* SIMD_X86 */
+
+
+/* -------------------------------------------------------------------- */
+/* Dispatch.                                                            */
+/* -------------------------------------------------------------------- */
+
+static const simd_kernels kernels_scalar = {
+    "scalar", SIMD_SCALAR,
+    raw_positions_scalar, roi_dot_scalar, roi_sum_scalar,
+    roi_diff2_scalar, fit_sums_scalar, fit_sums_f32_scalar,
+    fit_sums_multi_scalar, fit_sums_multi_f32_scalar,
+    varpro_sums_scalar
+};
+
+#ifdef SIMD_X86
+static const simd_kernels kernels_sse2 = {
+    "sse2", SIMD_SSE2,
+    raw_positions_sse2, roi_dot_sse2, roi_sum_sse2,
+    roi_diff2_sse2, fit_sums_sse2, fit_sums_f32_sse2,
+    fit_sums_multi_sse2, fit_sums_multi_f32_sse2,
+    varpro_sums_sse2
+};
+
+static const simd_kernels kernels_avx2 = {
+    "avx2", SIMD_AVX2,
+    raw_positions_avx2, roi_dot_avx2, roi_sum_avx2,
+    roi_diff2_avx2, fit_sums_avx2, fit_sums_f32_avx2,
+    fit_sums_multi_avx2, fit_sums_multi_f32_avx2,
+    varpro_sums_avx2
+};
+
+static const simd_kernels kernels_avx512 = {
+    "avx512", SIMD_AVX512,
+    raw_positions_avx512, roi_dot_avx512, roi_sum_avx512,
+    roi_diff2_avx512, fit_sums_avx512, fit_sums_f32_avx512,
+    fit_sums_multi_avx512, fit_sums_multi_f32_avx512,
+    varpro_sums_avx512
+};
+#endif
+
+simd_kernels simd = {
+    "scalar", SIMD_SCALAR,
+    raw_positions_scalar, roi_dot_scalar, roi_sum_scalar,
+    roi_diff2_scalar, fit_sums_scalar, fit_sums_f32_scalar,
+    fit_sums_multi_scalar, fit_sums_multi_f32_scalar,
+    varpro_sums_scalar
+};
+
+
+/* Highest kernel level supported by the running CPU.
+ */
+static int simd_level_supported (void)
+{
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2") &&
+        __builtin_cpu_supports("fma"))     return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2"))    return SIMD_SSE2;
+#endif
+    return SIMD_SCALAR;
+}
+
+
+/* Select the kernels for the requested level, limited to the level the
+ * CPU supports. SIMD_AUTO chooses the best supported one.
+ */
+const char * simd_kernels_init (int level)
+{
+    int best = simd_level_supported();
+    if (level == SIMD_AUTO || level > best) level = best;
+
+    switch (level)
+    {
+#ifdef SIMD_X86
+    case SIMD_AVX512: simd = kernels_avx512; break;
+    case SIMD_AVX2:   simd = kernels_avx2;   break;
+    case SIMD_SSE2:   simd = kernels_sse2;   break;
+#endif
+    default:          simd = kernels_scalar; break;
+    }
+    return simd.name;
+}
+
+
+/* Level of the kernels named name; -2 if there is no such set.
+ */
+int simd_level_by_name (const char * name)
+{
+    if (strcmp(name, "auto")   == 0) return SIMD_AUTO;
+    if (strcmp(name, "scalar") == 0) return SIMD_SCALAR;
+    if (strcmp(name, "sse2")   == 0) return SIMD_SSE2;
+    if (strcmp(name, "avx2")   == 0) return SIMD_AVX2;
+    if (strcmp(name, "avx512") == 0) return SIMD_AVX512;
+    return -2;
+}
@@ -0,0 +1,104 @@
+/* Header for the vector kernels used in xbpm-randmat.
+ * Implementations live in simd_kernels.c
+ */
+#ifndef SIMD_KERNELS
+#define SIMD_KERNELS
+
+#include <stddef.h>
+
+/* Instruction set levels of the kernels. */
+#define SIMD_AUTO     -1
+#define SIMD_SCALAR    0
+#define SIMD_SSE2      1
+#define SIMD_AVX2      2
+#define SIMD_AVX512    3
+
+/* Candidate change of the delta and sigma terms, by ad[k] * blade and
+ * as[k] * blade of blades bl[k], k = 0, 1: a move of one or two elements
+ * of the half suppression matrix (unused ones have ad = as = 0).
+ */
+typedef struct
+{
+    int bl[2];
+    double ad[2], as[2];
+} fit_move;
+
+/* Table of kernels of one instruction set level. Indexed (roi_*) kernels
+ * take the sites' indices idx; the others run over contiguous arrays.
+ * Reductions are blocked: partial sums of each block of sites are added
+ * up to the totals, which keeps the rounding error growth low.
+ */
+typedef struct
+{
+    const char * name;
+    int level;
+
+    /* pos = (s[0:4] . blades) / (s[4:8] . blades), for nn sites. */
+    void   (*raw_positions)(const double * const blades[4],
+                            const double * supmat, double * pos, size_t nn);
+
+    /* Sum of mA[idx] * mB[idx]. */
+    double (*roi_dot)(const double * mA, const double * mB,
+                      const size_t * idx, size_t nn);
+
+    /* Sum of mA[idx]. */
+    double (*roi_sum)(const double * mA, const size_t * idx, size_t nn);
+
+    /* Sum of (mA[idx] - mB[idx])^2. */
+    double (*roi_diff2)(const double * mA, const double * mB,
+                        const size_t * idx, size_t nn);
+
+    /* Regression sums Sx, Sxx, Sy, Sxy, Syy of the positions
+     * x = (delta + ad * blade) / (sigma + as * blade) - x0 against
+     * y = nominal - y0, for nn contiguous sites. */
+    void   (*fit_sums)(const double * delta, const double * sigma,
+                       double ad, double as, const double * blade,
+                       const double * nominal, double x0, double y0,
+                       size_t nn, double sums[5]);
+
+    /* Same, with single precision terms and blade; positions are
+     * calculated in single precision and accumulated in double. */
+    void   (*fit_sums_f32)(const float * delta, const float * sigma,
+                           float ad, float as, const float * blade,
+                           const double * nominal, double x0, double y0,
+                           size_t nn, double sums[5]);
+
+    /* Regression sums (5 per candidate, into sums[5 * m]) of mm candidate
+     * moves mv in one pass: the sites are taken by blocks, each block
+     * evaluated for all candidates while in cache. Candidate m positions
+     * are shifted by x0[m]. */
+    void   (*fit_sums_multi)(const double * delta, const double * sigma,
+                             const double * const blades[4],
+                             const double * nominal, const double * x0,
+                             double y0, size_t nn,
+                             const fit_move * mv, int mm, double * sums);
+
+    /* Same, with single precision terms and blades. */
+    void   (*fit_sums_multi_f32)(const float * delta, const float * sigma,
+                                 const float * const blades[4],
+                                 const double * nominal, const double * x0,
+                                 double y0, size_t nn,
+                                 const fit_move * mv, int mm, double * sums);
+
+    /* Variable projection sums of nn sites for the sigma row sg, with
+     * z = blades / (sg . blades) and y = nominal - y0: the upper triangle
+     * of z z^T by rows (sums[0:10]), z y (sums[10:14]) and y y. */
+    void   (*varpro_sums)(const double * const blades[4],
+                          const double * nominal, const double * sg,
+                          double y0, size_t nn, double sums[15]);
+} simd_kernels;
+
+/* Kernels in use. Scalar until simd_kernels_init is called. */
+extern simd_kernels simd;
+
+/* Select the kernels for the requested level, or the best level supported
+ * by the CPU if level is SIMD_AUTO. Returns the name of the chosen set.
+ */
+const char * simd_kernels_init(int level);
+
+/* Level corresponding to a name (auto, scalar, sse2, avx2, avx512), or
+ * -2 if unknown.
+ */
+int simd_level_by_name(const char * name);
+
+#endif
@@ -0,0 +1,158 @@
+#define _GNU_SOURCE
+#include "thread_team.h"
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Worker's arguments. */
+typedef struct
+{
+    thread_team * team;
+    int tid;
+} team_worker;
+
+
+/* Number of online processors (at least 1).
+ */
+int team_cores (void)
+{
+    long ncores = sysconf(_SC_NPROCESSORS_ONLN);
+    return (ncores > 0) ? (int) ncores : 1;
+}
+
+
+/* Seconds from a monotonic clock.
+ */
+double clock_seconds (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + 1.0e-9 * (double) ts.tv_nsec;
+}
+
+
+/* Worker loop: wait for a task, run it, signal its end.
+ */
+static void * team_worker_loop (void * arg)
+{
+    team_worker * tw = (team_worker *) arg;
+    thread_team * team = tw->team;
+    int tid = tw->tid;
+    free(tw);
+
+    while (1)
+    {
+        pthread_barrier_wait(&team->start);
+        if (team->quit) break;
+        team->task(team->arg, tid, team->nthreads);
+        pthread_barrier_wait(&team->done);
+    }
+    return NULL;
+}
+
+
+/* Create a team of nthreads threads; the calling thread is thread 0 and
+ * nthreads - 1 workers are started.
+ */
+thread_team * team_create (int nthreads)
+{
+    if (nthreads < 1) nthreads = 1;
+
+    thread_team * team = calloc(1, sizeof(thread_team));
+    if (team != NULL)
+    {
+        team->threads = calloc(nthreads, sizeof(pthread_t));
+    }
+    if (team == NULL || team->threads == NULL)
+    {
+        printf(" ERROR (team_create): could not allocate memory"
+               " for thread team. Aborting.\n");
+        exit(-1);
+    }
+    team->nthreads = nthreads;
+    team->quit = 0;
+    pthread_barrier_init(&team->start, NULL, nthreads);
+    pthread_barrier_init(&team->done,  NULL, nthreads);
+
+    for (int tid = 1; tid < nthreads; tid++)
+    {
+        team_worker * tw = malloc(sizeof(team_worker));
+        if (tw == NULL)
+        {
+            printf(" ERROR (team_create): could not allocate memory"
+                   " for thread team. Aborting.\n");
+            exit(-1);
+        }
+        tw->team = team;
+        tw->tid  = tid;
+        if (pthread_create(&team->threads[tid], NULL,
+                           team_worker_loop, tw) != 0)
+        {
+            printf(" ERROR (team_create): could not create"
+                   " thread. Aborting.\n");
+            exit(-1);
+        }
+    }
+    return team;
+}
+
+
+/* Run task on all threads of the team, the caller included, and return
+ * when all of them are done.
+ */
+void team_run (thread_team * team, team_task task, void * arg)
+{
+    team->task = task;
+    team->arg  = arg;
+    if (team->nthreads > 1) pthread_barrier_wait(&team->start);
+    task(arg, 0, team->nthreads);
+    if (team->nthreads > 1) pthread_barrier_wait(&team->done);
+}
+
+
+/* Pin the calling thread to processor first_cpu + tid (modulo the
+ * number of processors). Failure only costs locality, thus it is not
+ * fatal.
+ */
+static void team_pin_task (void * arg, int tid, int nthreads)
+{
+    int first_cpu = *(int *) arg;
+    cpu_set_t cpus;
+    (void) nthreads;
+
+    CPU_ZERO(&cpus);
+    CPU_SET((first_cpu + tid) % team_cores(), &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                               &cpus) != 0)
+    {
+        printf(" WARNING (team_pin): could not pin thread %d.\n", tid);
+    }
+}
+
+
+/* Pin each thread of the team to its own processor, from first_cpu on.
+ */
+void team_pin (thread_team * team, int first_cpu)
+{
+    team_run(team, team_pin_task, &first_cpu);
+}
+
+
+/* Stop the team's workers and free up its memory.
+ */
+void team_destroy (thread_team * team)
+{
+    if (team == NULL) return;
+    team->quit = 1;
+    if (team->nthreads > 1) pthread_barrier_wait(&team->start);
+    for (int tid = 1; tid < team->nthreads; tid++)
+    {
+        pthread_join(team->threads[tid], NULL);
+    }
+    pthread_barrier_destroy(&team->start);
+    pthread_barrier_destroy(&team->done);
+    free(team->threads);
+    free(team);
+}
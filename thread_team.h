@@ -0,0 +1,46 @@
+/* Header for the persistent thread team used in xbpm-randmat.
+ * Implementations live in thread_team.c
+ */
+#ifndef THREAD_TEAM
+#define THREAD_TEAM
+
+#include <pthread.h>
+
+/* Task run by every thread of a team: tid is the thread index, from 0
+ * (the calling thread) to nthreads - 1.
+ */
+typedef void (*team_task)(void * arg, int tid, int nthreads);
+
+/* Team of threads kept alive between tasks, waiting on a barrier.
+ */
+typedef struct thread_team
+{
+    int nthreads;               /* Number of threads, caller included. */
+    pthread_t * threads;        /* Worker threads (nthreads - 1).      */
+    pthread_barrier_t start;    /* Release of workers for a task.      */
+    pthread_barrier_t done;     /* End of a task.                      */
+    team_task task;             /* Current task and its argument.      */
+    void * arg;
+    int quit;                   /* Workers must return.                */
+} thread_team;
+
+/* Number of online processors. */
+int team_cores(void);
+
+/* Seconds from a monotonic clock, for timings and time limits. */
+double clock_seconds(void);
+
+/* Create a team of nthreads threads (the caller is thread 0). */
+thread_team * team_create(int nthreads);
+
+/* Pin thread tid of the team to processor (first_cpu + tid) modulo the
+ * number of processors; must be called by the team's thread 0. */
+void team_pin(thread_team * team, int first_cpu);
+
+/* Run task on all threads of the team and wait for all of them. */
+void team_run(thread_team * team, team_task task, void * arg);
+
+/* Stop the team's workers and free it up. */
+void team_destroy(thread_team * team);
+
+#endif